@@ -0,0 +1,297 @@
+#include "benchmark.h"
+#include "vulkanwindow.h"
+#include "renderer.h"
+#include "utilities.h"
+#include "matrixkernels.h"
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMatrix4x4>
+#include <QSysInfo>
+#include <algorithm>
+#include <cstring>
+
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+// The camera path of a run: turn and walk forward for the first half, then
+// the exact same steps backwards.
+static const float PATH_YAW_STEP = 0.3f;
+static const float PATH_WALK_STEP = 0.05f;
+
+static const struct {
+    const char *name;
+    bool useLogo;
+    bool mixed;
+} SCENES[] = {
+    { "block", false, false },
+    { "qt_logo", true, false },
+    { "mixed", false, true }
+};
+static const int SCENE_COUNT = sizeof(SCENES) / sizeof(SCENES[0]);
+
+// Resident set size, -1 where there is no cheap way to get it.
+static qint64 residentBytes()
+{
+#ifdef Q_OS_LINUX
+    QFile f(QStringLiteral("/proc/self/statm"));
+    if (f.open(QIODevice::ReadOnly)) {
+        const QList<QByteArray> fields = f.readAll().split(' ');
+        if (fields.size() > 1)
+            return fields[1].toLongLong() * sysconf(_SC_PAGESIZE);
+    }
+#endif
+    return -1;
+}
+
+Benchmark::Benchmark(VulkanWindow *w, const Options &options)
+    : mWindow(w),
+      mOptions(options)
+{
+}
+
+void Benchmark::start()
+{
+    mWindow->setRandomSeed(mOptions.seed);
+    mWindow->setFrameCallback([this] { frame(); });
+}
+
+void Benchmark::frame()
+{
+    if (mDone)
+        return;
+    // The renderer only exists once the first frame is on its way.
+    if (!mStarted) {
+        mStarted = true;
+        startRun();
+        return;
+    }
+
+    switch (mPhase) {
+    case Phase::Loading:
+        // Wait until all instances made it to the GPU, uploads are spread over several frames.
+        if (mWindow->instanceBytesUsed() == qint64(mInstCount) * PER_INSTANCE_DATA_SIZE) {
+            mPhase = Phase::Warmup;
+            mFrame = 0;
+        }
+        break;
+    case Phase::Warmup:
+        if (++mFrame >= mOptions.warmupFrames) {
+            mWindow->renderer()->profiler()->clear();
+            mPhase = Phase::Measuring;
+            mFrame = 0;
+            mFrameTimes.clear();
+            mFrameTimer.start();
+            moveCamera(mFrame);
+        }
+        break;
+    case Phase::Measuring:
+        mFrameTimes.append(mFrameTimer.nsecsElapsed() / 1000000.0);
+        mFrameTimer.start();
+        if (++mFrame < mOptions.measuredFrames)
+            moveCamera(mFrame);
+        else
+            finishRun();
+        break;
+    }
+}
+
+void Benchmark::startRun()
+{
+    // The renderer would not take more, and the loading would never finish.
+    if (mInstCount > sweepMaxInstances()) {
+        qWarning("Benchmark: the device holds at most %d instances, not %d", sweepMaxInstances(), mInstCount);
+        mInstCount = sweepMaxInstances();
+    }
+    qDebug("Benchmark: %s with %d instances", SCENES[mScene].name, mInstCount);
+    mWindow->meshSwitched(SCENES[mScene].useLogo);
+    mWindow->mixedMeshesSwitched(SCENES[mScene].mixed);
+    mWindow->depthPrepassSwitched(mOptions.depthPrepass);
+    mWindow->lightCountChanged(mOptions.lightCount);
+    mWindow->adaptiveResolutionSwitched(mOptions.adaptiveResolution);
+    mWindow->occlusionCullingSwitched(mOptions.occlusionCulling);
+    mWindow->setInstanceCount(mInstCount);
+    mPhase = Phase::Loading;
+    mFrame = 0;
+}
+
+int Benchmark::sweepMaxInstances() const
+{
+    return qMin(mOptions.maxInstances, mWindow->maxInstanceCount());
+}
+
+// Only the step for the given frame, the camera input is applied in order.
+void Benchmark::moveCamera(int frame)
+{
+    const int half = mOptions.measuredFrames / 2;
+    if (frame < half) {
+        mWindow->renderer()->yaw(PATH_YAW_STEP);
+        mWindow->renderer()->walk(PATH_WALK_STEP);
+    } else if (frame < half * 2) {
+        mWindow->renderer()->walk(-PATH_WALK_STEP);
+        mWindow->renderer()->yaw(-PATH_YAW_STEP);
+    }
+}
+
+void Benchmark::finishRun()
+{
+    QList<double> sorted = mFrameTimes;
+    std::sort(sorted.begin(), sorted.end());
+    double sum = 0;
+    for (double v : std::as_const(sorted))
+        sum += v;
+    auto percentile = [&sorted](double p) {
+        return sorted[qBound(0, int(p * (sorted.size() - 1) + 0.5), int(sorted.size()) - 1)];
+    };
+
+    QJsonObject frameMs;
+    frameMs[QLatin1String("avg")] = sum / sorted.size();
+    frameMs[QLatin1String("p50")] = percentile(0.50);
+    frameMs[QLatin1String("p95")] = percentile(0.95);
+    frameMs[QLatin1String("p99")] = percentile(0.99);
+
+    const Profiler *profiler = mWindow->renderer()->profiler();
+    QJsonObject timers;
+    for (int t = 0; t < Profiler::TimerCount; ++t) {
+        const Profiler::Stats st = profiler->stats(Profiler::Timer(t));
+        if (!st.samples)
+            continue;
+        QJsonObject timer;
+        timer[QLatin1String("avg")] = st.avg;
+        timer[QLatin1String("p50")] = st.p50;
+        timer[QLatin1String("p95")] = st.p95;
+        timer[QLatin1String("p99")] = st.p99;
+        timers[QLatin1String(Profiler::timerName(Profiler::Timer(t)))] = timer;
+    }
+
+    QJsonObject run;
+    run[QLatin1String("mesh")] = QLatin1String(SCENES[mScene].name);
+    run[QLatin1String("instances")] = mInstCount;
+    run[QLatin1String("fps")] = sum > 0 ? 1000.0 * sorted.size() / sum : 0.0;
+    run[QLatin1String("frameMs")] = frameMs;
+    run[QLatin1String("timersMs")] = timers;
+    run[QLatin1String("renderScale")] = mWindow->renderScale();
+    run[QLatin1String("residentBytes")] = residentBytes();
+    run[QLatin1String("instanceBytesAllocated")] = mWindow->instanceBytesAllocated();
+    mRuns.append(run);
+
+    if (mInstCount * 2 <= sweepMaxInstances()) {
+        mInstCount *= 2;
+    } else if (mScene + 1 < SCENE_COUNT) {
+        ++mScene;
+        mInstCount = 128;
+    } else {
+        writeResults();
+        return;
+    }
+    startRun();
+}
+
+// Matrices like the frame's: a perspective projection times a view, and the
+// normal matrix of a mesh's model. Every iteration changes the input a
+// little so that nothing can be hoisted out of the loop.
+void Benchmark::runMatrixKernels(int iterations)
+{
+    QMatrix4x4 proj;
+    proj.perspective(45.0f, 16.0f / 9.0f, 0.01f, 1000.0f);
+    QMatrix4x4 view;
+    view.rotate(12.0f, 1, 0, 0);
+    view.rotate(30.0f, 0, 1, 0);
+    view.translate(-1.0f, 2.0f, -20.0f);
+    QMatrix4x4 model;
+    model.rotate(90.0f, 1, 0, 0);
+    model.scale(1.2f, 0.8f, 1.5f);
+
+    volatile float sink = 0.0f;
+    QElapsedTimer timer;
+    auto nsPerIteration = [&timer, iterations] { return timer.nsecsElapsed() / double(iterations); };
+
+    timer.start();
+    for (int i = 0; i < iterations; ++i) {
+        view(0, 3) = float(i & 1023) * 0.001f;
+        const QMatrix4x4 vp = proj * view;
+        sink = sink + vp(2, 3);
+    }
+    const double qtMultiply = nsPerIteration();
+
+    timer.start();
+    for (int i = 0; i < iterations; ++i) {
+        view(0, 3) = float(i & 1023) * 0.001f;
+        float vp[16];
+        multiplyMatrix4(vp, proj.constData(), view.constData());
+        sink = sink + vp[14];
+    }
+    const double kernelMultiply = nsPerIteration();
+
+    // Both the way buildDrawCallsForItems() used to write the normal matrix,
+    // and the kernel writing std140 directly.
+    uint8_t uni[48];
+    timer.start();
+    for (int i = 0; i < iterations; ++i) {
+        model(0, 0) = 1.2f + float(i & 1023) * 0.0001f;
+        const QMatrix3x3 n = model.normalMatrix();
+        const float *np = n.constData();
+        memcpy(uni, np, 12);
+        memcpy(uni + 16, np + 3, 12);
+        memcpy(uni + 32, np + 6, 12);
+        sink = sink + uni[5];
+    }
+    const double qtNormal = nsPerIteration();
+
+    timer.start();
+    for (int i = 0; i < iterations; ++i) {
+        model(0, 0) = 1.2f + float(i & 1023) * 0.0001f;
+        normalMatrixStd140(reinterpret_cast<float *>(uni), model.constData());
+        sink = sink + uni[5];
+    }
+    const double kernelNormal = nsPerIteration();
+
+    // And that they agree.
+    float maxError = 0.0f;
+    float vp[16];
+    multiplyMatrix4(vp, proj.constData(), view.constData());
+    const QMatrix4x4 qtVp = proj * view;
+    for (int i = 0; i < 16; ++i)
+        maxError = qMax(maxError, qAbs(vp[i] - qtVp.constData()[i]));
+    float normal[12];
+    normalMatrixStd140(normal, model.constData());
+    const QMatrix3x3 qtNormalMatrix = model.normalMatrix();
+    for (int c = 0; c < 3; ++c) {
+        for (int r = 0; r < 3; ++r)
+            maxError = qMax(maxError, qAbs(normal[c * 4 + r] - qtNormalMatrix.constData()[c * 3 + r]));
+    }
+
+    qDebug("Matrix kernels, %d iterations:", iterations);
+    qDebug("  view-projection: QMatrix4x4 %.1f ns, kernel %.1f ns", qtMultiply, kernelMultiply);
+    qDebug("  std140 normal matrix: QMatrix4x4 %.1f ns, kernel %.1f ns", qtNormal, kernelNormal);
+    qDebug("  largest difference %g", double(maxError));
+}
+
+void Benchmark::writeResults()
+{
+    mDone = true;
+
+    QJsonObject root;
+    root[QLatin1String("device")] = QLatin1String(mWindow->physicalDeviceProperties()->deviceName);
+    root[QLatin1String("os")] = QSysInfo::prettyProductName();
+    root[QLatin1String("seed")] = qint64(mOptions.seed);
+    root[QLatin1String("depthPrepass")] = mOptions.depthPrepass;
+    root[QLatin1String("lights")] = mOptions.lightCount;
+    root[QLatin1String("adaptiveResolution")] = mOptions.adaptiveResolution;
+    root[QLatin1String("occlusionCulling")] = mOptions.occlusionCulling;
+    root[QLatin1String("warmupFrames")] = mOptions.warmupFrames;
+    root[QLatin1String("measuredFrames")] = mOptions.measuredFrames;
+    root[QLatin1String("maxInstances")] = sweepMaxInstances();
+    root[QLatin1String("runs")] = mRuns;
+
+    QFile f(mOptions.outputFile);
+    if (!f.open(QIODevice::WriteOnly) || f.write(QJsonDocument(root).toJson()) < 0) {
+        qWarning("Failed to write benchmark results to %s", qPrintable(mOptions.outputFile));
+        QCoreApplication::exit(1);
+        return;
+    }
+    qDebug("Benchmark results written to %s", qPrintable(mOptions.outputFile));
+    QCoreApplication::quit();
+}
@@ -0,0 +1,65 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QString>
+#include <QList>
+#include <QJsonArray>
+#include <QElapsedTimer>
+#include "utilities.h"
+
+class VulkanWindow;
+
+// Drives the window through a fixed sweep without anyone at the controls:
+// for the block, the Qt logo and then both mixed, the instance count doubles
+// from 128 up to maxInstances. Each run warms up, then measures while the camera
+// follows the same path every time, ending where it started. The results
+// go to a JSON file and the application quits when done.
+class Benchmark
+{
+public:
+    struct Options {
+        QString outputFile{QStringLiteral("benchmark.json")};
+        int maxInstances{131072};
+        int warmupFrames{60};
+        int measuredFrames{300};
+        quint32 seed{1};
+        bool depthPrepass{false};
+        int lightCount{DEFAULT_LIGHT_COUNT};
+        bool adaptiveResolution{false};
+        bool occlusionCulling{true};
+    };
+
+    Benchmark(VulkanWindow *w, const Options &options);
+
+    // Call before the window is shown.
+    void start();
+
+    // Times the matrix kernels against QMatrix4x4 for the per-frame uniforms
+    // and prints the results, no window needed.
+    static void runMatrixKernels(int iterations);
+
+private:
+    enum class Phase { Loading, Warmup, Measuring };
+
+    void frame();
+    void startRun();
+    void moveCamera(int frame);
+    void finishRun();
+    void writeResults();
+    int sweepMaxInstances() const;
+
+    VulkanWindow *mWindow;
+    Options mOptions;
+
+    bool mStarted{false};
+    bool mDone{false};
+    int mScene{0}; // index into the scenes in benchmark.cpp
+    int mInstCount{128};
+    Phase mPhase{Phase::Loading};
+    int mFrame{0};
+    QElapsedTimer mFrameTimer;
+    QList<double> mFrameTimes;
+    QJsonArray mRuns;
+};
+
+#endif
@@ -4,19 +4,46 @@ layout(location = 0) in vec3 vECVertNormal;
 layout(location = 1) in vec3 vECVertPos;
 layout(location = 2) flat in vec3 vDiffuseAdjust;   //flat qualifier to avoid interpolation
 
+// Specialization constants, see createItemPipeline(). Each combination of
+// the switches is a pipeline of its own, so the branches on them are gone
+// once compiled. The material is gray and never changes.
+layout(constant_id = 0) const bool SPECULAR = true;
+layout(constant_id = 1) const bool POINT_LIGHTS = true;
+layout(constant_id = 2) const float KA = 0.05;
+layout(constant_id = 3) const float KD = 0.7;
+layout(constant_id = 4) const float KS = 0.66;
+layout(constant_id = 5) const float SPECULAR_EXP = 150.0;
+
 layout(std140, binding = 1) uniform buf {
     vec3 ECCameraPosition;
-    vec3 ka;
-    vec3 kd;
-    vec3 ks;
-    // Have one light only for now.
+    // The main light, the point lights come from the clusters.
     vec3 ECLightPosition;
     vec3 attenuation;
     vec3 color;
     float intensity;
-    float specularExp;
+    vec4 viewDepth;     // the view matrix row giving -depth
+    vec4 cluster;       // 1 / tile size in pixels, then the slice scale and bias for the log of the depth
 } ubuf;
 
+const int CLUSTER_X = 16;
+const int CLUSTER_Y = 9;
+const int CLUSTER_Z = 24;
+const int MAX_LIGHTS_PER_CLUSTER = 63;
+
+// See lightcull.comp.
+struct Light {
+    vec4 posRadius;
+    vec4 color;
+};
+
+layout(std430, binding = 2) readonly buffer LightBuf {
+    Light data[];
+} lights;
+
+layout(std430, binding = 3) readonly buffer ClusterBuf {
+    uint data[];
+} clusters;
+
 layout(location = 0) out vec4 fragColor;
 
 void main()
@@ -30,10 +57,40 @@ void main()
     float NL = max(0.0, dot(N, L));
     vec3 dColor = att * ubuf.intensity * ubuf.color * NL;
 
-    vec3 R = reflect(-L, N);
-    vec3 V = normalize(ubuf.ECCameraPosition - vECVertPos);
-    float RV = max(0.0, dot(R, V));
-    vec3 sColor = att * ubuf.intensity * ubuf.color * pow(RV, ubuf.specularExp);
+    vec3 V = vec3(0.0);
+    vec3 sColor = vec3(0.0);
+    if (SPECULAR) {
+        V = normalize(ubuf.ECCameraPosition - vECVertPos);
+        float RV = max(0.0, dot(reflect(-L, N), V));
+        sColor = att * ubuf.intensity * ubuf.color * pow(RV, SPECULAR_EXP);
+    }
+
+    // Only the point lights binned into this fragment's cluster, however many there are in total.
+    if (POINT_LIGHTS) {
+        float depth = -(dot(ubuf.viewDepth.xyz, vECVertPos) + ubuf.viewDepth.w);
+        uvec2 tile = min(uvec2(gl_FragCoord.xy * ubuf.cluster.xy), uvec2(CLUSTER_X - 1, CLUSTER_Y - 1));
+        uint slice = uint(clamp(log(max(depth, 1.0e-4)) * ubuf.cluster.z + ubuf.cluster.w, 0.0, float(CLUSTER_Z - 1)));
+        uint base = ((slice * CLUSTER_Y + tile.y) * CLUSTER_X + tile.x) * (MAX_LIGHTS_PER_CLUSTER + 1);
+        uint count = clusters.data[base];
+        for (uint i = 0; i < count; ++i) {
+            Light light = lights.data[clusters.data[base + 1 + i]];
+            vec3 toLight = light.posRadius.xyz - vECVertPos;
+            float d2 = dot(toLight, toLight);
+            float r2 = light.posRadius.w * light.posRadius.w;
+            if (d2 >= r2)
+                continue;
+            // Falls off to exactly 0 at the radius, so the light can be left out beyond it.
+            float window = 1.0 - d2 / r2;
+            float lightAtt = window * window / (1.0 + d2);
+            vec3 lightL = toLight * inversesqrt(d2);
+            dColor += lightAtt * light.color.rgb * max(0.0, dot(N, lightL));
+            if (SPECULAR)
+                sColor += lightAtt * light.color.rgb * pow(max(0.0, dot(reflect(-lightL, N), V)), SPECULAR_EXP);
+        }
+    }
 
-    fragColor = vec4(ubuf.ka + (ubuf.kd + vDiffuseAdjust) * dColor + ubuf.ks * sColor, 1.0);
+    vec3 result = KA + (KD + vDiffuseAdjust) * dColor;
+    if (SPECULAR)
+        result += KS * sColor;
+    fragColor = vec4(result, 1.0);
 }
@@ -1,33 +1,58 @@
 #version 440
 
+// Position relative to the aabb of the mesh, model includes the scale back.
+// The normal is octahedral encoded.
 layout(location = 0) in vec4 position;
-layout(location = 1) in vec3 normal;
+layout(location = 1) in vec2 packedNormal;
 
 // Instanced attributes to variate the translation of the model and the diffuse
-// color of the material.
+// color of the material, and which mesh the instance is. Then its rotation,
+// a quaternion kept up to date by animate.comp, and its scale.
 layout(location = 2) in vec3 instTranslate;
 layout(location = 3) in vec3 instDiffuseAdjust;
+layout(location = 4) in uint instMesh;
+layout(location = 5) in vec4 instRotation;
+layout(location = 6) in float instScale;
 
 out gl_PerVertex { vec4 gl_Position; };
+invariant gl_Position; // must match depth_prepass.vert to the bit
 
 layout(location = 0) out vec3 vECVertNormal;
 layout(location = 1) out vec3 vECVertPos;
 layout(location = 2) flat out vec3 vDiffuseAdjust; //flat == same value for all vertices of the triangle
 
-layout(std140, binding = 0) uniform buf {
-    mat4 vp;
+const int MESH_COUNT = 2;
+const float MAX_SCALE = 2.0; // INSTANCE_MAX_SCALE
+
+struct MeshTransform {
     mat4 model;
     mat3 modelNormal;
+};
+
+layout(std140, binding = 0) uniform buf {
+    mat4 vp;
+    MeshTransform meshes[MESH_COUNT];
 } ubuf;
 
+vec3 decodeNormal(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
+vec3 rotate(vec4 q, vec3 v)
+{
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
 void main()
 {
-    vECVertNormal = normalize(ubuf.modelNormal * normal);
-    mat4 t = mat4(1, 0, 0, 0,
-                  0, 1, 0, 0,
-                  0, 0, 1, 0,
-                  instTranslate.x, instTranslate.y, instTranslate.z, 1);
-    vECVertPos = vec3(t * ubuf.model * position);
+    // The scale is uniform, so the normal only needs the rotation.
+    vECVertNormal = normalize(rotate(instRotation, ubuf.meshes[instMesh].modelNormal * decodeNormal(packedNormal)));
+    vec3 modelPos = vec3(ubuf.meshes[instMesh].model * position);
+    vECVertPos = instTranslate + instScale * MAX_SCALE * rotate(instRotation, modelPos);
     vDiffuseAdjust = instDiffuseAdjust;
-    gl_Position = ubuf.vp * t * ubuf.model * position;
+    gl_Position = ubuf.vp * vec4(vECVertPos, 1.0);
 }
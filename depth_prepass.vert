@@ -0,0 +1,38 @@
+#version 440
+
+// The depth-only pass in front of color_phong.vert. Takes the same vertex and
+// instance input and has to come up with exactly the same position, the
+// shading pass tests for equal depth.
+layout(location = 0) in vec4 position;
+layout(location = 2) in vec3 instTranslate;
+layout(location = 4) in uint instMesh;
+layout(location = 5) in vec4 instRotation;
+layout(location = 6) in float instScale;
+
+out gl_PerVertex { vec4 gl_Position; };
+invariant gl_Position;
+
+const int MESH_COUNT = 2;
+const float MAX_SCALE = 2.0; // INSTANCE_MAX_SCALE
+
+struct MeshTransform {
+    mat4 model;
+    mat3 modelNormal;
+};
+
+layout(std140, binding = 0) uniform buf {
+    mat4 vp;
+    MeshTransform meshes[MESH_COUNT];
+} ubuf;
+
+vec3 rotate(vec4 q, vec3 v)
+{
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+void main()
+{
+    vec3 modelPos = vec3(ubuf.meshes[instMesh].model * position);
+    vec3 worldPos = instTranslate + instScale * MAX_SCALE * rotate(instRotation, modelPos);
+    gl_Position = ubuf.vp * vec4(worldPos, 1.0);
+}
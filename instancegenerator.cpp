@@ -0,0 +1,217 @@
+#include "instancegenerator.h"
+#include "utilities.h"
+#include <QList>
+#include <QVector3D>
+#include <QtConcurrentMap>
+#include <QtMath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define INSTANCEGENERATOR_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#define INSTANCEGENERATOR_NEON
+#include <arm_neon.h>
+#endif
+
+// The random values of an instance, each uniform in its range.
+enum Field {
+    TranslateX,
+    TranslateY,
+    TranslateZ,
+    DiffuseR,
+    DiffuseG,
+    DiffuseB,
+    SpinX,
+    SpinY,
+    SpinZ,
+    Angle,
+    Scale,
+    FieldCount
+};
+
+// Keys are instance * FIELD_STRIDE + field.
+static const quint32 FIELD_STRIDE = 16;
+
+static const struct {
+    float lo;
+    float hi;
+} FIELD_RANGES[FieldCount] = {
+    { -5.0f, 5.0f },
+    { -4.0f, 6.0f },
+    { -30.0f, 5.0f },
+    // Adjustments to the diffuse color (default is 0.7).
+    { -0.6f, 0.3f },
+    { -0.6f, 0.3f },
+    { -0.6f, 0.3f },
+    // Turned into -127..127 when packing.
+    { 0.0f, 1.0f },
+    { 0.0f, 1.0f },
+    { 0.0f, 1.0f },
+    { 0.0f, float(2 * M_PI) },
+    { 0.6f, 1.4f }
+};
+
+// Instances per block of values, a multiple of the SIMD width.
+static const int BLOCK_SIZE = 256;
+// Instances per task when a batch is spread over the threads, and how many
+// tasks it takes to be worth it.
+static const int PARALLEL_BATCH = 16384;
+static const int PARALLEL_MIN_BATCHES = 4;
+
+// From the top 24 bits, so that every value is exact in a float.
+static const float UNIT_SCALE = 1.0f / 16777216.0f;
+
+// lowbias32 by Chris Wellons, a good enough mix for two multiplies.
+static inline quint32 hash(quint32 x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+#if defined(INSTANCEGENERATOR_SSE2)
+// There is no 32 bit multiply in SSE2, only one giving 64 bit results for
+// lanes 0 and 2.
+static inline __m128i mullo32(__m128i a, __m128i b)
+{
+    const __m128i even = _mm_mul_epu32(a, b);
+    const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline __m128i hash4(__m128i x)
+{
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    x = mullo32(x, _mm_set1_epi32(0x7feb352d));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+    x = mullo32(x, _mm_set1_epi32(int(0x846ca68bu)));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    return x;
+}
+#elif defined(INSTANCEGENERATOR_NEON)
+static inline uint32x4_t hash4(uint32x4_t x)
+{
+    x = veorq_u32(x, vshrq_n_u32(x, 16));
+    x = vmulq_u32(x, vdupq_n_u32(0x7feb352du));
+    x = veorq_u32(x, vshrq_n_u32(x, 15));
+    x = vmulq_u32(x, vdupq_n_u32(0x846ca68bu));
+    x = veorq_u32(x, vshrq_n_u32(x, 16));
+    return x;
+}
+#endif
+
+// BLOCK_SIZE values of one field for consecutive instances, the first one
+// with the given key.
+static void fillField(float *dst, quint32 key, quint32 seedKey, float lo, float hi)
+{
+#if defined(INSTANCEGENERATOR_SSE2)
+    const __m128i seed = _mm_set1_epi32(int(seedKey));
+    const __m128i step = _mm_set1_epi32(int(4 * FIELD_STRIDE));
+    const __m128 unit = _mm_set1_ps(UNIT_SCALE);
+    const __m128 base = _mm_set1_ps(lo);
+    const __m128 range = _mm_set1_ps(hi - lo);
+    __m128i keys = _mm_add_epi32(_mm_set1_epi32(int(key)),
+                                 _mm_setr_epi32(0, int(FIELD_STRIDE), int(2 * FIELD_STRIDE), int(3 * FIELD_STRIDE)));
+    for (int i = 0; i < BLOCK_SIZE; i += 4) {
+        const __m128i h = hash4(_mm_xor_si128(keys, seed));
+        const __m128 u = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(h, 8)), unit);
+        _mm_store_ps(dst + i, _mm_add_ps(base, _mm_mul_ps(u, range)));
+        keys = _mm_add_epi32(keys, step);
+    }
+#elif defined(INSTANCEGENERATOR_NEON)
+    const uint32x4_t seed = vdupq_n_u32(seedKey);
+    const uint32x4_t step = vdupq_n_u32(4 * FIELD_STRIDE);
+    const float32x4_t base = vdupq_n_f32(lo);
+    const float32x4_t range = vdupq_n_f32(hi - lo);
+    const quint32 lanes[] = { 0, FIELD_STRIDE, 2 * FIELD_STRIDE, 3 * FIELD_STRIDE };
+    uint32x4_t keys = vaddq_u32(vdupq_n_u32(key), vld1q_u32(lanes));
+    for (int i = 0; i < BLOCK_SIZE; i += 4) {
+        const uint32x4_t h = hash4(veorq_u32(keys, seed));
+        const float32x4_t u = vmulq_n_f32(vcvtq_f32_u32(vshrq_n_u32(h, 8)), UNIT_SCALE);
+        vst1q_f32(dst + i, vaddq_f32(base, vmulq_f32(u, range)));
+        keys = vaddq_u32(keys, step);
+    }
+#else
+    for (int i = 0; i < BLOCK_SIZE; ++i) {
+        const float u = float(hash((key + quint32(i) * FIELD_STRIDE) ^ seedKey) >> 8) * UNIT_SCALE;
+        dst[i] = lo + u * (hi - lo);
+    }
+#endif
+}
+
+// Same as decodeDirection() in animate.comp.
+static QVector3D decodeDirection(float ex, float ey)
+{
+    QVector3D n(ex, ey, 1.0f - std::abs(ex) - std::abs(ey));
+    const float t = qMax(-n.z(), 0.0f);
+    n.setX(n.x() + (n.x() >= 0.0f ? -t : t));
+    n.setY(n.y() + (n.y() >= 0.0f ? -t : t));
+    return n.normalized();
+}
+
+InstanceGenerator::InstanceGenerator(quint32 seed)
+    : mSeedKey(hash(seed ^ 0x85ebca6bu))
+{
+}
+
+void InstanceGenerator::generate(char *dst, int first, int count, quint8 mesh, int meshCycle) const
+{
+    if (count < PARALLEL_BATCH * PARALLEL_MIN_BATCHES) {
+        generateRange(dst, first, count, mesh, meshCycle);
+        return;
+    }
+
+    // Blocking from a pool thread is fine, Qt lets another thread take its place.
+    QList<int> starts;
+    for (int s = 0; s < count; s += PARALLEL_BATCH)
+        starts.append(s);
+    QtConcurrent::blockingMap(starts, [=](const int &s) {
+        generateRange(dst + s * PER_INSTANCE_DATA_SIZE, first + s, qMin(PARALLEL_BATCH, count - s), mesh, meshCycle);
+    });
+}
+
+void InstanceGenerator::generateRange(char *dst, int first, int count, quint8 mesh, int meshCycle) const
+{
+    alignas(16) float values[FieldCount][BLOCK_SIZE];
+    char *p = dst;
+    for (int b = 0; b < count; b += BLOCK_SIZE) {
+        const quint32 key = quint32(first + b) * FIELD_STRIDE;
+        for (int f = 0; f < FieldCount; ++f)
+            fillField(values[f], key + quint32(f), mSeedKey, FIELD_RANGES[f].lo, FIELD_RANGES[f].hi);
+
+        const int n = qMin(BLOCK_SIZE, count - b);
+        for (int j = 0; j < n; ++j) {
+            const int i = first + b + j;
+            const float t[] = { values[TranslateX][j], values[TranslateY][j], values[TranslateZ][j] };
+            memcpy(p, t, 12);
+            // 8 bit snorm, -0.6..0.3 does not need more than that.
+            // The last byte is the mesh.
+            const qint8 d[] = { qint8(qRound(values[DiffuseR][j] * 127)), qint8(qRound(values[DiffuseG][j] * 127)),
+                                qint8(qRound(values[DiffuseB][j] * 127)),
+                                qint8(meshCycle > 1 ? i % meshCycle : mesh) };
+            memcpy(p + 12, d, 4);
+            // animate.comp advances the angle and keeps the rotation up to
+            // date, the one here is for the frames before it first runs.
+            const qint8 spin[] = { qint8(qMin(int(values[SpinX][j] * 255), 254) - 127),
+                                   qint8(qMin(int(values[SpinY][j] * 255), 254) - 127),
+                                   qint8(qMin(int(values[SpinZ][j] * 255), 254) - 127) };
+            const float angle = values[Angle][j];
+            const QVector3D axis = decodeDirection(spin[0] / 127.0f, spin[1] / 127.0f) * std::sin(angle * 0.5f);
+            const float q[] = { axis.x(), axis.y(), axis.z(), std::cos(angle * 0.5f) };
+            qint16 rotation[4];
+            for (int c = 0; c < 4; ++c)
+                rotation[c] = qint16(qRound(q[c] * 32767));
+            const quint8 scale = quint8(qRound(values[Scale][j] / INSTANCE_MAX_SCALE * 255));
+            memcpy(p + 16, rotation, 8);
+            memcpy(p + 24, spin, 3);
+            memcpy(p + 27, &scale, 1);
+            memcpy(p + 28, &angle, 4);
+            p += PER_INSTANCE_DATA_SIZE;
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef INSTANCEGENERATOR_H
+#define INSTANCEGENERATOR_H
+
+#include <QtGlobal>
+
+// Makes the random instances, PER_INSTANCE_DATA_SIZE bytes each in the
+// layout of the instance buffer. There is no generator state: every value is
+// a hash of the seed, the instance index and which value it is, so a range of
+// instances comes out the same no matter how the batches were split, in what
+// order or on which thread they were made.
+//
+// The values are made a block of instances at a time, one array per value,
+// with SSE2 or NEON where there is one. Then they are interleaved into the
+// instance layout, together with the starting rotation that needs a sine and
+// a cosine per instance. Large batches are spread over the global thread pool.
+class InstanceGenerator
+{
+public:
+    explicit InstanceGenerator(quint32 seed);
+
+    // Writes instances [first, first + count) to dst, which is where the
+    // first of them goes. Their mesh is mesh, or with a meshCycle above 1, the
+    // instance index modulo meshCycle.
+    void generate(char *dst, int first, int count, quint8 mesh, int meshCycle) const;
+
+private:
+    void generateRange(char *dst, int first, int count, quint8 mesh, int meshCycle) const;
+
+    quint32 mSeedKey;
+};
+
+#endif
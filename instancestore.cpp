@@ -0,0 +1,322 @@
+#include "instancestore.h"
+#include "vulkanwindow.h"
+#include "transferqueue.h"
+#include "utilities.h"
+
+void InstanceStore::init(VulkanWindow *w, QVulkanDeviceFunctions *devFuncs, MemoryAllocator *allocator,
+                         TransferQueue *transfer)
+{
+    mWindow = w;
+    mDeviceFunctions = devFuncs;
+    mAllocator = allocator;
+    mTransfer = transfer;
+}
+
+//Everything on the GPU side is gone afterwards, the next update() uploads all instances again.
+void InstanceStore::releaseResources()
+{
+    for (Retired &r : mRetired)
+        mAllocator->destroyBuffer(&r.buf, &r.alloc);
+    mRetired.clear();
+
+    mAllocator->destroyBuffer(&mBuf, &mBufAlloc);
+    releaseStagingRing(&mRing);
+    releaseStagingRing(&mTransferRing);
+    mTransfers.clear();
+
+    mCapacity = 0;
+    mDrawableCount = 0;
+    mUploadedEnd = 0;
+    mTransferHoldFrames = 0;
+    mDirtyBegin = mDirtyEnd = 0;
+    mAllocatedBytes = 0;
+    for (quint64 &frameEnd : mRingFrameEnd)
+        frameEnd = 0;
+}
+
+VkDeviceSize InstanceStore::bytesUsed() const
+{
+    return VkDeviceSize(mDrawableCount) * PER_INSTANCE_DATA_SIZE;
+}
+
+void InstanceStore::markDirty(int first, int count)
+{
+    if (count <= 0)
+        return;
+
+    if (mDirtyBegin == mDirtyEnd) {
+        mDirtyBegin = first;
+        mDirtyEnd = first + count;
+    } else {
+        mDirtyBegin = qMin(mDirtyBegin, first);
+        mDirtyEnd = qMax(mDirtyEnd, first + count);
+    }
+}
+
+void InstanceStore::clear()
+{
+    cancelTransfers(0);
+    mDirtyBegin = mDirtyEnd = 0;
+}
+
+void InstanceStore::update(VkCommandBuffer cb, const QByteArray &instData, int instCount)
+{
+    releaseRetired();
+    ensureStagingRing(&mRing, "instance staging");
+
+    // Whatever the frame that last used this slot staged is consumed by now.
+    const int frame = mWindow->currentFrame();
+    mRing.tail = qMax(mRing.tail, mRingFrameEnd[frame]);
+
+    if (mTransfer->isActive()) {
+        completeTransfers();
+        if (instCount < mUploadedEnd)
+            cancelTransfers(instCount);
+        if (mTransferHoldFrames == 0) {
+            updateOnTransferQueue(cb, instData, instCount);
+            mRingFrameEnd[frame] = mRing.head;
+            return;
+        }
+        --mTransferHoldFrames;
+    }
+
+    if (!mBuf || instCount > mCapacity)
+        grow(cb, instCount, mDrawableCount);
+
+    // The instances have been removed from the end, nothing to upload for them.
+    mDrawableCount = qMin(mDrawableCount, instCount);
+    mDirtyEnd = qMin(mDirtyEnd, instCount);
+    if (mDirtyBegin >= mDirtyEnd)
+        mDirtyBegin = mDirtyEnd = 0;
+
+    markDirty(mDrawableCount, instCount - mDrawableCount);
+
+    // The rest stays dirty for the next frame.
+    if (mDirtyBegin < mDirtyEnd) {
+        const int uploaded = uploadRange(cb, &mRing, instData, mDirtyBegin, mDirtyEnd);
+        if (mDirtyBegin <= mDrawableCount)
+            mDrawableCount = qMax(mDrawableCount, uploaded);
+        mDirtyBegin = uploaded;
+    }
+    if (mDirtyBegin >= mDirtyEnd)
+        mDirtyBegin = mDirtyEnd = 0;
+
+    mUploadedEnd = mDrawableCount;
+    mRingFrameEnd[frame] = mRing.head;
+}
+
+void InstanceStore::updateOnTransferQueue(VkCommandBuffer cb, const QByteArray &instData, int instCount)
+{
+    ensureStagingRing(&mTransferRing, "instance transfer staging");
+
+    if (!mBuf || instCount > mCapacity) {
+        // The copy reads what the transfers in flight write.
+        if (mUploadedEnd > mDrawableCount)
+            mTransfer->requireGraphicsWait(mTransfer->lastSubmitted());
+        grow(cb, instCount, mUploadedEnd);
+    }
+
+    // Rewrites of drawable instances go with the frame, the graphics queue
+    // waited for their transfers already. Instances still in flight stay
+    // dirty until they are drawable, those not uploaded at all are new.
+    // After growing, the rewrites land in the copied range, grow() orders
+    // them after the copy. The transfer below only writes past the copy, so
+    // the two queues never write the same instances.
+    mDirtyEnd = qMin(mDirtyEnd, mUploadedEnd);
+    const int rewriteEnd = qMin(mDirtyEnd, mDrawableCount);
+    if (mDirtyBegin < rewriteEnd)
+        mDirtyBegin = uploadRange(cb, &mRing, instData, mDirtyBegin, rewriteEnd);
+    if (mDirtyBegin >= mDirtyEnd)
+        mDirtyBegin = mDirtyEnd = 0;
+
+    // New instances, as many as the ring has room for. The ring positions
+    // are multiples of the record size, so room for anything is room for one.
+    if (mUploadedEnd < instCount && mTransferRing.head - mTransferRing.tail < INSTANCE_STAGING_RING_SIZE) {
+        VkCommandBuffer transferCb = mTransfer->begin();
+        mUploadedEnd = uploadRange(transferCb, &mTransferRing, instData, mUploadedEnd, instCount);
+        mTransfers.append({ mUploadedEnd, mTransferRing.head, mTransfer->submit(transferCb), mEpoch });
+    }
+}
+
+void InstanceStore::completeTransfers()
+{
+    if (mTransfers.isEmpty())
+        return;
+
+    const quint64 completed = mTransfer->completed();
+    while (!mTransfers.isEmpty() && mTransfers.first().value <= completed) {
+        const Transfer t = mTransfers.takeFirst();
+        mTransferRing.tail = t.ringEnd;
+        if (t.epoch == mEpoch && t.end > mDrawableCount) {
+            mDrawableCount = qMin(t.end, mUploadedEnd);
+            // Done already, but waiting is what makes the writes visible to the frame.
+            mTransfer->requireGraphicsWait(t.value);
+        }
+    }
+}
+
+// For when the instances from instCount on are gone. The transfers in flight
+// must not make anything drawable any more, and the graphics queue waits
+// for them before the next frame, so that what it uploads lands after them.
+void InstanceStore::cancelTransfers(int instCount)
+{
+    mDrawableCount = qMin(mDrawableCount, instCount);
+    mUploadedEnd = qMin(mUploadedEnd, instCount);
+    if (!mTransfer || !mTransfer->isActive())
+        return;
+
+    ++mEpoch;
+    mTransferHoldFrames = mWindow->concurrentFrameCount();
+    mTransfer->requireGraphicsWait(mTransfer->lastSubmitted());
+}
+
+void InstanceStore::ensureStagingRing(StagingRing *ring, const char *what)
+{
+    if (ring->buf)
+        return;
+
+    ring->buf = mAllocator->createBuffer(INSTANCE_STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                         MemoryAllocator::HostVisible, &ring->alloc, what);
+}
+
+void InstanceStore::releaseStagingRing(StagingRing *ring)
+{
+    mAllocator->destroyBuffer(&ring->buf, &ring->alloc);
+    ring->head = ring->tail = 0;
+}
+
+bool InstanceStore::allocateStaging(StagingRing *ring, VkDeviceSize size, VkDeviceSize *offset)
+{
+    const VkDeviceSize pos = ring->head % INSTANCE_STAGING_RING_SIZE;
+    if (pos + size > INSTANCE_STAGING_RING_SIZE || ring->head + size - ring->tail > INSTANCE_STAGING_RING_SIZE)
+        return false;
+
+    *offset = pos;
+    ring->head += size;
+    return true;
+}
+
+// Uploads from first on as long as the ring has room, returns where it stopped.
+int InstanceStore::uploadRange(VkCommandBuffer cb, StagingRing *ring, const QByteArray &instData, int first, int end)
+{
+    while (first < end) {
+        const VkDeviceSize ringFree = INSTANCE_STAGING_RING_SIZE - (ring->head - ring->tail);
+        const VkDeviceSize untilWrap = INSTANCE_STAGING_RING_SIZE - ring->head % INSTANCE_STAGING_RING_SIZE;
+        const int count = qMin<VkDeviceSize>(end - first, qMin(ringFree, untilWrap) / PER_INSTANCE_DATA_SIZE);
+        if (count == 0) {
+            if (untilWrap < ringFree) {
+                // Too close to the end of the ring to fit a single instance, continue from the start.
+                ring->head += untilWrap;
+                continue;
+            }
+            break;
+        }
+
+        VkDeviceSize stagingOffset;
+        if (!allocateStaging(ring, count * PER_INSTANCE_DATA_SIZE, &stagingOffset))
+            break;
+        upload(cb, *ring, instData, first, count, stagingOffset);
+        first += count;
+    }
+    return first;
+}
+
+void InstanceStore::grow(VkCommandBuffer cb, int instCount, int copyCount)
+{
+    if (instCount > mMaxCapacity)
+        qFatal("%d instances do not fit into the largest instance store of %d", instCount, mMaxCapacity);
+    qint64 newCapacity = qMax(mCapacity, INITIAL_INSTANCE_CAPACITY);
+    while (newCapacity < instCount)
+        newCapacity *= 2;
+    newCapacity = qMin<qint64>(newCapacity, mMaxCapacity);
+
+    if (DBG)
+        qDebug("Growing instance store from %d to %lld instances", mCapacity, newCapacity);
+
+    // Written by both queues when there is a transfer queue, ranges never overlap.
+    QList<uint32_t> queueFamilies;
+    if (mTransfer->isActive())
+        queueFamilies = { mWindow->graphicsQueueFamilyIndex(), mTransfer->familyIndex() };
+
+    MemoryAllocator::Allocation newAlloc;
+    // Storage for the culling pass, transfer for the uploads and for copying into the next, bigger buffer.
+    VkBuffer newBuf = mAllocator->createBuffer(newCapacity * PER_INSTANCE_DATA_SIZE,
+                                               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                               MemoryAllocator::DeviceLocal, &newAlloc, "instance", queueFamilies);
+
+    if (mBuf) {
+        if (copyCount) {
+            // Earlier frames wrote the old contents with transfers.
+            VkMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                                   0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+            VkBufferCopy region{};
+            region.size = VkDeviceSize(copyCount) * PER_INSTANCE_DATA_SIZE;
+            mDeviceFunctions->vkCmdCopyBuffer(cb, mBuf, newBuf, 1, &region);
+
+            // The dirty instances uploaded right after may be in the copied
+            // range, their fresh data must land after the stale copy.
+            VkBufferMemoryBarrier bufferBarrier{};
+            bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+            bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            bufferBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            bufferBarrier.buffer = newBuf;
+            bufferBarrier.size = region.size;
+            mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                                   0, 0, nullptr, 1, &bufferBarrier, 0, nullptr);
+        }
+        retire(mBuf, mBufAlloc);
+    }
+
+    mBuf = newBuf;
+    mBufAlloc = newAlloc;
+    mCapacity = int(newCapacity);
+    mAllocatedBytes = newAlloc.size;
+    ++mGeneration;
+
+    if (DBG)
+        mAllocator->dump();
+}
+
+void InstanceStore::upload(VkCommandBuffer cb, const StagingRing &ring, const QByteArray &instData, int first, int count,
+                           VkDeviceSize stagingOffset)
+{
+    const VkDeviceSize offset = VkDeviceSize(first) * PER_INSTANCE_DATA_SIZE;
+    const VkDeviceSize size = VkDeviceSize(count) * PER_INSTANCE_DATA_SIZE;
+
+    if (DBG)
+        qDebug("Uploading instances %d..%d", first, first + count - 1);
+
+    memcpy(ring.alloc.mapped + stagingOffset, instData.constData() + offset, size);
+    mAllocator->flush(ring.alloc, stagingOffset, size);
+
+    VkBufferCopy region{};
+    region.srcOffset = stagingOffset;
+    region.dstOffset = offset;
+    region.size = size;
+    mDeviceFunctions->vkCmdCopyBuffer(cb, ring.buf, mBuf, 1, &region);
+}
+
+//The frames currently in flight may still use it, so destroy only once they are all done.
+void InstanceStore::retire(VkBuffer buf, const MemoryAllocator::Allocation &alloc)
+{
+    mRetired.append({ buf, alloc, mWindow->concurrentFrameCount() });
+}
+
+void InstanceStore::releaseRetired()
+{
+    for (auto it = mRetired.begin(); it != mRetired.end(); ) {
+        if (--it->framesLeft <= 0) {
+            mAllocator->destroyBuffer(&it->buf, &it->alloc);
+            it = mRetired.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef INSTANCESTORE_H
+#define INSTANCESTORE_H
+
+#include <QVulkanWindow>
+#include <QVulkanFunctions>
+#include <QByteArray>
+#include <QList>
+#include <climits>
+#include "memoryallocator.h"
+
+class VulkanWindow;
+class TransferQueue;
+
+// The per-instance data on the GPU, in device local memory. Grows by
+// reallocating to twice the capacity, with the old contents copied over on
+// the GPU. The CPU side copy is owned by the renderer.
+//
+// Only dirty instances are uploaded, through a staging ring shared by the
+// frames in flight. What does not fit into the ring in one frame is uploaded
+// in the following ones, drawableCount() tells how many are on the GPU.
+//
+// With an active transfer queue, instances added at the end go through a
+// ring of their own on that queue instead, and become drawable once the
+// render thread sees the transfer has completed, a frame or two later.
+// Rewrites of instances that are drawable stay in the frame's commands.
+class InstanceStore
+{
+public:
+    void init(VulkanWindow *w, QVulkanDeviceFunctions *devFuncs, MemoryAllocator *allocator,
+              TransferQueue *transfer);
+    void releaseResources();
+
+    // The capacity never grows past this, update() must not be asked for more.
+    void setMaxCapacity(int maxCapacity) { mMaxCapacity = maxCapacity; }
+
+    // Records the commands to grow the buffer and upload instances that are
+    // not on the GPU yet or were marked dirty. Call once per frame, outside
+    // the render pass.
+    void update(VkCommandBuffer cb, const QByteArray &instData, int instCount);
+
+    // For instances that were changed after they had been uploaded.
+    void markDirty(int first, int count);
+    // For when all instances were replaced, none of them are drawn until
+    // they have been uploaded again. Keeps the buffer.
+    void clear();
+
+    // The leading instances the GPU has valid data for.
+    int drawableCount() const { return mDrawableCount; }
+
+    VkBuffer buffer() const { return mBuf; }
+    int capacity() const { return mCapacity; }
+    VkDeviceSize bytesUsed() const;
+    VkDeviceSize bytesAllocated() const { return mAllocatedBytes; }
+
+    // Changes whenever buffer() does, so descriptor sets know to update.
+    uint32_t generation() const { return mGeneration; }
+
+private:
+    struct Retired {
+        VkBuffer buf;
+        MemoryAllocator::Allocation alloc;
+        int framesLeft;
+    };
+
+    // Positions only ever increase, the actual offset is modulo
+    // INSTANCE_STAGING_RING_SIZE. Everything before tail is free again.
+    struct StagingRing {
+        VkBuffer buf{VK_NULL_HANDLE};
+        MemoryAllocator::Allocation alloc; // mapped for as long as the ring exists
+        quint64 head{0};
+        quint64 tail{0};
+    };
+
+    // A submission to the transfer queue, for the instances up to end.
+    struct Transfer {
+        int end;
+        quint64 ringEnd;
+        quint64 value;
+        quint32 epoch;
+    };
+
+    void updateOnTransferQueue(VkCommandBuffer cb, const QByteArray &instData, int instCount);
+    void completeTransfers();
+    void cancelTransfers(int instCount);
+    void grow(VkCommandBuffer cb, int instCount, int copyCount);
+    void ensureStagingRing(StagingRing *ring, const char *what);
+    void releaseStagingRing(StagingRing *ring);
+    bool allocateStaging(StagingRing *ring, VkDeviceSize size, VkDeviceSize *offset);
+    int uploadRange(VkCommandBuffer cb, StagingRing *ring, const QByteArray &instData, int first, int end);
+    void upload(VkCommandBuffer cb, const StagingRing &ring, const QByteArray &instData, int first, int count,
+                VkDeviceSize stagingOffset);
+    void retire(VkBuffer buf, const MemoryAllocator::Allocation &alloc);
+    void releaseRetired();
+
+    VulkanWindow *mWindow{nullptr};
+    QVulkanDeviceFunctions *mDeviceFunctions{nullptr};
+    MemoryAllocator *mAllocator{nullptr};
+    TransferQueue *mTransfer{nullptr};
+
+    VkBuffer mBuf{VK_NULL_HANDLE};
+    MemoryAllocator::Allocation mBufAlloc;
+    int mCapacity{0};
+    int mMaxCapacity{INT_MAX};
+    int mDrawableCount{0};
+    int mDirtyBegin{0};
+    int mDirtyEnd{0};
+    VkDeviceSize mAllocatedBytes{0};
+    uint32_t mGeneration{0};
+
+    StagingRing mRing;
+    quint64 mRingFrameEnd[QVulkanWindow::MAX_CONCURRENT_FRAME_COUNT]{};
+
+    // Everything before mUploadedEnd is on the GPU or on its way there on
+    // the transfer queue. Transfers of an older epoch were cancelled by
+    // removing instances, they only free their part of the ring. For a few
+    // frames after that, everything goes through the frame's commands again,
+    // until no frame in flight reads what the transfers would overwrite.
+    StagingRing mTransferRing;
+    QList<Transfer> mTransfers;
+    int mUploadedEnd{0};
+    quint32 mEpoch{0};
+    int mTransferHoldFrames{0};
+
+    // Buffers that frames still in flight may read from.
+    QList<Retired> mRetired;
+};
+
+#endif
@@ -2,15 +2,77 @@
 // SPDX-License-Identifier: LicenseRef-Qt-Commercial OR BSD-3-Clause
 
 #include <QApplication>
+#include <QCommandLineParser>
 #include <QLoggingCategory>
 #include "mainwindow.h"
 #include "vulkanwindow.h"
+#include "benchmark.h"
+#include "mesh.h"
 
 int main(int argc, char **argv)
 {
     QApplication app(argc, argv);
 
-	qputenv("QT_VK_DEBUG", "1"); // Set the environment variable programmatically to enable Vulkan debugging
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption benchmarkOption(QStringLiteral("benchmark"),
+                                       QStringLiteral("Run the instance count sweep unattended, write the results and quit."));
+    QCommandLineOption outputOption(QStringLiteral("benchmark-output"),
+                                    QStringLiteral("JSON file for the benchmark results."),
+                                    QStringLiteral("file"), QStringLiteral("benchmark.json"));
+    QCommandLineOption maxInstancesOption(QStringLiteral("benchmark-max-instances"),
+                                          QStringLiteral("Largest instance count of the sweep."),
+                                          QStringLiteral("count"), QStringLiteral("131072"));
+    QCommandLineOption framesOption(QStringLiteral("benchmark-frames"),
+                                    QStringLiteral("Measured frames per instance count."),
+                                    QStringLiteral("count"), QStringLiteral("300"));
+    QCommandLineOption warmupFramesOption(QStringLiteral("warmup-frames"),
+                                          QStringLiteral("Frames rendered before measuring each instance count."),
+                                          QStringLiteral("count"), QString::number(Benchmark::Options().warmupFrames));
+    QCommandLineOption seedOption(QStringLiteral("seed"),
+                                  QStringLiteral("Seed for the instance data, the benchmark defaults to 1."),
+                                  QStringLiteral("seed"));
+    QCommandLineOption depthPrepassOption(QStringLiteral("benchmark-depth-prepass"),
+                                          QStringLiteral("Draw the items with the depth pre-pass during the benchmark."));
+    QCommandLineOption lightsOption(QStringLiteral("benchmark-lights"),
+                                    QStringLiteral("Point lights during the benchmark."),
+                                    QStringLiteral("count"), QString::number(DEFAULT_LIGHT_COUNT));
+    QCommandLineOption adaptiveOption(QStringLiteral("benchmark-adaptive-resolution"),
+                                      QStringLiteral("Let the render resolution follow the GPU time during the benchmark."));
+    QCommandLineOption noOcclusionOption(QStringLiteral("benchmark-no-occlusion-culling"),
+                                         QStringLiteral("Frustum culling only during the benchmark."));
+    QCommandLineOption sceneOption(QStringLiteral("scene"),
+                                   QStringLiteral("Start with the instances of a scene file."),
+                                   QStringLiteral("file"));
+    QCommandLineOption matricesOption(QStringLiteral("benchmark-matrices"),
+                                      QStringLiteral("Time the matrix kernels against QMatrix4x4 and quit."),
+                                      QStringLiteral("iterations"));
+    QCommandLineOption convertMeshOption(QStringLiteral("convert-mesh"),
+                                         QStringLiteral("Convert a mesh to format 2, check that it reads back the same and quit."),
+                                         QStringLiteral("file"));
+    QCommandLineOption convertMeshOutputOption(QStringLiteral("convert-mesh-output"),
+                                               QStringLiteral("Format 2 file written by --convert-mesh."),
+                                               QStringLiteral("file"));
+    parser.addOptions({ benchmarkOption, outputOption, maxInstancesOption, framesOption, warmupFramesOption, seedOption,
+                        depthPrepassOption, lightsOption, adaptiveOption, noOcclusionOption, sceneOption, matricesOption,
+                        convertMeshOption, convertMeshOutputOption });
+    parser.process(app);
+
+    if (parser.isSet(convertMeshOption)) {
+        if (!parser.isSet(convertMeshOutputOption))
+            qFatal("--convert-mesh needs --convert-mesh-output");
+        return Mesh::convert(parser.value(convertMeshOption), parser.value(convertMeshOutputOption)) ? 0 : 1;
+    }
+
+    if (parser.isSet(matricesOption)) {
+        Benchmark::runMatrixKernels(qMax(1, parser.value(matricesOption).toInt()));
+        return 0;
+    }
+
+	// Set the environment variable programmatically to enable Vulkan debugging. Not for the
+	// benchmark, the validation layer would be most of what it measures.
+	if (!parser.isSet(benchmarkOption))
+		qputenv("QT_VK_DEBUG", "1");
 
     const bool dbg = qEnvironmentVariableIntValue("QT_VK_DEBUG");
 
@@ -21,12 +83,46 @@ int main(int argc, char **argv)
         inst.setLayers({ "VK_LAYER_KHRONOS_validation" });
     }
 
+#if QT_VERSION >= QT_VERSION_CHECK(6, 7, 0)
+    // For the timeline semaphores of the transfer queue, see transferqueue.h.
+    if (inst.supportedApiVersion() >= QVersionNumber(1, 2))
+        inst.setApiVersion(QVersionNumber(1, 2));
+#endif
+
     if (!inst.create())
         qFatal("Failed to create Vulkan instance: %d", inst.errorCode());
 
     VulkanWindow *vulkanWindow = new VulkanWindow(dbg);
     vulkanWindow->setVulkanInstance(&inst);
 
+    if (parser.isSet(seedOption))
+        vulkanWindow->setRandomSeed(parser.value(seedOption).toUInt());
+    if (parser.isSet(sceneOption))
+        vulkanWindow->setSceneFile(parser.value(sceneOption));
+
+    if (parser.isSet(benchmarkOption)) {
+        // The window alone, with a fixed size so that runs stay comparable.
+        Benchmark::Options options;
+        options.outputFile = parser.value(outputOption);
+        options.maxInstances = qMax(128, parser.value(maxInstancesOption).toInt());
+        options.measuredFrames = qMax(2, parser.value(framesOption).toInt());
+        options.warmupFrames = qMax(0, parser.value(warmupFramesOption).toInt());
+        if (parser.isSet(seedOption))
+            options.seed = parser.value(seedOption).toUInt();
+        options.depthPrepass = parser.isSet(depthPrepassOption);
+        options.lightCount = qBound(0, parser.value(lightsOption).toInt(), MAX_LIGHT_COUNT);
+        options.adaptiveResolution = parser.isSet(adaptiveOption);
+        options.occlusionCulling = !parser.isSet(noOcclusionOption);
+        Benchmark benchmark(vulkanWindow, options);
+        benchmark.start();
+
+        vulkanWindow->resize(1280, 720);
+        vulkanWindow->show();
+        const int ret = app.exec();
+        delete vulkanWindow;
+        return ret;
+    }
+
     MainWindow mainWindow(vulkanWindow);
     mainWindow.resize(1024, 768);
     mainWindow.show();
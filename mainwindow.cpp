@@ -3,14 +3,21 @@
 
 #include "mainwindow.h"
 #include "vulkanwindow.h"
+#include "utilities.h"
 #include <QApplication>
 #include <QLabel>
 #include <QPushButton>
 #include <QLCDNumber>
 #include <QCheckBox>
+#include <QSpinBox>
 #include <QGridLayout>
+#include <QLocale>
+#include <QTimer>
+#include <QFileDialog>
+#include <QFontDatabase>
 
 MainWindow::MainWindow(VulkanWindow *vulkanWindow)
+    : mVulkanWindow(vulkanWindow)
 {
     QWidget *wrapper = QWidget::createWindowContainer(vulkanWindow);
     wrapper->setFocusPolicy(Qt::StrongFocus);
@@ -20,9 +27,12 @@ MainWindow::MainWindow(VulkanWindow *vulkanWindow)
     infoLabel->setFrameStyle(QFrame::Box | QFrame::Raised);
     infoLabel->setAlignment(Qt::AlignCenter);
     infoLabel->setText(tr("This example demonstrates instanced drawing\nof a mesh loaded from a file.\n"
-                          "Uses a Phong material with a single light.\n"
+                          "Uses a Phong material with a main light\nand point lights culled into clusters.\n"
                           "Also demonstrates dynamic uniform buffers\nand a bit of threading with QtConcurrent.\n"
+                          "Frustum and occlusion culls the instances\nin compute shaders, draws them indirectly.\n"
+                          "All meshes share one buffer and draw\nin a single multi-draw-indirect.\n"
                           "Uses 4x MSAA when available.\n"
+                          "Can lower the resolution to stay in budget.\n"
                           "Comes with an FPS camera.\n"
                           "Hit [Shift+]WASD to walk and strafe.\nPress and move mouse to look around.\n"
                           "Click Add New to increase the number of instances."));
@@ -30,10 +40,65 @@ MainWindow::MainWindow(VulkanWindow *vulkanWindow)
     meshSwitch = new QCheckBox(tr("&Use Qt logo"));
     meshSwitch->setFocusPolicy(Qt::NoFocus); // do not interfere with vulkanWindow's keyboard input
 
-    counterLcd = new QLCDNumber(5);
+    mixSwitch = new QCheckBox(tr("&Mix blocks and Qt logos"));
+    mixSwitch->setFocusPolicy(Qt::NoFocus);
+
+    cacheSwitch = new QCheckBox(tr("&Reuse render pass commands"));
+    cacheSwitch->setFocusPolicy(Qt::NoFocus);
+    cacheSwitch->setChecked(true);
+
+    depthPrepassSwitch = new QCheckBox(tr("&Depth pre-pass for the items"));
+    depthPrepassSwitch->setFocusPolicy(Qt::NoFocus);
+
+    prepareAheadSwitch = new QCheckBox(tr("Prepare &next frame ahead"));
+    prepareAheadSwitch->setFocusPolicy(Qt::NoFocus);
+    prepareAheadSwitch->setChecked(true);
+
+    adaptiveSwitch = new QCheckBox(tr("Adaptive resolu&tion"));
+    adaptiveSwitch->setFocusPolicy(Qt::NoFocus);
+
+    occlusionSwitch = new QCheckBox(tr("&Occlusion culling"));
+    occlusionSwitch->setFocusPolicy(Qt::NoFocus);
+    occlusionSwitch->setChecked(true);
+
+    specularSwitch = new QCheckBox(tr("&Specular highlights"));
+    specularSwitch->setFocusPolicy(Qt::NoFocus);
+    specularSwitch->setChecked(true);
+
+    lightCountBox = new QSpinBox;
+    lightCountBox->setFocusPolicy(Qt::NoFocus);
+    lightCountBox->setPrefix(tr("Point lights: "));
+    lightCountBox->setRange(0, MAX_LIGHT_COUNT);
+    lightCountBox->setSingleStep(32);
+    lightCountBox->setValue(DEFAULT_LIGHT_COUNT);
+
+    counterLcd = new QLCDNumber(8);
     counterLcd->setSegmentStyle(QLCDNumber::Filled);
     counterLcd->display(mCount);
 
+    // The instance store grows on the render thread, so poll rather than update on click.
+    memoryLabel = new QLabel;
+    memoryLabel->setAlignment(Qt::AlignCenter);
+    QTimer *memoryTimer = new QTimer(this);
+    connect(memoryTimer, &QTimer::timeout, this, &MainWindow::updateMemoryLabel);
+    memoryTimer->start(500);
+
+    frameLabel = new QLabel;
+    frameLabel->setAlignment(Qt::AlignCenter);
+    connect(memoryTimer, &QTimer::timeout, this, &MainWindow::updateFrameLabel);
+
+    // Rolling timings from the renderer, fixed width so the columns line up.
+    profileLabel = new QLabel;
+    profileLabel->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+    profileLabel->setFrameStyle(QFrame::Box | QFrame::Sunken);
+    exportButton = new QPushButton(tr("E&xport timings..."));
+    exportButton->setFocusPolicy(Qt::NoFocus);
+
+    loadSceneButton = new QPushButton(tr("&Load scene..."));
+    loadSceneButton->setFocusPolicy(Qt::NoFocus);
+    saveSceneButton = new QPushButton(tr("Sa&ve scene..."));
+    saveSceneButton->setFocusPolicy(Qt::NoFocus);
+
     newButton = new QPushButton(tr("&Add new"));
     newButton->setFocusPolicy(Qt::NoFocus);
     quitButton = new QPushButton(tr("&Quit"));
@@ -47,21 +112,89 @@ MainWindow::MainWindow(VulkanWindow *vulkanWindow)
         mCount = vulkanWindow->instanceCount();
         counterLcd->display(mCount);
     });
+    connect(exportButton, &QPushButton::clicked, this, &MainWindow::exportProfile);
+    connect(loadSceneButton, &QPushButton::clicked, this, &MainWindow::loadScene);
+    connect(saveSceneButton, &QPushButton::clicked, this, &MainWindow::saveScene);
     connect(pauseButton, &QPushButton::clicked, vulkanWindow, &VulkanWindow::togglePaused);
     connect(meshSwitch, &QCheckBox::clicked, vulkanWindow, &VulkanWindow::meshSwitched);
+    connect(mixSwitch, &QCheckBox::clicked, vulkanWindow, &VulkanWindow::mixedMeshesSwitched);
+    connect(mixSwitch, &QCheckBox::toggled, meshSwitch, &QCheckBox::setDisabled);
+    connect(cacheSwitch, &QCheckBox::clicked, vulkanWindow, &VulkanWindow::commandCachingSwitched);
+    connect(depthPrepassSwitch, &QCheckBox::clicked, vulkanWindow, &VulkanWindow::depthPrepassSwitched);
+    connect(prepareAheadSwitch, &QCheckBox::clicked, vulkanWindow, &VulkanWindow::prepareAheadSwitched);
+    connect(adaptiveSwitch, &QCheckBox::clicked, vulkanWindow, &VulkanWindow::adaptiveResolutionSwitched);
+    connect(occlusionSwitch, &QCheckBox::clicked, vulkanWindow, &VulkanWindow::occlusionCullingSwitched);
+    connect(lightCountBox, &QSpinBox::valueChanged, vulkanWindow, &VulkanWindow::lightCountChanged);
+    connect(specularSwitch, &QCheckBox::clicked, vulkanWindow, &VulkanWindow::specularSwitched);
 
     QGridLayout *layout = new QGridLayout;
     layout->addWidget(infoLabel, 0, 2);
     layout->addWidget(meshSwitch, 1, 2);
-    layout->addWidget(createLabel(tr("INSTANCES")), 2, 2);
-    layout->addWidget(counterLcd, 3, 2);
-    layout->addWidget(newButton, 4, 2);
-    layout->addWidget(pauseButton, 5, 2);
-    layout->addWidget(quitButton, 6, 2);
-    layout->addWidget(wrapper, 0, 0, 7, 2);
+    layout->addWidget(mixSwitch, 1, 3);
+    layout->addWidget(cacheSwitch, 2, 2);
+    layout->addWidget(depthPrepassSwitch, 2, 3);
+    layout->addWidget(prepareAheadSwitch, 3, 2);
+    layout->addWidget(lightCountBox, 3, 3);
+    layout->addWidget(createLabel(tr("INSTANCES")), 4, 2);
+    layout->addWidget(counterLcd, 5, 2);
+    layout->addWidget(profileLabel, 4, 3, 4, 1);
+    layout->addWidget(exportButton, 8, 3);
+    layout->addWidget(memoryLabel, 6, 2);
+    layout->addWidget(frameLabel, 7, 2);
+    layout->addWidget(newButton, 8, 2);
+    layout->addWidget(pauseButton, 9, 2);
+    layout->addWidget(adaptiveSwitch, 9, 3);
+    layout->addWidget(occlusionSwitch, 10, 3);
+    layout->addWidget(quitButton, 10, 2);
+    layout->addWidget(loadSceneButton, 11, 2);
+    layout->addWidget(saveSceneButton, 11, 3);
+    layout->addWidget(specularSwitch, 12, 2);
+    layout->addWidget(wrapper, 0, 0, 13, 2);
     setLayout(layout);
 }
 
+void MainWindow::updateMemoryLabel()
+{
+    const QLocale locale;
+    memoryLabel->setText(tr("Capacity: %1 instances\n%2 used of %3")
+                         .arg(mVulkanWindow->instanceCapacity())
+                         .arg(locale.formattedDataSize(mVulkanWindow->instanceBytesUsed()),
+                              locale.formattedDataSize(mVulkanWindow->instanceBytesAllocated())));
+}
+
+void MainWindow::updateFrameLabel()
+{
+    frameLabel->setText(tr("Frame build wait: %1 ms\nRender scale: %2%\nDropped input: %3")
+                        .arg(mVulkanWindow->frameWaitMs(), 0, 'f', 2)
+                        .arg(qRound(mVulkanWindow->renderScale() * 100))
+                        .arg(mVulkanWindow->droppedInputCount()));
+    profileLabel->setText(mVulkanWindow->profileSummary());
+}
+
+void MainWindow::exportProfile()
+{
+    const QString fn = QFileDialog::getSaveFileName(this, tr("Export timings"), QStringLiteral("timings.csv"),
+                                                    tr("CSV files (*.csv)"));
+    if (!fn.isEmpty())
+        mVulkanWindow->exportProfile(fn);
+}
+
+void MainWindow::loadScene()
+{
+    const QString fn = QFileDialog::getOpenFileName(this, tr("Load scene"), QString(),
+                                                    tr("Scene files (*.scene)"));
+    if (!fn.isEmpty())
+        mVulkanWindow->loadScene(fn);
+}
+
+void MainWindow::saveScene()
+{
+    const QString fn = QFileDialog::getSaveFileName(this, tr("Save scene"), QStringLiteral("instances.scene"),
+                                                    tr("Scene files (*.scene)"));
+    if (!fn.isEmpty())
+        mVulkanWindow->saveScene(fn);
+}
+
 QLabel *MainWindow::createLabel(const QString &text)
 {
     QLabel *lbl = new QLabel(text);
@@ -10,6 +10,7 @@ QT_FORWARD_DECLARE_CLASS(QLCDNumber)
 QT_FORWARD_DECLARE_CLASS(QLabel)
 QT_FORWARD_DECLARE_CLASS(QPushButton)
 QT_FORWARD_DECLARE_CLASS(QCheckBox)
+QT_FORWARD_DECLARE_CLASS(QSpinBox)
 
 class VulkanWindow;
 
@@ -20,10 +21,31 @@ public:
 
 private:
     QLabel *createLabel(const QString &text);
+    void updateMemoryLabel();
+    void updateFrameLabel();
+    void exportProfile();
+    void loadScene();
+    void saveScene();
+
+    VulkanWindow *mVulkanWindow{ nullptr };
 
     QLabel* infoLabel{ nullptr };
     QCheckBox *meshSwitch{ nullptr };
+    QCheckBox *mixSwitch{ nullptr };
+    QCheckBox *cacheSwitch{ nullptr };
+    QCheckBox *depthPrepassSwitch{ nullptr };
+    QCheckBox *prepareAheadSwitch{ nullptr };
+    QCheckBox *adaptiveSwitch{ nullptr };
+    QCheckBox *occlusionSwitch{ nullptr };
+    QCheckBox *specularSwitch{ nullptr };
+    QSpinBox *lightCountBox{ nullptr };
     QLCDNumber *counterLcd{ nullptr };
+    QLabel *memoryLabel{ nullptr };
+    QLabel *frameLabel{ nullptr };
+    QLabel *profileLabel{ nullptr };
+    QPushButton *exportButton{ nullptr };
+    QPushButton *loadSceneButton{ nullptr };
+    QPushButton *saveSceneButton{ nullptr };
     QPushButton *newButton{ nullptr };
     QPushButton *quitButton{ nullptr };
     QPushButton *pauseButton{ nullptr };
@@ -0,0 +1,112 @@
+#include "matrixkernels.h"
+#include <QtGlobal>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MATRIXKERNELS_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#define MATRIXKERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+void multiplyMatrix4(float *dst, const float *a, const float *b)
+{
+    // Column j of the result is the columns of a weighted by column j of b.
+#if defined(MATRIXKERNELS_SSE2)
+    const __m128 a0 = _mm_loadu_ps(a);
+    const __m128 a1 = _mm_loadu_ps(a + 4);
+    const __m128 a2 = _mm_loadu_ps(a + 8);
+    const __m128 a3 = _mm_loadu_ps(a + 12);
+    for (int j = 0; j < 4; ++j) {
+        const __m128 bj = _mm_loadu_ps(b + j * 4);
+        __m128 c = _mm_mul_ps(a0, _mm_shuffle_ps(bj, bj, _MM_SHUFFLE(0, 0, 0, 0)));
+        c = _mm_add_ps(c, _mm_mul_ps(a1, _mm_shuffle_ps(bj, bj, _MM_SHUFFLE(1, 1, 1, 1))));
+        c = _mm_add_ps(c, _mm_mul_ps(a2, _mm_shuffle_ps(bj, bj, _MM_SHUFFLE(2, 2, 2, 2))));
+        c = _mm_add_ps(c, _mm_mul_ps(a3, _mm_shuffle_ps(bj, bj, _MM_SHUFFLE(3, 3, 3, 3))));
+        _mm_storeu_ps(dst + j * 4, c);
+    }
+#elif defined(MATRIXKERNELS_NEON)
+    const float32x4_t a0 = vld1q_f32(a);
+    const float32x4_t a1 = vld1q_f32(a + 4);
+    const float32x4_t a2 = vld1q_f32(a + 8);
+    const float32x4_t a3 = vld1q_f32(a + 12);
+    for (int j = 0; j < 4; ++j) {
+        const float32x4_t bj = vld1q_f32(b + j * 4);
+        float32x4_t c = vmulq_lane_f32(a0, vget_low_f32(bj), 0);
+        c = vmlaq_lane_f32(c, a1, vget_low_f32(bj), 1);
+        c = vmlaq_lane_f32(c, a2, vget_high_f32(bj), 0);
+        c = vmlaq_lane_f32(c, a3, vget_high_f32(bj), 1);
+        vst1q_f32(dst + j * 4, c);
+    }
+#else
+    float r[16];
+    for (int j = 0; j < 4; ++j) {
+        for (int i = 0; i < 4; ++i)
+            r[j * 4 + i] = a[i] * b[j * 4] + a[4 + i] * b[j * 4 + 1] + a[8 + i] * b[j * 4 + 2] + a[12 + i] * b[j * 4 + 3];
+    }
+    memcpy(dst, r, sizeof(r));
+#endif
+}
+
+// For columns a, b and c the inverse transpose has the columns b x c, c x a
+// and a x b, divided by the determinant a . (b x c).
+void normalMatrixStd140(float *dst, const float *m)
+{
+#if defined(MATRIXKERNELS_SSE2)
+    // Row 3 is not part of it, keep it out of the padding.
+    const __m128 mask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+    const __m128 a = _mm_and_ps(_mm_loadu_ps(m), mask);
+    const __m128 b = _mm_and_ps(_mm_loadu_ps(m + 4), mask);
+    const __m128 c = _mm_and_ps(_mm_loadu_ps(m + 8), mask);
+    auto cross = [](__m128 u, __m128 v) {
+        const __m128 uYzx = _mm_shuffle_ps(u, u, _MM_SHUFFLE(3, 0, 2, 1));
+        const __m128 vYzx = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 0, 2, 1));
+        const __m128 r = _mm_sub_ps(_mm_mul_ps(u, vYzx), _mm_mul_ps(uYzx, v));
+        return _mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 0, 2, 1));
+    };
+    const __m128 bc = cross(b, c);
+    const __m128 ca = cross(c, a);
+    const __m128 ab = cross(a, b);
+    const __m128 d = _mm_mul_ps(a, bc);
+    const float det = _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(1, 1, 1, 1))),
+                                               _mm_shuffle_ps(d, d, _MM_SHUFFLE(2, 2, 2, 2))));
+    if (qFuzzyIsNull(det)) {
+        const float identity[] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0 };
+        memcpy(dst, identity, sizeof(identity));
+        return;
+    }
+    const __m128 inv = _mm_set1_ps(1.0f / det);
+    _mm_storeu_ps(dst, _mm_mul_ps(bc, inv));
+    _mm_storeu_ps(dst + 4, _mm_mul_ps(ca, inv));
+    _mm_storeu_ps(dst + 8, _mm_mul_ps(ab, inv));
+#else
+    // Three lanes of work, NEON has no shuffles that would make it pay off.
+    const float *a = m;
+    const float *b = m + 4;
+    const float *c = m + 8;
+    const float bc[] = { b[1] * c[2] - b[2] * c[1], b[2] * c[0] - b[0] * c[2], b[0] * c[1] - b[1] * c[0] };
+    const float ca[] = { c[1] * a[2] - c[2] * a[1], c[2] * a[0] - c[0] * a[2], c[0] * a[1] - c[1] * a[0] };
+    const float ab[] = { a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] };
+    const float det = a[0] * bc[0] + a[1] * bc[1] + a[2] * bc[2];
+    if (qFuzzyIsNull(det)) {
+        const float identity[] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0 };
+        memcpy(dst, identity, sizeof(identity));
+        return;
+    }
+    const float inv = 1.0f / det;
+    const float r[] = { bc[0] * inv, bc[1] * inv, bc[2] * inv, 0.0f,
+                        ca[0] * inv, ca[1] * inv, ca[2] * inv, 0.0f,
+                        ab[0] * inv, ab[1] * inv, ab[2] * inv, 0.0f };
+    memcpy(dst, r, sizeof(r));
+#endif
+}
+
+// The inverse of [R t] is [R^T -R^T t].
+QVector3D rigidInverseTranslation(const float *m)
+{
+    const float *t = m + 12;
+    return QVector3D(-(m[0] * t[0] + m[1] * t[1] + m[2] * t[2]),
+                     -(m[4] * t[0] + m[5] * t[1] + m[6] * t[2]),
+                     -(m[8] * t[0] + m[9] * t[1] + m[10] * t[2]));
+}
@@ -0,0 +1,22 @@
+#ifndef MATRIXKERNELS_H
+#define MATRIXKERNELS_H
+
+#include <QVector3D>
+
+// Column-major 4x4 float matrices, the layout of QMatrix4x4::constData() and
+// of a mat4 in std140. With SSE2 or NEON where there is one, without the
+// flag checks and the double precision QMatrix4x4 goes through.
+
+// dst = a * b, dst may be a or b.
+void multiplyMatrix4(float *dst, const float *a, const float *b);
+
+// The normal matrix of m, the inverse transpose of its upper 3x3, straight
+// into std140 mat3 layout: three columns, each padded to a vec4. The identity
+// when m is singular, like QMatrix4x4::normalMatrix().
+void normalMatrixStd140(float *dst, const float *m);
+
+// Where the camera is for a view matrix that only rotates and translates,
+// without the general inverse.
+QVector3D rigidInverseTranslation(const float *m);
+
+#endif
@@ -0,0 +1,312 @@
+#include "memoryallocator.h"
+#include "vulkanwindow.h"
+#include "utilities.h"
+
+// Smaller heaps, like the host visible device local one of 256 MB on many
+// discrete GPUs, get smaller blocks so that a single one cannot take a big
+// share of them.
+static const VkDeviceSize MAX_BLOCK_SIZE = 64 * 1024 * 1024;
+static const VkDeviceSize MIN_BLOCK_SIZE = 1024 * 1024;
+
+void MemoryAllocator::init(VulkanWindow *w, QVulkanDeviceFunctions *devFuncs)
+{
+    mWindow = w;
+    mDeviceFunctions = devFuncs;
+    w->vulkanInstance()->functions()->vkGetPhysicalDeviceMemoryProperties(w->physicalDevice(), &mMemProps);
+    mAtomSize = w->physicalDeviceProperties()->limits.nonCoherentAtomSize;
+}
+
+void MemoryAllocator::releaseResources()
+{
+    for (Block *block : std::as_const(mBlocks)) {
+        if (block->allocationCount)
+            qWarning("Releasing a memory block with %d allocations left", block->allocationCount);
+        destroyBlock(block);
+    }
+    mBlocks.clear();
+}
+
+// Prefers the types QVulkanWindow picked, then anything with the right property.
+uint32_t MemoryAllocator::memoryTypeIndex(uint32_t typeBits, Usage usage) const
+{
+    const uint32_t preferred = usage == HostVisible ? mWindow->hostVisibleMemoryIndex()
+                                                    : mWindow->deviceLocalMemoryIndex();
+    if (typeBits & (1u << preferred))
+        return preferred;
+
+    const VkMemoryPropertyFlags wanted = usage == HostVisible ? VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                                                              : VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    for (uint32_t i = 0; i < mMemProps.memoryTypeCount; ++i) {
+        if ((typeBits & (1u << i)) && (mMemProps.memoryTypes[i].propertyFlags & wanted) == wanted)
+            return i;
+    }
+    // Device local is only a preference, host visible is not.
+    if (usage == DeviceLocal) {
+        for (uint32_t i = 0; i < mMemProps.memoryTypeCount; ++i) {
+            if (typeBits & (1u << i))
+                return i;
+        }
+    }
+    qFatal("No suitable memory type for type bits 0x%x", typeBits);
+    return 0;
+}
+
+VkDeviceSize MemoryAllocator::blockSize(uint32_t memoryType) const
+{
+    const VkDeviceSize heapSize = mMemProps.memoryHeaps[mMemProps.memoryTypes[memoryType].heapIndex].size;
+    return qBound(MIN_BLOCK_SIZE, heapSize / 8, MAX_BLOCK_SIZE);
+}
+
+MemoryAllocator::Block *MemoryAllocator::createBlock(uint32_t memoryType, VkDeviceSize size, bool dedicated)
+{
+    VkMemoryAllocateInfo memAllocInfo{};
+    memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memAllocInfo.allocationSize = size;
+    memAllocInfo.memoryTypeIndex = memoryType;
+
+    Block *block = new Block;
+    VkResult err = mDeviceFunctions->vkAllocateMemory(mWindow->device(), &memAllocInfo, nullptr, &block->memory);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to allocate memory: %d", err);
+
+    block->memoryType = memoryType;
+    block->size = size;
+    block->dedicated = dedicated;
+    block->freeRanges.append({ 0, size });
+
+    if (mMemProps.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        err = mDeviceFunctions->vkMapMemory(mWindow->device(), block->memory, 0, VK_WHOLE_SIZE, 0,
+                                            reinterpret_cast<void **>(&block->mapped));
+        if (err != VK_SUCCESS)
+            qFatal("Failed to map memory: %d", err);
+    }
+
+    if (DBG)
+        qDebug("New %smemory block of %llu bytes in memory type %u", dedicated ? "dedicated " : "",
+               (unsigned long long) size, memoryType);
+
+    mBlocks.append(block);
+    return block;
+}
+
+void MemoryAllocator::destroyBlock(Block *block)
+{
+    VkDevice dev = mWindow->device();
+    if (block->mapped)
+        mDeviceFunctions->vkUnmapMemory(dev, block->memory);
+    mDeviceFunctions->vkFreeMemory(dev, block->memory, nullptr);
+    delete block;
+}
+
+// First fit. The space lost in front of the aligned offset stays free.
+bool MemoryAllocator::allocateFrom(Block *block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *offset)
+{
+    for (int i = 0; i < block->freeRanges.size(); ++i) {
+        const Range r = block->freeRanges[i];
+        const VkDeviceSize start = aligned(r.offset, alignment);
+        if (start + size > r.offset + r.size)
+            continue;
+
+        const Range before = { r.offset, start - r.offset };
+        const Range after = { start + size, r.offset + r.size - (start + size) };
+        block->freeRanges.removeAt(i);
+        if (after.size)
+            block->freeRanges.insert(i, after);
+        if (before.size)
+            block->freeRanges.insert(i, before);
+
+        *offset = start;
+        return true;
+    }
+    return false;
+}
+
+MemoryAllocator::Allocation MemoryAllocator::allocate(const VkMemoryRequirements &memReq, Usage usage, bool dedicated)
+{
+    const uint32_t memoryType = memoryTypeIndex(memReq.memoryTypeBits, usage);
+    VkDeviceSize alignment = memReq.alignment;
+    VkDeviceSize size = memReq.size;
+    if (mMemProps.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        alignment = qMax(alignment, mAtomSize);
+        size = aligned(size, mAtomSize);
+    }
+
+    Block *block = nullptr;
+    VkDeviceSize offset = 0;
+    const VkDeviceSize typeBlockSize = blockSize(memoryType);
+    if (dedicated || size > typeBlockSize / 2) {
+        block = createBlock(memoryType, size, true);
+        allocateFrom(block, size, alignment, &offset);
+    } else {
+        for (Block *b : std::as_const(mBlocks)) {
+            if (b->memoryType == memoryType && !b->dedicated && allocateFrom(b, size, alignment, &offset)) {
+                block = b;
+                break;
+            }
+        }
+        if (!block) {
+            block = createBlock(memoryType, typeBlockSize, false);
+            allocateFrom(block, size, alignment, &offset);
+        }
+    }
+
+    block->used += size;
+    ++block->allocationCount;
+
+    Allocation a;
+    a.memory = block->memory;
+    a.offset = offset;
+    a.size = size;
+    a.mapped = block->mapped ? block->mapped + offset : nullptr;
+    a.block = block;
+    return a;
+}
+
+// Merges the range back with its free neighbours. Empty blocks are given
+// back, apart from one per memory type to not thrash when a buffer is
+// replaced by a new one of the same size.
+void MemoryAllocator::free(Allocation *a)
+{
+    Block *block = a->block;
+    if (!block)
+        return;
+
+    QList<Range> &ranges(block->freeRanges);
+    int i = 0;
+    while (i < ranges.size() && ranges[i].offset < a->offset)
+        ++i;
+    Range r = { a->offset, a->size };
+    if (i < ranges.size() && r.offset + r.size == ranges[i].offset) {
+        r.size += ranges[i].size;
+        ranges.removeAt(i);
+    }
+    if (i > 0 && ranges[i - 1].offset + ranges[i - 1].size == r.offset) {
+        ranges[i - 1].size += r.size;
+    } else {
+        ranges.insert(i, r);
+    }
+
+    block->used -= a->size;
+    --block->allocationCount;
+    *a = Allocation();
+
+    if (block->allocationCount == 0) {
+        bool keep = !block->dedicated;
+        for (Block *b : std::as_const(mBlocks)) {
+            if (keep && b != block && b->memoryType == block->memoryType && !b->dedicated && b->allocationCount == 0)
+                keep = false;
+        }
+        if (!keep) {
+            mBlocks.removeOne(block);
+            destroyBlock(block);
+        }
+    }
+}
+
+VkBuffer MemoryAllocator::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, Usage memUsage,
+                                       Allocation *a, const char *what, const QList<uint32_t> &queueFamilies)
+{
+    VkDevice dev = mWindow->device();
+
+    VkBufferCreateInfo bufInfo{};
+    bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufInfo.size = size;
+    bufInfo.usage = usage;
+    if (queueFamilies.size() > 1) {
+        bufInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        bufInfo.queueFamilyIndexCount = uint32_t(queueFamilies.size());
+        bufInfo.pQueueFamilyIndices = queueFamilies.constData();
+    }
+    VkBuffer buf;
+    VkResult err = mDeviceFunctions->vkCreateBuffer(dev, &bufInfo, nullptr, &buf);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create %s buffer: %d", what, err);
+
+    VkMemoryRequirements memReq;
+    mDeviceFunctions->vkGetBufferMemoryRequirements(dev, buf, &memReq);
+    *a = allocate(memReq, memUsage);
+
+    err = mDeviceFunctions->vkBindBufferMemory(dev, buf, a->memory, a->offset);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to bind %s buffer memory: %d", what, err);
+
+    return buf;
+}
+
+void MemoryAllocator::destroyBuffer(VkBuffer *buf, Allocation *a)
+{
+    if (*buf) {
+        mDeviceFunctions->vkDestroyBuffer(mWindow->device(), *buf, nullptr);
+        *buf = VK_NULL_HANDLE;
+    }
+    free(a);
+}
+
+VkImage MemoryAllocator::createImage(const VkImageCreateInfo &info, Allocation *a, const char *what)
+{
+    VkDevice dev = mWindow->device();
+
+    VkImage image;
+    VkResult err = mDeviceFunctions->vkCreateImage(dev, &info, nullptr, &image);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create %s image: %d", what, err);
+
+    VkMemoryRequirements memReq;
+    mDeviceFunctions->vkGetImageMemoryRequirements(dev, image, &memReq);
+    *a = allocate(memReq, DeviceLocal, true);
+
+    err = mDeviceFunctions->vkBindImageMemory(dev, image, a->memory, a->offset);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to bind %s image memory: %d", what, err);
+
+    return image;
+}
+
+void MemoryAllocator::destroyImage(VkImage *image, Allocation *a)
+{
+    if (*image) {
+        mDeviceFunctions->vkDestroyImage(mWindow->device(), *image, nullptr);
+        *image = VK_NULL_HANDLE;
+    }
+    free(a);
+}
+
+void MemoryAllocator::flush(const Allocation &a, VkDeviceSize offset, VkDeviceSize size)
+{
+    if (!a.block || (mMemProps.memoryTypes[a.block->memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+        return;
+    flushMappedRange(mWindow, a.memory, a.block->size, a.offset + offset, size);
+}
+
+void MemoryAllocator::dump() const
+{
+    qDebug("Memory allocator: %d blocks", int(mBlocks.size()));
+    for (uint32_t h = 0; h < mMemProps.memoryHeapCount; ++h) {
+        int blocks = 0;
+        int allocations = 0;
+        VkDeviceSize allocated = 0;
+        VkDeviceSize used = 0;
+        for (const Block *b : mBlocks) {
+            if (mMemProps.memoryTypes[b->memoryType].heapIndex != h)
+                continue;
+            ++blocks;
+            allocations += b->allocationCount;
+            allocated += b->size;
+            used += b->used;
+        }
+        if (!blocks)
+            continue;
+        qDebug("  heap %u (%llu MB%s): %d blocks, %d allocations, %.2f MB allocated, %.2f MB used",
+               h, (unsigned long long) (mMemProps.memoryHeaps[h].size / (1024 * 1024)),
+               mMemProps.memoryHeaps[h].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT ? ", device local" : "",
+               blocks, allocations, allocated / (1024.0 * 1024.0), used / (1024.0 * 1024.0));
+        for (const Block *b : mBlocks) {
+            if (mMemProps.memoryTypes[b->memoryType].heapIndex != h)
+                continue;
+            qDebug("    type %u%s: %llu of %llu bytes in %d allocations, %d free ranges",
+                   b->memoryType, b->dedicated ? " dedicated" : "",
+                   (unsigned long long) b->used, (unsigned long long) b->size,
+                   b->allocationCount, int(b->freeRanges.size()));
+        }
+    }
+}
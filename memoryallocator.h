@@ -0,0 +1,97 @@
+#ifndef MEMORYALLOCATOR_H
+#define MEMORYALLOCATOR_H
+
+#include <QVulkanWindow>
+#include <QVulkanFunctions>
+#include <QList>
+
+class VulkanWindow;
+
+// Hands out pieces of a few large VkDeviceMemory blocks instead of one
+// allocation per buffer, maxMemoryAllocationCount can be as low as 4096.
+// Blocks are per memory type. Allocations respect the alignment from their
+// VkMemoryRequirements, in host visible memory also nonCoherentAtomSize so
+// that flushing one never touches its neighbours. Anything larger than half
+// a block gets a block of its own. Host visible blocks are mapped for as
+// long as they exist.
+//
+// Only buffers share blocks. Images, the render targets, always get a block
+// of their own, so bufferImageGranularity does not matter.
+// Not thread-safe, everything is allocated and freed on the render thread.
+class MemoryAllocator
+{
+    struct Block;
+
+public:
+    enum Usage {
+        DeviceLocal,
+        HostVisible
+    };
+
+    struct Allocation {
+        bool isValid() const { return block != nullptr; }
+        VkDeviceMemory memory{VK_NULL_HANDLE};
+        VkDeviceSize offset{0};
+        VkDeviceSize size{0};
+        uint8_t *mapped{nullptr}; // host visible only, already at offset
+    private:
+        friend class MemoryAllocator;
+        Block *block{nullptr};
+    };
+
+    void init(VulkanWindow *w, QVulkanDeviceFunctions *devFuncs);
+    // Everything must have been freed before.
+    void releaseResources();
+
+    Allocation allocate(const VkMemoryRequirements &memReq, Usage usage, bool dedicated = false);
+    void free(Allocation *a);
+
+    // Creates a buffer and binds it to a new allocation. Shared between
+    // queueFamilies when there is more than one of them.
+    VkBuffer createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, Usage memUsage,
+                          Allocation *a, const char *what, const QList<uint32_t> &queueFamilies = {});
+    void destroyBuffer(VkBuffer *buf, Allocation *a);
+
+    // Same for images, in device local memory.
+    VkImage createImage(const VkImageCreateInfo &info, Allocation *a, const char *what);
+    void destroyImage(VkImage *image, Allocation *a);
+
+    // Makes host writes to [offset, offset + size) of the allocation visible
+    // to the device, a no-op for coherent memory.
+    void flush(const Allocation &a, VkDeviceSize offset, VkDeviceSize size);
+
+    // Blocks, allocations and bytes per heap, to the debug output.
+    void dump() const;
+
+private:
+    struct Range {
+        VkDeviceSize offset;
+        VkDeviceSize size;
+    };
+
+    struct Block {
+        VkDeviceMemory memory{VK_NULL_HANDLE};
+        uint32_t memoryType{0};
+        VkDeviceSize size{0};
+        VkDeviceSize used{0};
+        int allocationCount{0};
+        bool dedicated{false};
+        uint8_t *mapped{nullptr};
+        QList<Range> freeRanges; // sorted by offset, never adjacent
+    };
+
+    uint32_t memoryTypeIndex(uint32_t typeBits, Usage usage) const;
+    VkDeviceSize blockSize(uint32_t memoryType) const;
+    Block *createBlock(uint32_t memoryType, VkDeviceSize size, bool dedicated);
+    void destroyBlock(Block *block);
+    bool allocateFrom(Block *block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *offset);
+
+    VulkanWindow *mWindow{nullptr};
+    QVulkanDeviceFunctions *mDeviceFunctions{nullptr};
+    VkPhysicalDeviceMemoryProperties mMemProps{};
+    VkDeviceSize mAtomSize{1};
+
+    QList<Block *> mBlocks;
+};
+
+#endif
@@ -4,6 +4,323 @@
 #include "mesh.h"
 #include <QtConcurrentRun>
 #include <QFile>
+#include <QSharedPointer>
+#include <QHash>
+#include <QList>
+#include <cmath>
+
+static const int SOURCE_VERTEX_BYTE_COUNT = 8 * 4; // x, y, z, u, v, nx, ny, nz as floats in format 1
+
+// Tom Forsyth's "Linear-Speed Vertex Cache Optimisation", with the constants
+// suggested there. Reorders the triangles so that consecutive ones share as
+// many vertices as possible while those are still in the post-transform cache.
+static const int CACHE_SIZE = 32;
+
+static float vertexScore(int cachePos, int remainingTris)
+{
+    if (remainingTris == 0)
+        return -1.0f;
+
+    float score = 0.0f;
+    if (cachePos >= 0) {
+        if (cachePos < 3) // used by the last triangle, do not favor it over the rest of the cache
+            score = 0.75f;
+        else
+            score = std::pow(1.0f - float(cachePos - 3) / (CACHE_SIZE - 3), 1.5f);
+    }
+    // Vertices with few triangles left should be finished off.
+    score += 2.0f / std::sqrt(float(remainingTris));
+    return score;
+}
+
+static void optimizeVertexCache(QList<quint32> &indices, int vertexCount)
+{
+    const int triCount = indices.size() / 3;
+
+    // The triangles using each vertex.
+    QList<int> remaining(vertexCount, 0);
+    for (quint32 i : std::as_const(indices))
+        ++remaining[i];
+    QList<int> vertTriOffsets(vertexCount + 1, 0);
+    for (int v = 0; v < vertexCount; ++v)
+        vertTriOffsets[v + 1] = vertTriOffsets[v] + remaining[v];
+    QList<int> vertTris(indices.size());
+    QList<int> fill(vertTriOffsets.cbegin(), vertTriOffsets.cend() - 1);
+    for (int t = 0; t < triCount; ++t) {
+        for (int k = 0; k < 3; ++k)
+            vertTris[fill[indices[t * 3 + k]]++] = t;
+    }
+
+    QList<int> cachePos(vertexCount, -1);
+    QList<float> vScore(vertexCount);
+    for (int v = 0; v < vertexCount; ++v)
+        vScore[v] = vertexScore(-1, remaining[v]);
+
+    QList<bool> emitted(triCount, false);
+    QList<float> tScore(triCount);
+    for (int t = 0; t < triCount; ++t)
+        tScore[t] = vScore[indices[t * 3]] + vScore[indices[t * 3 + 1]] + vScore[indices[t * 3 + 2]];
+
+    QList<quint32> result;
+    result.reserve(indices.size());
+    QList<int> cache; // most recently used first
+    cache.reserve(CACHE_SIZE + 3);
+    int bestTri = -1;
+
+    // Whole triangles only, a partial one at the end would leave nothing to pick.
+    while (result.size() < triCount * 3) {
+        if (bestTri < 0) {
+            // Nothing in the cache to continue with, pick the best of the rest.
+            float bestScore = -1.0f;
+            for (int t = 0; t < triCount; ++t) {
+                if (!emitted[t] && tScore[t] > bestScore) {
+                    bestScore = tScore[t];
+                    bestTri = t;
+                }
+            }
+        }
+
+        emitted[bestTri] = true;
+        for (int k = 0; k < 3; ++k) {
+            const int v = indices[bestTri * 3 + k];
+            result.append(v);
+            --remaining[v];
+            cache.removeOne(v);
+            cache.prepend(v);
+        }
+
+        QList<int> touched = cache;
+        while (cache.size() > CACHE_SIZE) {
+            cachePos[cache.last()] = -1;
+            cache.removeLast();
+        }
+        for (int i = 0; i < cache.size(); ++i)
+            cachePos[cache[i]] = i;
+        for (int v : std::as_const(touched))
+            vScore[v] = vertexScore(cachePos[v], remaining[v]);
+
+        bestTri = -1;
+        float bestScore = -1.0f;
+        for (int v : std::as_const(touched)) {
+            for (int i = vertTriOffsets[v]; i < vertTriOffsets[v + 1]; ++i) {
+                const int t = vertTris[i];
+                if (emitted[t])
+                    continue;
+                tScore[t] = vScore[indices[t * 3]] + vScore[indices[t * 3 + 1]] + vScore[indices[t * 3 + 2]];
+                if (tScore[t] > bestScore) {
+                    bestScore = tScore[t];
+                    bestTri = t;
+                }
+            }
+        }
+    }
+
+    indices = result;
+}
+
+static qint16 toSnorm16(float v)
+{
+    return qint16(qRound(qBound(-1.0f, v, 1.0f) * 32767.0f));
+}
+
+// Octahedral normal encoding: project onto the octahedron |x| + |y| + |z| = 1
+// and fold the lower half over the upper one, leaving two components.
+static void encodeNormal(const float *n, qint16 *out)
+{
+    const float l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+    if (l1 == 0.0f) {
+        out[0] = out[1] = 0;
+        return;
+    }
+    float x = n[0] / l1;
+    float y = n[1] / l1;
+    if (n[2] < 0.0f) {
+        const float fx = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        const float fy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+    }
+    out[0] = toSnorm16(x);
+    out[1] = toSnorm16(y);
+}
+
+// Positions relative to the aabb, so that -1..1 covers it on each axis.
+// Drops the uv, nothing reads it.
+static QByteArray packVertex(const float *v, const float *aabb)
+{
+    qint16 packed[PACKED_VERTEX_BYTE_COUNT / 2];
+    for (int i = 0; i < 3; ++i) {
+        const float center = (aabb[i * 2] + aabb[i * 2 + 1]) * 0.5f;
+        const float halfExtent = (aabb[i * 2 + 1] - aabb[i * 2]) * 0.5f;
+        packed[i] = halfExtent > 0.0f ? toSnorm16((v[i] - center) / halfExtent) : 0;
+    }
+    packed[3] = 32767; // w = 1
+    encodeNormal(v + 5, packed + 4);
+    return QByteArray(reinterpret_cast<const char *>(packed), PACKED_VERTEX_BYTE_COUNT);
+}
+
+// Format 1 meshes are plain triangle soups, where most vertices appear
+// several times. Keep each one once and draw through an index buffer.
+static void buildIndexed(MeshData *md, const char *vertices, int vertexCount)
+{
+    // The vertices may point into a file mapping with no particular
+    // alignment, so read them one by one instead of casting.
+    float src[8];
+
+    // The aabb in the file is not necessarily tight, and the quantization
+    // should not waste any range.
+    memcpy(src, vertices, SOURCE_VERTEX_BYTE_COUNT);
+    for (int i = 0; i < 3; ++i) {
+        md->aabb[i * 2] = src[i];
+        md->aabb[i * 2 + 1] = src[i];
+    }
+    for (int v = 1; v < vertexCount; ++v) {
+        memcpy(src, vertices + v * SOURCE_VERTEX_BYTE_COUNT, 3 * sizeof(float));
+        for (int i = 0; i < 3; ++i) {
+            md->aabb[i * 2] = qMin(md->aabb[i * 2], src[i]);
+            md->aabb[i * 2 + 1] = qMax(md->aabb[i * 2 + 1], src[i]);
+        }
+    }
+
+    QHash<QByteArray, quint32> unique;
+    QList<quint32> indices;
+    indices.reserve(vertexCount);
+    md->geom.reserve(vertexCount * PACKED_VERTEX_BYTE_COUNT);
+
+    for (int i = 0; i < vertexCount; ++i) {
+        memcpy(src, vertices + i * SOURCE_VERTEX_BYTE_COUNT, SOURCE_VERTEX_BYTE_COUNT);
+        const QByteArray v = packVertex(src, md->aabb);
+        auto it = unique.constFind(v);
+        if (it == unique.cend()) {
+            it = unique.insert(v, unique.size());
+            md->geom.append(v);
+        }
+        indices.append(*it);
+    }
+
+    md->vertexCount = unique.size();
+    optimizeVertexCache(indices, md->vertexCount);
+
+    md->indexCount = indices.size();
+    md->indexSize = md->vertexCount <= 0xFFFF ? 2 : 4;
+    md->indices.resize(md->indexCount * md->indexSize);
+    if (md->indexSize == 2) {
+        quint16 *p = reinterpret_cast<quint16 *>(md->indices.data());
+        for (quint32 i : std::as_const(indices))
+            *p++ = quint16(i);
+    } else {
+        memcpy(md->indices.data(), indices.constData(), md->indices.size());
+    }
+}
+
+// Cells along the longest side of the aabb for each level, 0 = the full mesh.
+// Halving the cells each time keeps the cells of a level nested in the next.
+static const int LOD_GRID_SIZES[MAX_LOD_COUNT] = { 0, 64, 32, 16 };
+
+// A level that keeps more than this share of the triangles of the previous
+// one is not worth its own draw, stop there.
+static const float LOD_MIN_REDUCTION = 0.75f;
+
+static quint32 readIndex(const MeshData *md, int i)
+{
+    if (md->indexSize == 2) {
+        quint16 v;
+        memcpy(&v, md->indices.constData() + i * 2, 2);
+        return v;
+    }
+    quint32 v;
+    memcpy(&v, md->indices.constData() + i * 4, 4);
+    return v;
+}
+
+// Vertex clustering: all vertices in a grid cell collapse into the first one
+// seen, and the triangles that end up with less than three corners are
+// dropped. The normal is part of the cell, otherwise the corners of the
+// block would merge across faces and light wrong. The levels reuse the
+// vertices of the full mesh, only the indices are new.
+static void buildLods(MeshData *md)
+{
+    md->lods[0] = { 0, md->indexCount, 0.0f };
+    md->lodCount = 1;
+
+    float extent[3];
+    for (int i = 0; i < 3; ++i)
+        extent[i] = md->aabb[i * 2 + 1] - md->aabb[i * 2];
+    const float longest = qMax(extent[0], qMax(extent[1], extent[2]));
+    if (longest <= 0.0f)
+        return;
+
+    QList<quint32> base(md->indexCount);
+    for (int i = 0; i < md->indexCount; ++i)
+        base[i] = readIndex(md, i);
+
+    QList<quint32> lodIndices;
+    int prevCount = md->indexCount;
+    QList<quint32> remap(md->vertexCount);
+    QHash<quint64, quint32> clusters;
+
+    for (int level = 1; level < MAX_LOD_COUNT; ++level) {
+        const float cellSize = longest / LOD_GRID_SIZES[level];
+        clusters.clear();
+        for (int v = 0; v < md->vertexCount; ++v) {
+            qint16 packed[PACKED_VERTEX_BYTE_COUNT / 2];
+            memcpy(packed, md->geom.constData() + v * PACKED_VERTEX_BYTE_COUNT, PACKED_VERTEX_BYTE_COUNT);
+            quint64 key = 0;
+            for (int i = 0; i < 3; ++i) {
+                const float pos = (packed[i] + 32767) / 65534.0f * extent[i];
+                const int cell = qBound(0, int(pos / cellSize), LOD_GRID_SIZES[level]);
+                key |= quint64(cell) << (i * 12);
+            }
+            // Four buckets per octahedral component, centered on the axes.
+            for (int i = 0; i < 2; ++i)
+                key |= quint64((packed[4 + i] + 32768 + 8192) >> 14) << (36 + i * 3);
+            auto it = clusters.constFind(key);
+            if (it == clusters.cend())
+                it = clusters.insert(key, v);
+            remap[v] = *it;
+        }
+
+        QList<quint32> lod;
+        lod.reserve(base.size());
+        for (int t = 0; t < base.size(); t += 3) {
+            const quint32 a = remap[base[t]];
+            const quint32 b = remap[base[t + 1]];
+            const quint32 c = remap[base[t + 2]];
+            if (a == b || b == c || a == c)
+                continue;
+            lod.append(a);
+            lod.append(b);
+            lod.append(c);
+        }
+        if (lod.isEmpty() || lod.size() > prevCount * LOD_MIN_REDUCTION)
+            break;
+
+        optimizeVertexCache(lod, md->vertexCount);
+        // Anything in the cell may have moved to its first vertex, at most the cell's diagonal away.
+        md->lods[level] = { int(md->indexCount + lodIndices.size()), int(lod.size()), cellSize * std::sqrt(3.0f) };
+        ++md->lodCount;
+        lodIndices.append(lod);
+        prevCount = lod.size();
+    }
+
+    if (md->lodCount == 1)
+        return;
+
+    // Detaches from a file mapping, the vertices stay mapped.
+    QByteArray all(md->indices.constData(), md->indices.size());
+    all.resize(all.size() + lodIndices.size() * md->indexSize);
+    char *p = all.data() + md->indices.size();
+    for (quint32 i : std::as_const(lodIndices)) {
+        if (md->indexSize == 2) {
+            const quint16 v = quint16(i);
+            memcpy(p, &v, 2);
+        } else {
+            memcpy(p, &i, 4);
+        }
+        p += md->indexSize;
+    }
+    md->indices = all;
+}
 
 void Mesh::load(const QString &fn)
 {
@@ -11,31 +328,130 @@ void Mesh::load(const QString &fn)
     mMaybeRunning = true;
     mFuture = QtConcurrent::run([fn]() {
         MeshData md;
-        QFile f(fn);
-        if (!f.open(QIODevice::ReadOnly)) {
+        QSharedPointer<QFile> f(new QFile(fn));
+        if (!f->open(QIODevice::ReadOnly)) {
             qWarning("Failed to open %s", qPrintable(fn));
             return md;
         }
-        QByteArray buf = f.readAll();
-        const char *p = buf.constData();
-        quint32 format;
-        memcpy(&format, p, 4);
-        if (format != 1) {
+
+        // Map the file when possible, format 2 is then used straight from the
+        // mapping without ever copying it into memory of our own. Compressed
+        // resources cannot be mapped, those are read the usual way.
+        qint64 size = f->size();
+        QByteArray buf;
+        const char *p = reinterpret_cast<const char *>(f->map(0, size));
+        const bool mapped = p != nullptr;
+        if (!mapped) {
+            buf = f->readAll();
+            p = buf.constData();
+            size = buf.size();
+        }
+
+        quint32 format = 0;
+        if (size >= 4)
+            memcpy(&format, p, 4);
+        if (format == 1 && size >= 8 + 6 * 4) {
+            int vertexCount;
+            int ofs = 4;
+            memcpy(&vertexCount, p + ofs, 4);
+            ofs += 4;
+            ofs += 6 * 4; // recalculated, see buildIndexed()
+            if (vertexCount <= 0 || vertexCount % 3 != 0
+                    || size < ofs + qint64(vertexCount) * SOURCE_VERTEX_BYTE_COUNT) {
+                qWarning("Truncated mesh data in %s", qPrintable(fn));
+                return md;
+            }
+            buildIndexed(&md, p + ofs, vertexCount);
+        } else if (format == 2 && size >= 16 + 6 * 4) {
+            int ofs = 4;
+            memcpy(&md.vertexCount, p + ofs, 4);
+            ofs += 4;
+            memcpy(&md.indexCount, p + ofs, 4);
+            ofs += 4;
+            memcpy(&md.indexSize, p + ofs, 4);
+            ofs += 4;
+            memcpy(md.aabb, p + ofs, 6 * 4);
+            ofs += 6 * 4;
+            const qint64 vertexByteCount = qint64(md.vertexCount) * PACKED_VERTEX_BYTE_COUNT;
+            const qint64 indexByteCount = qint64(md.indexCount) * md.indexSize;
+            if (md.vertexCount <= 0 || md.indexCount <= 0 || md.indexCount % 3 != 0
+                    || (md.indexSize != 2 && md.indexSize != 4) || size < ofs + vertexByteCount + indexByteCount) {
+                qWarning("Invalid mesh data in %s", qPrintable(fn));
+                return MeshData();
+            }
+            if (mapped) {
+                md.geom = QByteArray::fromRawData(p + ofs, vertexByteCount);
+                md.indices = QByteArray::fromRawData(p + ofs + vertexByteCount, indexByteCount);
+                md.mapping = f;
+            } else {
+                md.geom = QByteArray(p + ofs, vertexByteCount);
+                md.indices = QByteArray(p + ofs + vertexByteCount, indexByteCount);
+            }
+            // Used as is by buildLods() and the GPU, one index past the
+            // vertices would read out of bounds on both.
+            for (int i = 0; i < md.indexCount; ++i) {
+                if (readIndex(&md, i) >= quint32(md.vertexCount)) {
+                    qWarning("Invalid mesh data in %s", qPrintable(fn));
+                    return MeshData();
+                }
+            }
+        } else {
             qWarning("Invalid format in %s", qPrintable(fn));
             return md;
         }
-        int ofs = 4;
-        memcpy(&md.vertexCount, p + ofs, 4);
-        ofs += 4;
-        memcpy(md.aabb, p + ofs, 6 * 4);
-        ofs += 6 * 4;
-        const int byteCount = md.vertexCount * 8 * 4;
-        md.geom.resize(byteCount);
-        memcpy(md.geom.data(), p + ofs, byteCount);
+        buildLods(&md);
         return md;
     });
 }
 
+bool Mesh::save(const MeshData &md, const QString &fn)
+{
+    QFile f(fn);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning("Failed to create %s", qPrintable(fn));
+        return false;
+    }
+
+    // Only the full mesh, the levels are generated again by load().
+    const quint32 header[4] = { 2, quint32(md.vertexCount), quint32(md.indexCount), quint32(md.indexSize) };
+    f.write(reinterpret_cast<const char *>(header), sizeof(header));
+    f.write(reinterpret_cast<const char *>(md.aabb), sizeof(md.aabb));
+    f.write(md.geom.constData(), qint64(md.vertexCount) * PACKED_VERTEX_BYTE_COUNT);
+    f.write(md.indices.constData(), qint64(md.indexCount) * md.indexSize);
+    if (!f.flush() || f.error() != QFileDevice::NoError) {
+        qWarning("Failed to write %s", qPrintable(fn));
+        return false;
+    }
+    return true;
+}
+
+bool Mesh::convert(const QString &inFn, const QString &outFn)
+{
+    Mesh in;
+    in.load(inFn);
+    if (!in.isValid() || !save(*in.data(), outFn))
+        return false;
+
+    // Read it back, what the renderer gets must not depend on the format.
+    Mesh out;
+    out.load(outFn);
+    const MeshData *a = in.data();
+    const MeshData *b = out.data();
+    bool same = b->isValid() && a->vertexCount == b->vertexCount && a->indexCount == b->indexCount
+            && a->indexSize == b->indexSize && !memcmp(a->aabb, b->aabb, sizeof(a->aabb))
+            && a->geom == b->geom && a->indices == b->indices && a->lodCount == b->lodCount;
+    for (int i = 0; same && i < a->lodCount; ++i) {
+        same = a->lods[i].firstIndex == b->lods[i].firstIndex && a->lods[i].indexCount == b->lods[i].indexCount
+                && a->lods[i].error == b->lods[i].error;
+    }
+    if (!same) {
+        qWarning("%s does not read back the same as %s", qPrintable(outFn), qPrintable(inFn));
+        return false;
+    }
+    qDebug("%s: %d vertices, %d indices, %d levels", qPrintable(outFn), b->vertexCount, b->indexCount, b->lodCount);
+    return true;
+}
+
 MeshData *Mesh::data()
 {
     if (mMaybeRunning && !mData.isValid())
@@ -6,19 +6,53 @@
 
 #include <QString>
 #include <QFuture>
+#include <QFile>
+#include <QSharedPointer>
+
+// x, y, z, w as 16 bit snorm within the aabb, then the octahedral normal as 2x 16 bit snorm.
+const int PACKED_VERTEX_BYTE_COUNT = 6 * 2;
+
+// The full mesh plus up to three simplified ones.
+const int MAX_LOD_COUNT = 4;
 
 struct MeshData
 {
-    bool isValid() const { return vertexCount > 0; }
+    bool isValid() const { return vertexCount > 0 && indexCount > 0; }
     int vertexCount = 0;
-    float aabb[6];
-    QByteArray geom; // x, y, z, u, v, nx, ny, nz
+    int indexCount = 0;
+    int indexSize = 2; // bytes per index, 2 or 4
+    float aabb[6]; // minX, maxX, minY, maxY, minZ, maxZ
+    QByteArray geom; // packed vertices, no duplicates
+    QByteArray indices; // triangle lists in vertex cache friendly order, all levels back to back
+    // Level 0 is the full mesh with indexCount indices, the others reuse its
+    // vertices with fewer triangles. error is how far, in model units, a
+    // level may differ from the full mesh.
+    struct Lod {
+        int firstIndex;
+        int indexCount;
+        float error;
+    };
+    int lodCount = 0;
+    Lod lods[MAX_LOD_COUNT];
+    // For format 2 files that could be mapped, geom and indices point into
+    // the mapping instead of owning a copy. Keeps the mapping alive.
+    QSharedPointer<QFile> mapping;
 };
 
+// Reads .buf files.
+// Format 1: vertex count, aabb and a non-indexed triangle list of x, y, z, u, v,
+//           nx, ny, nz floats. Packed and indexed at load time.
+// Format 2: vertex count, index count, index size, aabb, the unique packed vertices
+//           and then the indices, already optimised for the post-transform cache.
+// The simplified levels are generated at load time for both formats.
 class Mesh
 {
 public:
     void load(const QString &fn);
+    // Writes the full mesh as format 2.
+    static bool save(const MeshData &md, const QString &fn);
+    // Loads inFn, saves it as format 2 and checks that the result loads the same.
+    static bool convert(const QString &inFn, const QString &outFn);
     MeshData *data();
     bool isValid() { return data()->isValid(); }
     void reset();
@@ -0,0 +1,224 @@
+#include "profiler.h"
+#include <QFile>
+#include <QTextStream>
+#include <algorithm>
+
+static const int GPU_TIMER_COUNT = Profiler::TimerCount - Profiler::FIRST_GPU_TIMER;
+static const int QUERIES_PER_FRAME = GPU_TIMER_COUNT * 2; // begin and end
+
+void Profiler::init(QVulkanWindow *w, QVulkanDeviceFunctions *devFuncs)
+{
+    mWindow = w;
+    mDeviceFunctions = devFuncs;
+
+    // No GPU timers when the graphics queue cannot do timestamps, the CPU side still works.
+    const VkPhysicalDeviceLimits &limits(w->physicalDeviceProperties()->limits);
+    uint32_t queueFamilyCount = 0;
+    QVulkanFunctions *f = w->vulkanInstance()->functions();
+    f->vkGetPhysicalDeviceQueueFamilyProperties(w->physicalDevice(), &queueFamilyCount, nullptr);
+    QList<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    f->vkGetPhysicalDeviceQueueFamilyProperties(w->physicalDevice(), &queueFamilyCount, queueFamilies.data());
+    const uint32_t validBits = queueFamilies[w->graphicsQueueFamilyIndex()].timestampValidBits;
+    if (!limits.timestampComputeAndGraphics || validBits == 0) {
+        qWarning("No timestamp support on the graphics queue, GPU timings disabled");
+        return;
+    }
+    mTimestampPeriodMs = limits.timestampPeriod / 1000000.0;
+    mTimestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+    VkQueryPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = QUERIES_PER_FRAME * w->concurrentFrameCount();
+    VkResult err = mDeviceFunctions->vkCreateQueryPool(w->device(), &poolInfo, nullptr, &mQueryPool);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to create query pool: %d", err);
+        mQueryPool = VK_NULL_HANDLE;
+    }
+}
+
+void Profiler::releaseResources()
+{
+    if (mQueryPool) {
+        mDeviceFunctions->vkDestroyQueryPool(mWindow->device(), mQueryPool, nullptr);
+        mQueryPool = VK_NULL_HANDLE;
+    }
+    for (bool &written : mSlotWritten)
+        written = false;
+}
+
+void Profiler::beginFrame(VkCommandBuffer cb)
+{
+    if (!mQueryPool)
+        return;
+
+    const int frame = mWindow->currentFrame();
+    const uint32_t firstQuery = frame * QUERIES_PER_FRAME;
+
+    // The GPU is done with this slot, so its queries are final.
+    if (mSlotWritten[frame]) {
+        quint64 results[QUERIES_PER_FRAME][2]; // value, availability
+        VkResult err = mDeviceFunctions->vkGetQueryPoolResults(mWindow->device(), mQueryPool, firstQuery, QUERIES_PER_FRAME,
+                                                               sizeof(results), results, sizeof(results[0]),
+                                                               VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        if (err == VK_SUCCESS || err == VK_NOT_READY) {
+            for (int i = 0; i < GPU_TIMER_COUNT; ++i) {
+                if (!results[i * 2][1] || !results[i * 2 + 1][1])
+                    continue;
+                const quint64 ticks = (results[i * 2 + 1][0] - results[i * 2][0]) & mTimestampMask;
+                addSample(Timer(FIRST_GPU_TIMER + i), ticks * mTimestampPeriodMs);
+            }
+        }
+    }
+
+    mDeviceFunctions->vkCmdResetQueryPool(cb, mQueryPool, firstQuery, QUERIES_PER_FRAME);
+    mSlotWritten[frame] = true;
+}
+
+void Profiler::writeTimestamp(VkCommandBuffer cb, Timer t, bool end)
+{
+    if (!mQueryPool || t < FIRST_GPU_TIMER)
+        return;
+
+    const uint32_t query = mWindow->currentFrame() * QUERIES_PER_FRAME + (t - FIRST_GPU_TIMER) * 2 + (end ? 1 : 0);
+    mDeviceFunctions->vkCmdWriteTimestamp(cb, end ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                          mQueryPool, query);
+}
+
+void Profiler::addSample(Timer t, double ms)
+{
+    QMutexLocker locker(&mMutex);
+    Samples &s(mSamples[t]);
+    if (s.values.size() < SAMPLE_COUNT)
+        s.values.append(ms);
+    else
+        s.values[s.next] = ms;
+    s.next = (s.next + 1) % SAMPLE_COUNT;
+}
+
+void Profiler::clear()
+{
+    QMutexLocker locker(&mMutex);
+    for (Samples &s : mSamples) {
+        s.values.clear();
+        s.next = 0;
+    }
+}
+
+Profiler::Stats Profiler::stats(Timer t) const
+{
+    QList<double> values;
+    {
+        QMutexLocker locker(&mMutex);
+        values = mSamples[t].values;
+    }
+
+    Stats st;
+    st.samples = values.size();
+    if (values.isEmpty())
+        return st;
+
+    std::sort(values.begin(), values.end());
+    double sum = 0;
+    for (double v : std::as_const(values))
+        sum += v;
+    st.avg = sum / values.size();
+    auto percentile = [&values](double p) {
+        return values[qBound(0, int(p * (values.size() - 1) + 0.5), int(values.size()) - 1)];
+    };
+    st.p50 = percentile(0.50);
+    st.p95 = percentile(0.95);
+    st.p99 = percentile(0.99);
+    return st;
+}
+
+bool Profiler::latest(Timer t, double *ms) const
+{
+    QMutexLocker locker(&mMutex);
+    const Samples &s(mSamples[t]);
+    if (s.values.isEmpty())
+        return false;
+    *ms = s.values[(s.next + SAMPLE_COUNT - 1) % SAMPLE_COUNT];
+    return true;
+}
+
+QString Profiler::summary() const
+{
+    QString s = QStringLiteral("%1 %2 %3 %4 %5\n").arg(QStringLiteral("ms"), -18)
+            .arg(QStringLiteral("avg"), 6).arg(QStringLiteral("p50"), 6)
+            .arg(QStringLiteral("p95"), 6).arg(QStringLiteral("p99"), 6);
+    for (int t = 0; t < TimerCount; ++t) {
+        const Stats st = stats(Timer(t));
+        if (t >= FIRST_GPU_TIMER && !st.samples)
+            continue; // no timestamp support
+        s += QStringLiteral("%1 %2 %3 %4 %5\n").arg(QLatin1String(timerName(Timer(t))), -18)
+                .arg(st.avg, 6, 'f', 3).arg(st.p50, 6, 'f', 3)
+                .arg(st.p95, 6, 'f', 3).arg(st.p99, 6, 'f', 3);
+    }
+    s.chop(1);
+    return s;
+}
+
+// The summary first, then the raw samples, oldest first.
+bool Profiler::exportCsv(const QString &fileName) const
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        qWarning("Failed to open %s for writing", qPrintable(fileName));
+        return false;
+    }
+
+    QTextStream out(&f);
+    out << "timer,samples,avg_ms,p50_ms,p95_ms,p99_ms\n";
+    for (int t = 0; t < TimerCount; ++t) {
+        const Stats st = stats(Timer(t));
+        out << timerName(Timer(t)) << ',' << st.samples << ',' << st.avg << ','
+            << st.p50 << ',' << st.p95 << ',' << st.p99 << '\n';
+    }
+
+    out << "\ntimer,sample,ms\n";
+    QMutexLocker locker(&mMutex);
+    for (int t = 0; t < TimerCount; ++t) {
+        const Samples &s(mSamples[t]);
+        const int n = s.values.size();
+        const int first = n < SAMPLE_COUNT ? 0 : s.next;
+        for (int i = 0; i < n; ++i)
+            out << timerName(Timer(t)) << ',' << i << ',' << s.values[(first + i) % n] << '\n';
+    }
+    return true;
+}
+
+const char *Profiler::timerName(Timer t)
+{
+    switch (t) {
+    case CpuBuildFrame:
+        return "cpu_build_frame";
+    case CpuPrepareFrame:
+        return "cpu_prepare_frame";
+    case CpuInstanceUpload:
+        return "cpu_instance_upload";
+    case CpuFloorRecording:
+        return "cpu_floor_recording";
+    case CpuItemRecording:
+        return "cpu_item_recording";
+    case GpuFrame:
+        return "gpu_frame";
+    case GpuAnimate:
+        return "gpu_animate";
+    case GpuCull:
+        return "gpu_cull";
+    case GpuOcclusion:
+        return "gpu_occlusion";
+    case GpuLightCull:
+        return "gpu_light_cull";
+    case GpuFloor:
+        return "gpu_floor";
+    case GpuItems:
+        return "gpu_items";
+    case GpuUpscale:
+        return "gpu_upscale";
+    default:
+        break;
+    }
+    return "unknown";
+}
@@ -0,0 +1,95 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <QVulkanWindow>
+#include <QVulkanFunctions>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QList>
+#include <QString>
+
+// Rolling CPU and GPU timings. CPU times are measured with ScopedTimer, GPU
+// times with timestamp queries written around the passes. The query results
+// of a frame slot are read back when that slot comes around again, so there
+// is no waiting on the GPU. Keeps the last SAMPLE_COUNT samples per timer.
+class Profiler
+{
+public:
+    enum Timer {
+        CpuBuildFrame,
+        CpuPrepareFrame,
+        CpuInstanceUpload,
+        CpuFloorRecording,
+        CpuItemRecording,
+        GpuFrame,
+        GpuAnimate,
+        GpuCull,          // includes GpuOcclusion
+        GpuOcclusion,
+        GpuLightCull,
+        GpuFloor,
+        GpuItems,
+        GpuUpscale,
+        TimerCount
+    };
+    static const int FIRST_GPU_TIMER = GpuFrame;
+    static const int SAMPLE_COUNT = 512;
+
+    struct Stats {
+        int samples{0};
+        double avg{0};
+        double p50{0};
+        double p95{0};
+        double p99{0};
+    };
+
+    class ScopedTimer
+    {
+    public:
+        ScopedTimer(Profiler *p, Timer t) : mProfiler(p), mTimer(t) { mElapsed.start(); }
+        ~ScopedTimer() { mProfiler->addSample(mTimer, mElapsed.nsecsElapsed() / 1000000.0); }
+
+    private:
+        Profiler *mProfiler;
+        Timer mTimer;
+        QElapsedTimer mElapsed;
+    };
+
+    void init(QVulkanWindow *w, QVulkanDeviceFunctions *devFuncs);
+    void releaseResources();
+
+    // Primary command buffer, outside the render pass. Collects the results
+    // the current frame slot got last time and resets its queries.
+    void beginFrame(VkCommandBuffer cb);
+    // Any command buffer of the current frame, also secondaries.
+    void writeTimestamp(VkCommandBuffer cb, Timer t, bool end);
+
+    bool hasGpuTimers() const { return mQueryPool != VK_NULL_HANDLE; }
+
+    // Thread-safe.
+    void addSample(Timer t, double ms);
+    Stats stats(Timer t) const;
+    // The most recent sample, false when there is none.
+    bool latest(Timer t, double *ms) const;
+    void clear();
+    QString summary() const;
+    bool exportCsv(const QString &fileName) const;
+
+    static const char *timerName(Timer t);
+
+private:
+    QVulkanWindow *mWindow{nullptr};
+    QVulkanDeviceFunctions *mDeviceFunctions{nullptr};
+
+    VkQueryPool mQueryPool{VK_NULL_HANDLE};
+    double mTimestampPeriodMs{0};
+    quint64 mTimestampMask{~0ull};
+    bool mSlotWritten[QVulkanWindow::MAX_CONCURRENT_FRAME_COUNT]{};
+
+    mutable QMutex mMutex;
+    struct Samples {
+        QList<double> values; // ring of SAMPLE_COUNT
+        int next{0};
+    } mSamples[TimerCount];
+};
+
+#endif
@@ -0,0 +1,55 @@
+#include "qualitygovernor.h"
+
+static const float LEVEL_SCALES[QualityGovernor::LEVEL_COUNT] = { 1.0f, 0.85f, 0.7f, 0.5f };
+
+// Frames to skip after a change, the frames in flight still have the old
+// resolution. Then how long the average has to stay over or under.
+static const int SETTLE_FRAMES = 30;
+static const int DROP_FRAMES = 10;
+static const int RAISE_FRAMES = 90;
+static const float DROP_FACTOR = 1.1f;
+static const float RAISE_FACTOR = 0.8f;
+
+float QualityGovernor::scale(int level)
+{
+    return LEVEL_SCALES[level];
+}
+
+bool QualityGovernor::addFrame(float ms)
+{
+    if (++mSamples <= SETTLE_FRAMES) {
+        mAvgMs = ms;
+        return false;
+    }
+    mAvgMs = mAvgMs * 0.9f + ms * 0.1f;
+
+    mOverBudget = mAvgMs > mTargetMs * DROP_FACTOR ? mOverBudget + 1 : 0;
+    if (mOverBudget >= DROP_FRAMES && mLevel + 1 < LEVEL_COUNT) {
+        setLevel(mLevel + 1);
+        return true;
+    }
+
+    // Most of the cost goes with the number of pixels.
+    if (mLevel > 0) {
+        const float ratio = scale(mLevel - 1) / scale(mLevel);
+        mUnderBudget = mAvgMs * ratio * ratio < mTargetMs * RAISE_FACTOR ? mUnderBudget + 1 : 0;
+        if (mUnderBudget >= RAISE_FRAMES) {
+            setLevel(mLevel - 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void QualityGovernor::reset()
+{
+    setLevel(0);
+}
+
+void QualityGovernor::setLevel(int level)
+{
+    mLevel = level;
+    mSamples = 0;
+    mOverBudget = 0;
+    mUnderBudget = 0;
+}
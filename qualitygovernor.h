@@ -0,0 +1,37 @@
+#ifndef QUALITYGOVERNOR_H
+#define QUALITYGOVERNOR_H
+
+// Picks the resolution the scene is rendered at from the measured GPU time
+// of the frames. Drops a level when the frames keep going over the budget,
+// and goes back up only when the frame time scaled up by the extra pixels
+// would still leave headroom, so that it does not flip back and forth.
+// After every change it waits for the frame times to settle first.
+class QualityGovernor
+{
+public:
+    static const int LEVEL_COUNT = 4;
+
+    float targetMs() const { return mTargetMs; }
+    void setTargetMs(float ms) { mTargetMs = ms; }
+
+    // One frame's time, returns true when the level changed.
+    bool addFrame(float ms);
+    void reset();
+
+    // 0 is full resolution.
+    int level() const { return mLevel; }
+    float renderScale() const { return scale(mLevel); }
+    static float scale(int level);
+
+private:
+    void setLevel(int level);
+
+    float mTargetMs{1000.0f / 60.0f};
+    int mLevel{0};
+    float mAvgMs{0.0f};
+    int mSamples{0};        // since the last change
+    int mOverBudget{0};     // frames in a row
+    int mUnderBudget{0};
+};
+
+#endif
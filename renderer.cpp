@@ -2,30 +2,78 @@
 // SPDX-License-Identifier: LicenseRef-Qt-Commercial OR BSD-3-Clause
 
 #include "renderer.h"
+#include "matrixkernels.h"
 #include "qrandom.h"
 #include <QVulkanFunctions>
 #include <QtConcurrentRun>
 #include <QTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QtMath>
+#include <cfloat>
 #include "utilities.h"
 
-Renderer::Renderer(VulkanWindow *w, int initialCount)
+// In ItemMesh order. Scene files refer to the meshes by these names.
+static const char *const ITEM_MESH_FILES[] = { ":/block.buf", ":/qt_logo.buf" };
+
+static QStringList itemMeshFiles()
+{
+    QStringList files;
+    for (const char *file : ITEM_MESH_FILES)
+        files.append(QLatin1String(file));
+    return files;
+}
+
+Renderer::Renderer(VulkanWindow *w, int initialCount, quint32 seed)
     : mWindow(w),
       // Have the light positioned just behind the default camera position, looking forward.
       mLightPos(0.0f, 0.0f, 25.0f),
       mCam(QVector3D(0.0f, 0.0f, 20.0f)), // starting camera position
-      mInstCount(initialCount)
+      mInstCount(initialCount),
+      mInstanceGenerator(seed),
+      mRequestedInstCount(initialCount)
 {
     mFloorModel.translate(0, -5, 0);
     mFloorModel.rotate(-90, 1, 0, 0);
     mFloorModel.scale(20, 100, 1);
 
-    mBlockMesh.load(QStringLiteral(":/block.buf"));
-    mLogoMesh.load(QStringLiteral(":/qt_logo.buf"));
+    static_assert(sizeof(ITEM_MESH_FILES) / sizeof(ITEM_MESH_FILES[0]) == ItemMeshCount, "A file for every item mesh");
+    for (int m = 0; m < ItemMeshCount; ++m)
+        mItemMeshes[m].load(QLatin1String(ITEM_MESH_FILES[m]));
+
+    // A generator of their own, so that the instances stay the same for a seed.
+    QRandomGenerator lightRandom(seed ^ 0x9e3779b9u);
+    auto gen = [&lightRandom](float a, float b) {
+        return float(lightRandom.bounded(double(b - a)) + a);
+    };
+    for (PointLight &light : mLights) {
+        light.center = QVector3D(gen(-6, 6), gen(-4, 6), gen(-32, 6));
+        light.orbitRadius = gen(0.5f, 3);
+        light.orbitSpeed = gen(-0.03f, 0.03f);
+        light.phase = gen(0, 2 * M_PI);
+        light.radius = gen(2, 5);
+        // Saturated, one channel at full strength. There are many of them, so not too bright each.
+        QVector3D color(gen(0, 1), gen(0, 1), gen(0, 1));
+        color[lightRandom.bounded(3)] = 1.0f;
+        light.color = color * 0.6f;
+    }
 
     QObject::connect(&mFrameWatcher, &QFutureWatcherBase::finished, mWindow, [this] {
         if (mFramePending) {
             mFramePending = false;
+            const float waitMs = mFrameTimer.nsecsElapsed() / 1000000.0f;
+            mFrameWaitMs = mFrameWaitMs * 0.9f + waitMs * 0.1f;
+            // The CPU side of the next frame does not need anything from the
+            // frame slots, so it can run while this frame is being submitted
+            // and until startNextFrame() is called again.
+            if (mPrepareAhead)
+                mPrepareFuture = QtConcurrent::run(&Renderer::prepareFrame, this);
+            mTransfer.submitGraphicsWait();
             mWindow->frameReady();
+            mWindow->frameSubmitted();
             mWindow->requestUpdate();
         }
     });
@@ -42,6 +90,70 @@ void Renderer::preInitResources()
             qDebug("Requesting 4x MSAA");
         mWindow->setSampleCount(4);
     }
+
+    mTransfer.preInit(mWindow);
+
+    // The item pipelines are linked from parts when the device can, see createItemVariants().
+    mPipelineLibraries = false;
+    bool pipelineLibraryExtensions = false;
+#if defined(VK_EXT_graphics_pipeline_library) && QT_VERSION >= QT_VERSION_CHECK(6, 7, 0)
+    const QVulkanInfoVector<QVulkanExtension> extensions = mWindow->supportedDeviceExtensions();
+    pipelineLibraryExtensions = extensions.contains(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME)
+            && extensions.contains(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+    if (pipelineLibraryExtensions)
+        mWindow->setDeviceExtensions({ VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME });
+#endif
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 7, 0)
+    mWindow->setEnabledFeaturesModifier([this, pipelineLibraryExtensions](VkPhysicalDeviceFeatures2 &features) {
+        mTransfer.checkFeatures(features);
+#ifdef VK_EXT_graphics_pipeline_library
+        if (!pipelineLibraryExtensions)
+            return;
+        // Not among what Qt fills in, so ask the device and chain it in.
+        auto getFeatures2 = reinterpret_cast<PFN_vkGetPhysicalDeviceFeatures2>(
+                mWindow->vulkanInstance()->getInstanceProcAddr("vkGetPhysicalDeviceFeatures2"));
+        if (!getFeatures2)
+            return;
+        mPipelineLibraryFeatures = {};
+        mPipelineLibraryFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+        VkPhysicalDeviceFeatures2 supported{};
+        supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        supported.pNext = &mPipelineLibraryFeatures;
+        getFeatures2(mWindow->physicalDevice(), &supported);
+        mPipelineLibraries = mPipelineLibraryFeatures.graphicsPipelineLibrary;
+        if (mPipelineLibraries) {
+            mPipelineLibraryFeatures.pNext = features.pNext;
+            features.pNext = &mPipelineLibraryFeatures;
+        }
+#else
+        Q_UNUSED(pipelineLibraryExtensions);
+#endif
+    });
+#else
+    Q_UNUSED(pipelineLibraryExtensions);
+#endif
+}
+
+// What a single allocation may be at most, 1 GB is guaranteed when the
+// device cannot tell.
+static VkDeviceSize maxMemoryAllocationSize(QVulkanWindow *w)
+{
+    const VkDeviceSize guaranteed = VkDeviceSize(1) << 30;
+    if (w->vulkanInstance()->apiVersion() < QVersionNumber(1, 1)
+            || w->physicalDeviceProperties()->apiVersion < VK_API_VERSION_1_1)
+        return guaranteed;
+    auto getProperties2 = reinterpret_cast<PFN_vkGetPhysicalDeviceProperties2>(
+            w->vulkanInstance()->getInstanceProcAddr("vkGetPhysicalDeviceProperties2"));
+    if (!getProperties2)
+        return guaranteed;
+    VkPhysicalDeviceMaintenance3Properties maintenance3{};
+    maintenance3.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MAINTENANCE_3_PROPERTIES;
+    VkPhysicalDeviceProperties2 properties{};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &maintenance3;
+    getProperties2(w->physicalDevice(), &properties);
+    return maintenance3.maxMemoryAllocationSize;
 }
 
 //Automatically called by the window when the Vulkan device is created.
@@ -51,6 +163,7 @@ void Renderer::initResources()
         qDebug("Renderer init");
 
     mAnimating = true;
+    mRequestedAnimating = true;
     mFramePending = false;
 
     QVulkanInstance *vulkanInstance = mWindow->vulkanInstance();
@@ -60,18 +173,53 @@ void Renderer::initResources()
     const VkDeviceSize uniformAlignment = physicalDeviceLimits->minUniformBufferOffsetAlignment;
 
     mDeviceFunctions = vulkanInstance->deviceFunctions(logicalDevice);
+    mAllocator.init(mWindow, mDeviceFunctions);
+    mTransfer.init(mWindow, mDeviceFunctions);
+    mInstances.init(mWindow, mDeviceFunctions, &mAllocator, &mTransfer);
+
+    // QVulkanWindow enables every feature the device supports, apart from robustBufferAccess.
+    VkPhysicalDeviceFeatures features;
+    vulkanInstance->functions()->vkGetPhysicalDeviceFeatures(mWindow->physicalDevice(), &features);
+    mMultiDrawIndirect = features.multiDrawIndirect && features.drawIndirectFirstInstance
+            && physicalDeviceLimits->maxDrawIndirectCount >= uint32_t(MAX_DRAW_COUNT);
+    if (DBG)
+        qDebug("Multi-draw indirect: %s", mMultiDrawIndirect ? "yes" : "no, one call per draw");
+
+    // The instance store and the visible buffer are bound whole as storage
+    // buffers, each in an allocation of its own. The visible buffer needs a
+    // bucket per draw without multi-draw-indirect.
+    VkDeviceSize maxBufferSize = qMin<VkDeviceSize>(physicalDeviceLimits->maxStorageBufferRange,
+                                                    maxMemoryAllocationSize(mWindow));
+    if (!mMultiDrawIndirect)
+        maxBufferSize /= MAX_DRAW_COUNT;
+    VkDeviceSize maxInstCount = qMin<VkDeviceSize>(maxBufferSize / PER_INSTANCE_DATA_SIZE, INT_MAX);
+    // And the rows of groups dispatchInstances() can spread them over.
+    maxInstCount = qMin<VkDeviceSize>(maxInstCount, VkDeviceSize(physicalDeviceLimits->maxComputeWorkGroupCount[0])
+                                      * physicalDeviceLimits->maxComputeWorkGroupCount[1] * 64);
+    mMaxInstCount = int(maxInstCount);
+    mPublishedMaxInstCount.store(mMaxInstCount, std::memory_order_release);
+    mInstances.setMaxCapacity(mMaxInstCount);
+    if (DBG)
+        qDebug("At most %d instances", mMaxInstCount);
+    if (DBG)
+        qDebug("Graphics pipeline libraries: %s", mPipelineLibraries ? "yes" : "no, the item variants are compiled whole");
+    mProfiler.init(mWindow, mDeviceFunctions);
+    // The occluder pipeline is created against it.
+    createOcclusionRenderPass();
 
     /************* Shaders ****************/
     // Note the std140 packing rules. A vec3 still has an alignment of 16,
     // while a mat3 is like 3 * vec3.
-    mItemMaterial.vertUniSize = aligned(2 * 64 + 48, uniformAlignment);         // 2x mat4, 1x mat3
-    mItemMaterial.fragUniSize = aligned(6 * 16 + 12 + 2 * 4, uniformAlignment); // 7x vec3, 2x float <-???
+    mItemMaterial.vertUniSize = aligned(64 + ItemMeshCount * (64 + 48), uniformAlignment); // 1x mat4, then a mat4 and a mat3 per mesh
+    mItemMaterial.fragUniSize = aligned(3 * 16 + 12 + 4 + 2 * 16, uniformAlignment); // 4x vec3, 1x float, 2x vec4
 
 	//Phong shader for the blocks
     if (!mItemMaterial.vs.isValid())
         mItemMaterial.vs.load(vulkanInstance, logicalDevice, QStringLiteral(":/color_phong_vert.spv"));
     if (!mItemMaterial.fs.isValid())
         mItemMaterial.fs.load(vulkanInstance, logicalDevice, QStringLiteral(":/color_phong_frag.spv"));
+    if (!mItemMaterial.prepassVs.isValid())
+        mItemMaterial.prepassVs.load(vulkanInstance, logicalDevice, QStringLiteral(":/depth_prepass_vert.spv"));
 
 	//Color shader for the floor
     if (!mFloorMaterial.vs.isValid())
@@ -79,27 +227,151 @@ void Renderer::initResources()
     if (!mFloorMaterial.fs.isValid())
         mFloorMaterial.fs.load(vulkanInstance, logicalDevice, QStringLiteral(":/color_frag.spv"));
 
-    //Runs createPipelines() in a separate thread
-    //Returns a QFuture - the result of an asynchronous computation
-    mPipelinesFuture = QtConcurrent::run(&Renderer::createPipelines, this);
+    //Compute shader for the frustum culling
+    if (!mCullMaterial.cs.isValid())
+        mCullMaterial.cs.load(vulkanInstance, logicalDevice, QStringLiteral(":/cull_comp.spv"));
+
+    //Compute shader for the instance animation
+    if (!mAnimateMaterial.cs.isValid())
+        mAnimateMaterial.cs.load(vulkanInstance, logicalDevice, QStringLiteral(":/animate_comp.spv"));
+
+    //Compute shader for the light culling
+    if (!mLightCullMaterial.cs.isValid())
+        mLightCullMaterial.cs.load(vulkanInstance, logicalDevice, QStringLiteral(":/lightcull_comp.spv"));
+
+    //Compute shader for the depth pyramid of the occlusion culling
+    if (!mHizMaterial.cs.isValid())
+        mHizMaterial.cs.load(vulkanInstance, logicalDevice, QStringLiteral(":/hizreduce_comp.spv"));
+
+    //Upscale shader for the scene at reduced resolution
+    if (!mUpscaleMaterial.vs.isValid())
+        mUpscaleMaterial.vs.load(vulkanInstance, logicalDevice, QStringLiteral(":/upscale_vert.spv"));
+    if (!mUpscaleMaterial.fs.isValid())
+        mUpscaleMaterial.fs.load(vulkanInstance, logicalDevice, QStringLiteral(":/upscale_frag.spv"));
+
+    //The pipeline cache is created in a separate thread, then each material
+    //builds its pipeline on its own worker as soon as the cache is there.
+    //The shader modules are created inside each task as it needs them, from
+    //SPIR-V that is only read once per process, see Shader::spirv(). Returns
+    //QFutures - the results of asynchronous computations
+    mPipelineCacheFuture = QtConcurrent::run(&Renderer::createPipelineCache, this);
+    mItemMaterial.pipelineFuture = mPipelineCacheFuture.then(QtFuture::Launch::Async, [this] { createItemPipeline(); });
+    // Not waited for by the frames.
+    mItemMaterial.optimized = false;
+    mItemMaterial.optimizeFuture = mItemMaterial.pipelineFuture.then(QtFuture::Launch::Async, [this] { optimizeItemPipelines(); });
+    mFloorMaterial.pipelineFuture = mPipelineCacheFuture.then(QtFuture::Launch::Async, [this] { createFloorPipeline(); });
+    mCullMaterial.pipelineFuture = mPipelineCacheFuture.then(QtFuture::Launch::Async, [this] { createCullPipeline(); });
+    // Needs the descriptor set layout of the culling.
+    mAnimateMaterial.pipelineFuture = mCullMaterial.pipelineFuture.then(QtFuture::Launch::Async, [this] { createAnimatePipeline(); });
+    mLightCullMaterial.pipelineFuture = mPipelineCacheFuture.then(QtFuture::Launch::Async, [this] { createLightCullPipeline(); });
+    mUpscaleMaterial.pipelineFuture = mPipelineCacheFuture.then(QtFuture::Launch::Async, [this] { createUpscalePipeline(); });
+    mHizMaterial.pipelineFuture = mPipelineCacheFuture.then(QtFuture::Launch::Async, [this] { createHizPipeline(); });
 }
 
 //Called from initResources() in a separate thread.
-void Renderer::createPipelines()
+//The cache is shared by all the pipeline tasks. It is created without
+//VK_PIPELINE_CACHE_CREATE_EXTERNALLY_SYNCHRONIZED_BIT, so the implementation
+//synchronizes access to it and the tasks can use it at the same time.
+void Renderer::createPipelineCache()
 {
     VkDevice logicalDevice = mWindow->device();
 
+    // Seed the cache with what the previous run left behind, makes the
+    // pipelines below mostly a lookup instead of a compile.
+    const QByteArray initialData = loadPipelineCacheData();
     VkPipelineCacheCreateInfo pipelineCacheInfo{};
     pipelineCacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    pipelineCacheInfo.initialDataSize = initialData.size();
+    pipelineCacheInfo.pInitialData = initialData.constData();
     VkResult err = mDeviceFunctions->vkCreatePipelineCache(logicalDevice, &pipelineCacheInfo, nullptr, &mPipelineCache);
     if (err != VK_SUCCESS)
         qFatal("Failed to create pipeline cache: %d", err);
+}
+
+void Renderer::waitForPipelines()
+{
+    mPipelineCacheFuture.waitForFinished();
+    mItemMaterial.pipelineFuture.waitForFinished();
+    mFloorMaterial.pipelineFuture.waitForFinished();
+    mCullMaterial.pipelineFuture.waitForFinished();
+    mAnimateMaterial.pipelineFuture.waitForFinished();
+    mLightCullMaterial.pipelineFuture.waitForFinished();
+    mUpscaleMaterial.pipelineFuture.waitForFinished();
+    mHizMaterial.pipelineFuture.waitForFinished();
+}
+
+//One file per device, the cache data is useless for any other
+QString Renderer::pipelineCacheFileName() const
+{
+    const VkPhysicalDeviceProperties *props = mWindow->physicalDeviceProperties();
+    const QByteArray uuid = QByteArray(reinterpret_cast<const char *>(props->pipelineCacheUUID), VK_UUID_SIZE).toHex();
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation)
+            + QStringLiteral("/pipelinecache_%1_%2_%3.bin")
+                  .arg(props->vendorID, 4, 16, QLatin1Char('0'))
+                  .arg(props->deviceID, 4, 16, QLatin1Char('0'))
+                  .arg(QString::fromLatin1(uuid));
+}
+
+//Empty if there is no usable file. A driver update changes pipelineCacheUUID, and with
+//that the file name, but check the header anyway before handing the data to the driver.
+QByteArray Renderer::loadPipelineCacheData() const
+{
+    QFile f(pipelineCacheFileName());
+    if (!f.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    const QByteArray data = f.readAll();
+    const VkPhysicalDeviceProperties *props = mWindow->physicalDeviceProperties();
+    VkPipelineCacheHeaderVersionOne header;
+    if (data.size() < qsizetype(sizeof(header))) {
+        qWarning("Ignoring truncated pipeline cache %s", qPrintable(f.fileName()));
+        return QByteArray();
+    }
+    memcpy(&header, data.constData(), sizeof(header));
+    if (header.headerSize < sizeof(header)
+            || header.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+            || header.vendorID != props->vendorID
+            || header.deviceID != props->deviceID
+            || memcmp(header.pipelineCacheUUID, props->pipelineCacheUUID, VK_UUID_SIZE)) {
+        qWarning("Ignoring pipeline cache %s from a different device or driver", qPrintable(f.fileName()));
+        return QByteArray();
+    }
+
+    if (DBG)
+        qDebug("Loaded %lld bytes of pipeline cache data", qint64(data.size()));
+    return data;
+}
+
+void Renderer::savePipelineCache()
+{
+    VkDevice dev = mWindow->device();
+    size_t size = 0;
+    VkResult err = mDeviceFunctions->vkGetPipelineCacheData(dev, mPipelineCache, &size, nullptr);
+    if (err != VK_SUCCESS || size == 0)
+        return;
+
+    QByteArray data(qsizetype(size), Qt::Uninitialized);
+    err = mDeviceFunctions->vkGetPipelineCacheData(dev, mPipelineCache, &size, data.data());
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to get pipeline cache data: %d", err);
+        return;
+    }
+    data.truncate(qsizetype(size));
+
+    const QString fn = pipelineCacheFileName();
+    QDir().mkpath(QFileInfo(fn).absolutePath());
+    // QSaveFile, so that a crash halfway does not leave a broken cache behind.
+    QSaveFile f(fn);
+    if (!f.open(QIODevice::WriteOnly) || f.write(data) != data.size() || !f.commit()) {
+        qWarning("Failed to write pipeline cache %s", qPrintable(fn));
+        return;
+    }
 
-    createItemPipeline();
-    createFloorPipeline();
+    if (DBG)
+        qDebug("Saved %lld bytes of pipeline cache data to %s", qint64(data.size()), qPrintable(fn));
 }
 
-//Called from createPipelines() in a separate thread.
+//Runs on a worker of its own once the pipeline cache is created, see initResources().
 //Phong shader for the blocks
 void Renderer::createItemPipeline()
 {
@@ -109,29 +381,29 @@ void Renderer::createItemPipeline()
 	// 0 = vertex
     VkVertexInputBindingDescription vertexBindingDesc[2]{};
 	vertexBindingDesc[0].binding = 0;
-	vertexBindingDesc[0].stride = 8 * sizeof(float);    //position, uv, normal = 3 + 2 + 3 = 8
+	vertexBindingDesc[0].stride = PACKED_VERTEX_BYTE_COUNT;    //position, normal, see mesh.h
 	vertexBindingDesc[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
     /********************************* Not used in my code yet: *********************************/
     // 1 = instance
     // Seems like instance translate and diffuse color
 	vertexBindingDesc[1].binding = 1;
-	vertexBindingDesc[1].stride = 6 * sizeof(float);
+	vertexBindingDesc[1].stride = PER_INSTANCE_DATA_SIZE;
 	vertexBindingDesc[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
 
     /********************************* Shader bindings: *********************************/
-    VkVertexInputAttributeDescription vertexAttrDesc[4]{};
+    VkVertexInputAttributeDescription vertexAttrDesc[7]{};
 	// 0 = position
 	vertexAttrDesc[0].location = 0;
 	vertexAttrDesc[0].binding = 0;
-	vertexAttrDesc[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+	vertexAttrDesc[0].format = VK_FORMAT_R16G16B16A16_SNORM; // within the aabb, the model matrix scales it back
 	vertexAttrDesc[0].offset = 0;
 
     // 1 = normal 
 	vertexAttrDesc[1].location = 1;
 	vertexAttrDesc[1].binding = 0;
-	vertexAttrDesc[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-	vertexAttrDesc[1].offset = 5 * sizeof(float);   // because uv is 3 and 4
+	vertexAttrDesc[1].format = VK_FORMAT_R16G16_SNORM;       // octahedral, decoded in the vertex shader
+	vertexAttrDesc[1].offset = 4 * sizeof(qint16);
 
     // 2 = instTranslate - Not used in my code yet
 	vertexAttrDesc[2].location = 2;
@@ -141,8 +413,23 @@ void Renderer::createItemPipeline()
     // 3 = instDiffuseAdjust - Not used in my code yet
 	vertexAttrDesc[3].location = 3;
 	vertexAttrDesc[3].binding = 1;
-	vertexAttrDesc[3].format = VK_FORMAT_R32G32B32_SFLOAT;
+	vertexAttrDesc[3].format = VK_FORMAT_R8G8B8A8_SNORM;
 	vertexAttrDesc[3].offset = 3 * sizeof(float);
+    // 4 = instMesh, the last byte of the above
+	vertexAttrDesc[4].location = 4;
+	vertexAttrDesc[4].binding = 1;
+	vertexAttrDesc[4].format = VK_FORMAT_R8_UINT;
+	vertexAttrDesc[4].offset = 3 * sizeof(float) + 3;
+    // 5 = instRotation, a quaternion written by animate.comp
+	vertexAttrDesc[5].location = 5;
+	vertexAttrDesc[5].binding = 1;
+	vertexAttrDesc[5].format = VK_FORMAT_R16G16B16A16_SNORM;
+	vertexAttrDesc[5].offset = 4 * sizeof(float);
+    // 6 = instScale, the last byte of the spin
+	vertexAttrDesc[6].location = 6;
+	vertexAttrDesc[6].binding = 1;
+	vertexAttrDesc[6].format = VK_FORMAT_R8_UNORM;
+	vertexAttrDesc[6].offset = 4 * sizeof(float) + 4 * sizeof(qint16) + 3;
 
     VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
     vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
@@ -155,9 +442,11 @@ void Renderer::createItemPipeline()
     /*******************************************************/
 
     // Descriptor set layout - own function in my code
-    VkDescriptorPoolSize descriptorPoolSizes[1]{};
+    VkDescriptorPoolSize descriptorPoolSizes[2]{};
     descriptorPoolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     descriptorPoolSizes[0].descriptorCount = 2; // OEF: Differs from my code
+    descriptorPoolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    descriptorPoolSizes[1].descriptorCount = 2; // the point lights and their clusters
 
     VkDescriptorPoolCreateInfo descriptorPoolInfo{};
     descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -171,7 +460,7 @@ void Renderer::createItemPipeline()
 
     // OEF: Similar to what I have done, but I only use 1 for now for the Vertex shader
     // in createDescriptorSetLayouts() function
-    VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[2]{};
+    VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[4]{};
     descriptorSetLayoutBindings[0].binding = 0;
     descriptorSetLayoutBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     descriptorSetLayoutBindings[0].descriptorCount = 1;
@@ -185,6 +474,14 @@ void Renderer::createItemPipeline()
     descriptorSetLayoutBindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
     descriptorSetLayoutBindings[1].pImmutableSamplers = nullptr;
 
+    // 2 = the point lights, 3 = the lights of each cluster, see lightcull.comp
+    for (uint32_t i = 2; i < 4; ++i) {
+        descriptorSetLayoutBindings[i].binding = i;
+        descriptorSetLayoutBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+        descriptorSetLayoutBindings[i].descriptorCount = 1;
+        descriptorSetLayoutBindings[i].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    }
+
     VkDescriptorSetLayoutCreateInfo descriptorSetLayoutInfo{};
     descriptorSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
     descriptorSetLayoutInfo.pNext = nullptr;
@@ -287,12 +584,170 @@ void Renderer::createItemPipeline()
     pipelineInfo.layout = mItemMaterial.pipelineLayout;
     pipelineInfo.renderPass = mWindow->defaultRenderPass();
 
-    err = mDeviceFunctions->vkCreateGraphicsPipelines(logicalDevice, mPipelineCache, 1, &pipelineInfo, nullptr, &mItemMaterial.pipeline);
+#ifdef VK_EXT_graphics_pipeline_library
+    // What all variants share, the shaded ones with the depth pre-pass too.
+    if (mPipelineLibraries) {
+        VkGraphicsPipelineCreateInfo partInfo = pipelineInfo;
+        partInfo.stageCount = 0;
+        partInfo.pStages = nullptr;
+        mItemMaterial.vertexInputLibrary = createItemLibrary(partInfo, VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT);
+        mItemMaterial.fragmentOutputLibrary = createItemLibrary(partInfo, VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT);
+        partInfo.stageCount = 1;
+        partInfo.pStages = &shaderStages[0];
+        mItemMaterial.preRasterizationLibrary = createItemLibrary(partInfo, VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT);
+    }
+#endif
+
+    createItemVariants(pipelineInfo, mItemMaterial.pipelines, mItemMaterial.fragmentLibraries[0]);
+
+    // The depth pre-pass, no fragment shader and no color writes.
+    VkPipelineShaderStageCreateInfo prepassVertShaderCreateInfo = vertShaderCreateInfo;
+    prepassVertShaderCreateInfo.module = mItemMaterial.prepassVs.data()->shaderModule;
+    pipelineInfo.stageCount = 1;
+    pipelineInfo.pStages = &prepassVertShaderCreateInfo;
+    colorBlendAttachment.colorWriteMask = 0;
+
+    err = mDeviceFunctions->vkCreateGraphicsPipelines(logicalDevice, mPipelineCache, 1, &pipelineInfo, nullptr, &mItemMaterial.prepassPipeline);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create graphics pipeline: %d", err);
+
+    // The shading after it, the depth is already final. Only the nearest
+    // fragment of each pixel passes the test, so Phong runs once per pixel.
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.pStages = shaderStages;
+    colorBlendAttachment.colorWriteMask = 0xF;
+    depthStencil.depthWriteEnable = VK_FALSE;
+    depthStencil.depthCompareOp = VK_COMPARE_OP_EQUAL;
+
+    createItemVariants(pipelineInfo, mItemMaterial.shadePipelines, mItemMaterial.fragmentLibraries[1]);
+
+    // The occluders, the depth pre-pass again but into the single sampled
+    // depth of the occlusion culling, without any color attachment.
+    pipelineInfo.stageCount = 1;
+    pipelineInfo.pStages = &prepassVertShaderCreateInfo;
+    multisample.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    depthStencil.depthWriteEnable = VK_TRUE;
+    depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    colorBlend.attachmentCount = 0;
+    pipelineInfo.renderPass = mOcclusion.renderPass;
+
+    err = mDeviceFunctions->vkCreateGraphicsPipelines(logicalDevice, mPipelineCache, 1, &pipelineInfo, nullptr, &mItemMaterial.occluderPipeline);
     if (err != VK_SUCCESS)
         qFatal("Failed to create graphics pipeline: %d", err);
 }
 
-//Called from createPipelines() in a separate thread.
+// Every variant of the item shading with the state in pipelineInfo, into
+// pipelines. With pipeline libraries each variant is only its fragment shader,
+// kept in fragmentLibraries, and a quick link with the shared parts.
+void Renderer::createItemVariants(VkGraphicsPipelineCreateInfo pipelineInfo, VkPipeline *pipelines,
+                                  VkPipeline *fragmentLibraries)
+{
+    VkDevice logicalDevice = mWindow->device();
+
+    // The specialization constants of color_phong.frag. The material never
+    // changes, so it is baked in as well instead of coming from the uniforms.
+    // Gray, one value for all channels.
+    struct {
+        VkBool32 specular;
+        VkBool32 pointLights;
+        float ka;
+        float kd;
+        float ks;
+        float specularExp;
+    } specData = { VK_TRUE, VK_TRUE, 0.05f, 0.7f, 0.66f, 150.0f };
+    VkSpecializationMapEntry specEntries[6];
+    for (uint32_t i = 0; i < 6; ++i)
+        specEntries[i] = { i, i * 4, 4 }; // constant_id, offset, size
+    VkSpecializationInfo specInfo{};
+    specInfo.mapEntryCount = sizeof(specEntries) / sizeof(specEntries[0]);
+    specInfo.pMapEntries = specEntries;
+    specInfo.dataSize = sizeof(specData);
+    specInfo.pData = &specData;
+
+    VkPipelineShaderStageCreateInfo stages[2] = { pipelineInfo.pStages[0], pipelineInfo.pStages[1] };
+    stages[1].pSpecializationInfo = &specInfo;
+    pipelineInfo.pStages = stages;
+
+    for (int v = 0; v < ItemVariantCount; ++v) {
+        specData.specular = (v & ItemSpecular) ? VK_TRUE : VK_FALSE;
+        specData.pointLights = (v & ItemPointLights) ? VK_TRUE : VK_FALSE;
+#ifdef VK_EXT_graphics_pipeline_library
+        if (mPipelineLibraries) {
+            VkGraphicsPipelineCreateInfo fragmentInfo = pipelineInfo;
+            fragmentInfo.stageCount = 1;
+            fragmentInfo.pStages = &stages[1];
+            fragmentLibraries[v] = createItemLibrary(fragmentInfo, VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT);
+            pipelines[v] = linkItemPipeline(fragmentLibraries[v], false);
+            continue;
+        }
+#else
+        Q_UNUSED(fragmentLibraries);
+#endif
+        VkResult err = mDeviceFunctions->vkCreateGraphicsPipelines(logicalDevice, mPipelineCache, 1, &pipelineInfo, nullptr, &pipelines[v]);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create graphics pipeline: %d", err);
+    }
+}
+
+#ifdef VK_EXT_graphics_pipeline_library
+// The parts of info given by parts, linkable with the other item libraries.
+VkPipeline Renderer::createItemLibrary(VkGraphicsPipelineCreateInfo info, VkGraphicsPipelineLibraryFlagsEXT parts)
+{
+    VkGraphicsPipelineLibraryCreateInfoEXT libraryInfo{};
+    libraryInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT;
+    libraryInfo.flags = parts;
+    info.pNext = &libraryInfo;
+    // Retained so that optimizeItemPipelines() can link them once more, properly.
+    info.flags |= VK_PIPELINE_CREATE_LIBRARY_BIT_KHR | VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT;
+
+    VkPipeline library;
+    VkResult err = mDeviceFunctions->vkCreateGraphicsPipelines(mWindow->device(), mPipelineCache, 1, &info, nullptr, &library);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create graphics pipeline library: %d", err);
+    return library;
+}
+
+// Without link time optimization this is quick, there is no compiling left.
+VkPipeline Renderer::linkItemPipeline(VkPipeline fragmentLibrary, bool optimize)
+{
+    const VkPipeline libraries[] = { mItemMaterial.vertexInputLibrary, mItemMaterial.preRasterizationLibrary,
+                                     fragmentLibrary, mItemMaterial.fragmentOutputLibrary };
+    VkPipelineLibraryCreateInfoKHR linkInfo{};
+    linkInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR;
+    linkInfo.libraryCount = sizeof(libraries) / sizeof(libraries[0]);
+    linkInfo.pLibraries = libraries;
+
+    VkGraphicsPipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.pNext = &linkInfo;
+    pipelineInfo.flags = optimize ? VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT : 0;
+    pipelineInfo.layout = mItemMaterial.pipelineLayout;
+
+    VkPipeline pipeline;
+    VkResult err = mDeviceFunctions->vkCreateGraphicsPipelines(mWindow->device(), mPipelineCache, 1, &pipelineInfo, nullptr, &pipeline);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to link graphics pipeline: %d", err);
+    return pipeline;
+}
+#endif
+
+//Runs on a worker once the item pipelines are there, see initResources().
+//The quickly linked variants draw in the meantime, consumeInput() swaps
+//these in when they are done.
+void Renderer::optimizeItemPipelines()
+{
+#ifdef VK_EXT_graphics_pipeline_library
+    if (!mPipelineLibraries)
+        return;
+
+    for (int v = 0; v < ItemVariantCount; ++v) {
+        mItemMaterial.optimizedPipelines[0][v] = linkItemPipeline(mItemMaterial.fragmentLibraries[0][v], true);
+        mItemMaterial.optimizedPipelines[1][v] = linkItemPipeline(mItemMaterial.fragmentLibraries[1][v], true);
+    }
+#endif
+}
+
+//Runs on a worker of its own once the pipeline cache is created, see initResources().
 //Color shader for the floor
 void Renderer::createFloorPipeline()
 {
@@ -417,354 +872,1701 @@ void Renderer::createFloorPipeline()
         qFatal("Failed to create graphics pipeline: %d", err);
 }
 
-void Renderer::initSwapChainResources()
-{
-    mProj = mWindow->clipCorrectionMatrix();
-    const QSize sz = mWindow->swapChainImageSize();
-    mProj.perspective(45.0f, sz.width() / (float) sz.height(), 0.01f, 1000.0f);
-    markViewProjDirty();
-}
-
-void Renderer::releaseSwapChainResources()
+//Runs on a worker of its own once the pipeline cache is created, see initResources().
+//Compute shader for the frustum culling
+void Renderer::createCullPipeline()
 {
-    // It is important to finish the pending frame right here since this is the
-    // last opportunity to act with all resources intact.
-    mFrameWatcher.waitForFinished();
-    // Cannot count on the finished() signal being emitted before returning
-    // from here.
-    if (mFramePending) {
-        mFramePending = false;
-        mWindow->frameReady();
-    }
-}
+    VkDevice logicalDevice = mWindow->device();
+    const int concurrentFrameCount = mWindow->concurrentFrameCount();
 
-void Renderer::releaseResources()
-{
-    if (DBG)
-        qDebug("Renderer release");
+    // One descriptor set per concurrent frame, see CullFrame
+    VkDescriptorPoolSize descriptorPoolSizes[2]{};
+    descriptorPoolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorPoolSizes[0].descriptorCount = 5 * concurrentFrameCount;
+    descriptorPoolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    descriptorPoolSizes[1].descriptorCount = concurrentFrameCount;
 
-    mPipelinesFuture.waitForFinished();
+    VkDescriptorPoolCreateInfo descriptorPoolInfo{};
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.maxSets = concurrentFrameCount;
+    descriptorPoolInfo.poolSizeCount = sizeof(descriptorPoolSizes) / sizeof(descriptorPoolSizes[0]);
+    descriptorPoolInfo.pPoolSizes = descriptorPoolSizes;
 
-    VkDevice dev = mWindow->device();
+    VkResult err = mDeviceFunctions->vkCreateDescriptorPool(logicalDevice, &descriptorPoolInfo, nullptr, &mCullMaterial.descriptorPool);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create descriptor pool: %d", err);
 
-    if (mItemMaterial.descriptorSetLayout) {
-        mDeviceFunctions->vkDestroyDescriptorSetLayout(dev, mItemMaterial.descriptorSetLayout, nullptr);
-        mItemMaterial.descriptorSetLayout = VK_NULL_HANDLE;
+    // 0 = all instances, 1 = visible instances, 2 = indirect draw command,
+    // 3 = what passed the occlusion test before, 4 = the depth pyramid,
+    // 5 = the slot of each instance in its draw's bucket
+    VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[6]{};
+    for (uint32_t i = 0; i < 6; ++i) {
+        descriptorSetLayoutBindings[i].binding = i;
+        descriptorSetLayoutBindings[i].descriptorType = i != 4 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptorSetLayoutBindings[i].descriptorCount = 1;
+        descriptorSetLayoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
     }
 
-    if (mItemMaterial.descriptorPool) {
-        mDeviceFunctions->vkDestroyDescriptorPool(dev, mItemMaterial.descriptorPool, nullptr);
-        mItemMaterial.descriptorPool = VK_NULL_HANDLE;
-    }
+    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutInfo{};
+    descriptorSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptorSetLayoutInfo.bindingCount = sizeof(descriptorSetLayoutBindings) / sizeof(descriptorSetLayoutBindings[0]);
+    descriptorSetLayoutInfo.pBindings = descriptorSetLayoutBindings;
 
-    if (mItemMaterial.pipeline) {
-        mDeviceFunctions->vkDestroyPipeline(dev, mItemMaterial.pipeline, nullptr);
-        mItemMaterial.pipeline = VK_NULL_HANDLE;
-    }
+    err = mDeviceFunctions->vkCreateDescriptorSetLayout(logicalDevice, &descriptorSetLayoutInfo, nullptr, &mCullMaterial.descriptorSetLayout);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create descriptor set layout: %d", err);
 
-    if (mItemMaterial.pipelineLayout) {
-        mDeviceFunctions->vkDestroyPipelineLayout(dev, mItemMaterial.pipelineLayout, nullptr);
-        mItemMaterial.pipelineLayout = VK_NULL_HANDLE;
-    }
+    VkDescriptorSetLayout setLayouts[QVulkanWindow::MAX_CONCURRENT_FRAME_COUNT];
+    VkDescriptorSet sets[QVulkanWindow::MAX_CONCURRENT_FRAME_COUNT];
+    for (int i = 0; i < concurrentFrameCount; ++i)
+        setLayouts[i] = mCullMaterial.descriptorSetLayout;
 
-    if (mFloorMaterial.pipeline) {
-        mDeviceFunctions->vkDestroyPipeline(dev, mFloorMaterial.pipeline, nullptr);
-        mFloorMaterial.pipeline = VK_NULL_HANDLE;
-    }
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo{};
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.descriptorPool = mCullMaterial.descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = concurrentFrameCount;
+    descriptorSetAllocateInfo.pSetLayouts = setLayouts;
 
-    if (mFloorMaterial.pipelineLayout) {
-        mDeviceFunctions->vkDestroyPipelineLayout(dev, mFloorMaterial.pipelineLayout, nullptr);
-        mFloorMaterial.pipelineLayout = VK_NULL_HANDLE;
-    }
+    err = mDeviceFunctions->vkAllocateDescriptorSets(logicalDevice, &descriptorSetAllocateInfo, sets);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to allocate descriptor set: %d", err);
+    for (int i = 0; i < concurrentFrameCount; ++i)
+        mCullFrames[i].descriptorSet = sets[i];
 
-    if (mPipelineCache) {
-        mDeviceFunctions->vkDestroyPipelineCache(dev, mPipelineCache, nullptr);
-        mPipelineCache = VK_NULL_HANDLE;
-    }
+    // 6 frustum planes, the instance count and the mode, see cull.comp. The
+    // meshes and the matrix are in the indirect buffer, they would not fit
+    // into the 128 bytes every device supports.
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = 6 * 16 + 2 * 4;
 
-    if (mBlockVertexBuf) {
-        mDeviceFunctions->vkDestroyBuffer(dev, mBlockVertexBuf, nullptr);
-        mBlockVertexBuf = VK_NULL_HANDLE;
-    }
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &mCullMaterial.descriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
 
-    if (mLogoVertexBuf) {
-        mDeviceFunctions->vkDestroyBuffer(dev, mLogoVertexBuf, nullptr);
-        mLogoVertexBuf = VK_NULL_HANDLE;
-    }
+    err = mDeviceFunctions->vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &mCullMaterial.pipelineLayout);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create pipeline layout: %d", err);
 
-    if (mFloorVertexBuf) {
-        mDeviceFunctions->vkDestroyBuffer(dev, mFloorVertexBuf, nullptr);
-        mFloorVertexBuf = VK_NULL_HANDLE;
-    }
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = mCullMaterial.cs.data()->shaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = mCullMaterial.pipelineLayout;
 
-    if (mUniBuf) {
-        mDeviceFunctions->vkDestroyBuffer(dev, mUniBuf, nullptr);
-        mUniBuf = VK_NULL_HANDLE;
-    }
+    err = mDeviceFunctions->vkCreateComputePipelines(logicalDevice, mPipelineCache, 1, &pipelineInfo, nullptr, &mCullMaterial.pipeline);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create compute pipeline: %d", err);
+}
 
-    if (mBufMem) {
-        mDeviceFunctions->vkFreeMemory(dev, mBufMem, nullptr);
-        mBufMem = VK_NULL_HANDLE;
-    }
+//Runs once createCullPipeline() is done, it shares its descriptor sets.
+//Compute shader for the instance animation
+void Renderer::createAnimatePipeline()
+{
+    VkDevice logicalDevice = mWindow->device();
 
-    if (mInstBuf) {
-        mDeviceFunctions->vkDestroyBuffer(dev, mInstBuf, nullptr);
-        mInstBuf = VK_NULL_HANDLE;
-    }
+    // The instance count, see animate.comp.
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = 4;
 
-    if (mInstBufMem) {
-        mDeviceFunctions->vkFreeMemory(dev, mInstBufMem, nullptr);
-        mInstBufMem = VK_NULL_HANDLE;
-    }
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &mCullMaterial.descriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
 
-    if (mItemMaterial.vs.isValid()) {
-        mDeviceFunctions->vkDestroyShaderModule(dev, mItemMaterial.vs.data()->shaderModule, nullptr);
-        mItemMaterial.vs.reset();
-    }
-    if (mItemMaterial.fs.isValid()) {
-        mDeviceFunctions->vkDestroyShaderModule(dev, mItemMaterial.fs.data()->shaderModule, nullptr);
-        mItemMaterial.fs.reset();
-    }
+    VkResult err = mDeviceFunctions->vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &mAnimateMaterial.pipelineLayout);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create pipeline layout: %d", err);
 
-    if (mFloorMaterial.vs.isValid()) {
-        mDeviceFunctions->vkDestroyShaderModule(dev, mFloorMaterial.vs.data()->shaderModule, nullptr);
-        mFloorMaterial.vs.reset();
-    }
-    if (mFloorMaterial.fs.isValid()) {
-        mDeviceFunctions->vkDestroyShaderModule(dev, mFloorMaterial.fs.data()->shaderModule, nullptr);
-        mFloorMaterial.fs.reset();
-    }
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = mAnimateMaterial.cs.data()->shaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = mAnimateMaterial.pipelineLayout;
+
+    err = mDeviceFunctions->vkCreateComputePipelines(logicalDevice, mPipelineCache, 1, &pipelineInfo, nullptr, &mAnimateMaterial.pipeline);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create compute pipeline: %d", err);
 }
 
-void Renderer::ensureBuffers()
+//Runs on a worker of its own once the pipeline cache is created, see initResources().
+//Compute shader for the depth pyramid
+void Renderer::createHizPipeline()
 {
-    if (mBlockVertexBuf)
-        return;
-
-    VkDevice dev = mWindow->device();
-    const int concurrentFrameCount = mWindow->concurrentFrameCount();
+    VkDevice logicalDevice = mWindow->device();
 
-    // Vertex buffer for the block.
-    VkBufferCreateInfo bufInfo{};
-    bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    const int blockMeshByteCount = mBlockMesh.data()->vertexCount * 8 * sizeof(float);
-    bufInfo.size = blockMeshByteCount;
-    bufInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-    VkResult err = mDeviceFunctions->vkCreateBuffer(dev, &bufInfo, nullptr, &mBlockVertexBuf);
+    // Only ever fetched from.
+    VkSamplerCreateInfo samplerInfo{};
+    samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter = VK_FILTER_NEAREST;
+    samplerInfo.minFilter = VK_FILTER_NEAREST;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+    VkResult err = mDeviceFunctions->vkCreateSampler(logicalDevice, &samplerInfo, nullptr, &mHizMaterial.sampler);
     if (err != VK_SUCCESS)
-        qFatal("Failed to create vertex buffer: %d", err);
+        qFatal("Failed to create sampler: %d", err);
 
-    VkMemoryRequirements blockVertMemReq;
-    mDeviceFunctions->vkGetBufferMemoryRequirements(dev, mBlockVertexBuf, &blockVertMemReq);
+    // The images are written in ensureOcclusionTarget().
+    VkDescriptorPoolSize descriptorPoolSizes[2]{};
+    descriptorPoolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    descriptorPoolSizes[0].descriptorCount = HIZ_MAX_LEVELS;
+    descriptorPoolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    descriptorPoolSizes[1].descriptorCount = HIZ_MAX_LEVELS;
 
-    // Vertex buffer for the logo.
-    const int logoMeshByteCount = mLogoMesh.data()->vertexCount * 8 * sizeof(float);
-    bufInfo.size = logoMeshByteCount;
-    bufInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-    err = mDeviceFunctions->vkCreateBuffer(dev, &bufInfo, nullptr, &mLogoVertexBuf);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to create vertex buffer: %d", err);
-
-    VkMemoryRequirements logoVertMemReq;
-    mDeviceFunctions->vkGetBufferMemoryRequirements(dev, mLogoVertexBuf, &logoVertMemReq);
+    VkDescriptorPoolCreateInfo descriptorPoolInfo{};
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.maxSets = HIZ_MAX_LEVELS;
+    descriptorPoolInfo.poolSizeCount = sizeof(descriptorPoolSizes) / sizeof(descriptorPoolSizes[0]);
+    descriptorPoolInfo.pPoolSizes = descriptorPoolSizes;
 
-    // Vertex buffer for the floor.
-    bufInfo.size = sizeof(quadVert);
-    err = mDeviceFunctions->vkCreateBuffer(dev, &bufInfo, nullptr, &mFloorVertexBuf);
+    err = mDeviceFunctions->vkCreateDescriptorPool(logicalDevice, &descriptorPoolInfo, nullptr, &mHizMaterial.descriptorPool);
     if (err != VK_SUCCESS)
-        qFatal("Failed to create vertex buffer: %d", err);
+        qFatal("Failed to create descriptor pool: %d", err);
 
-    VkMemoryRequirements floorVertMemReq;
-    mDeviceFunctions->vkGetBufferMemoryRequirements(dev, mFloorVertexBuf, &floorVertMemReq);
+    // 0 = the level below, 1 = the level written
+    VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[2]{};
+    for (uint32_t i = 0; i < 2; ++i) {
+        descriptorSetLayoutBindings[i].binding = i;
+        descriptorSetLayoutBindings[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        descriptorSetLayoutBindings[i].descriptorCount = 1;
+        descriptorSetLayoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
 
-    // Uniform buffer. Instead of using multiple descriptor sets, we take a
-    // different approach: have a single dynamic uniform buffer and specify the
-    // active-frame-specific offset at the time of binding the descriptor set.
-    bufInfo.size = (mItemMaterial.vertUniSize + mItemMaterial.fragUniSize) * concurrentFrameCount;
-    bufInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-    err = mDeviceFunctions->vkCreateBuffer(dev, &bufInfo, nullptr, &mUniBuf);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to create uniform buffer: %d", err);
-
-    VkMemoryRequirements uniMemReq;
-    mDeviceFunctions->vkGetBufferMemoryRequirements(dev, mUniBuf, &uniMemReq);
-
-    // Allocate memory for everything at once.
-    VkDeviceSize logoVertStartOffset = aligned(0 + blockVertMemReq.size, logoVertMemReq.alignment);
-    VkDeviceSize floorVertStartOffset = aligned(logoVertStartOffset + logoVertMemReq.size, floorVertMemReq.alignment);
-    mItemMaterial.uniMemStartOffset = aligned(floorVertStartOffset + floorVertMemReq.size, uniMemReq.alignment);
-    VkMemoryAllocateInfo memAllocInfo = {
-        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        nullptr,
-        mItemMaterial.uniMemStartOffset + uniMemReq.size,
-        mWindow->hostVisibleMemoryIndex()
-    };
-    err = mDeviceFunctions->vkAllocateMemory(dev, &memAllocInfo, nullptr, &mBufMem);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to allocate memory: %d", err);
+    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutInfo{};
+    descriptorSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptorSetLayoutInfo.bindingCount = sizeof(descriptorSetLayoutBindings) / sizeof(descriptorSetLayoutBindings[0]);
+    descriptorSetLayoutInfo.pBindings = descriptorSetLayoutBindings;
 
-    err = mDeviceFunctions->vkBindBufferMemory(dev, mBlockVertexBuf, mBufMem, 0);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to bind vertex buffer memory: %d", err);
-    err = mDeviceFunctions->vkBindBufferMemory(dev, mLogoVertexBuf, mBufMem, logoVertStartOffset);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to bind vertex buffer memory: %d", err);
-    err = mDeviceFunctions->vkBindBufferMemory(dev, mFloorVertexBuf, mBufMem, floorVertStartOffset);
+    err = mDeviceFunctions->vkCreateDescriptorSetLayout(logicalDevice, &descriptorSetLayoutInfo, nullptr, &mHizMaterial.descriptorSetLayout);
     if (err != VK_SUCCESS)
-        qFatal("Failed to bind vertex buffer memory: %d", err);
-    err = mDeviceFunctions->vkBindBufferMemory(dev, mUniBuf, mBufMem, mItemMaterial.uniMemStartOffset);
-    if (err != VK_SUCCESS)
-        qFatal("Failed to bind uniform buffer memory: %d", err);
+        qFatal("Failed to create descriptor set layout: %d", err);
+
+    VkDescriptorSetLayout setLayouts[HIZ_MAX_LEVELS];
+    for (int i = 0; i < HIZ_MAX_LEVELS; ++i)
+        setLayouts[i] = mHizMaterial.descriptorSetLayout;
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo{};
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.descriptorPool = mHizMaterial.descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = HIZ_MAX_LEVELS;
+    descriptorSetAllocateInfo.pSetLayouts = setLayouts;
 
-    // Copy vertex data.
-    uint8_t* p{ nullptr };
-    err = mDeviceFunctions->vkMapMemory(dev, mBufMem, 0, mItemMaterial.uniMemStartOffset, 0, reinterpret_cast<void**>(&p));
+    err = mDeviceFunctions->vkAllocateDescriptorSets(logicalDevice, &descriptorSetAllocateInfo, mHizMaterial.descriptorSets);
     if (err != VK_SUCCESS)
-        qFatal("Failed to map memory: %d", err);
-    memcpy(p, mBlockMesh.data()->geom.constData(), blockMeshByteCount);
-    memcpy(p + logoVertStartOffset, mLogoMesh.data()->geom.constData(), logoMeshByteCount);
-    memcpy(p + floorVertStartOffset, quadVert, sizeof(quadVert));
-    mDeviceFunctions->vkUnmapMemory(dev, mBufMem);
+        qFatal("Failed to allocate descriptor set: %d", err);
 
-    // Write descriptors for the uniform buffers in the vertex and fragment shaders.
-    // OEF: I have done it the same way but only have it for Vertex shader for now.
-    VkDescriptorBufferInfo vertUniformBufferInfo{};
-    vertUniformBufferInfo.buffer = mUniBuf;
-    vertUniformBufferInfo.offset = 0;
-    vertUniformBufferInfo.range = mItemMaterial.vertUniSize;
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &mHizMaterial.descriptorSetLayout;
 
-    VkDescriptorBufferInfo fragUniformBufferInfo{};
-    fragUniformBufferInfo.buffer = mUniBuf;
-    fragUniformBufferInfo.offset = mItemMaterial.vertUniSize;
-    fragUniformBufferInfo.range = mItemMaterial.fragUniSize;
+    err = mDeviceFunctions->vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &mHizMaterial.pipelineLayout);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create pipeline layout: %d", err);
 
-    // I only have 1 for now, so not using array
-    VkWriteDescriptorSet writeDescriptorSet[2]{};
-    writeDescriptorSet[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writeDescriptorSet[0].dstSet = mItemMaterial.descriptorSet;
-    writeDescriptorSet[0].dstBinding = 0;
-    writeDescriptorSet[0].descriptorCount = 1;
-    writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
-    writeDescriptorSet[0].pBufferInfo = &vertUniformBufferInfo;
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = mHizMaterial.cs.data()->shaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = mHizMaterial.pipelineLayout;
 
-    writeDescriptorSet[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writeDescriptorSet[1].dstSet = mItemMaterial.descriptorSet;
-    writeDescriptorSet[1].dstBinding = 1;
-    writeDescriptorSet[1].descriptorCount = 1;
-    writeDescriptorSet[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
-    writeDescriptorSet[1].pBufferInfo = &fragUniformBufferInfo;
+    err = mDeviceFunctions->vkCreateComputePipelines(logicalDevice, mPipelineCache, 1, &pipelineInfo, nullptr, &mHizMaterial.pipeline);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create compute pipeline: %d", err);
+}
 
-    mDeviceFunctions->vkUpdateDescriptorSets(dev, 2, writeDescriptorSet, 0, nullptr);
+//Called from initResources(), before the item pipeline is created against it.
+//A single depth attachment, sampled afterwards.
+void Renderer::createOcclusionRenderPass()
+{
+    // Sampled depth is always there for D16, but D32 keeps things a few units
+    // behind an occluder from being culled with it.
+    VkFormatProperties formatProps;
+    mWindow->vulkanInstance()->functions()->vkGetPhysicalDeviceFormatProperties(mWindow->physicalDevice(), VK_FORMAT_D32_SFLOAT, &formatProps);
+    const VkFormatFeatureFlags wanted = VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+    mOcclusion.depthFormat = (formatProps.optimalTilingFeatures & wanted) == wanted ? VK_FORMAT_D32_SFLOAT : VK_FORMAT_D16_UNORM;
+
+    // The layouts around it are up to buildOcclusionCommands().
+    VkAttachmentDescription attachment{};
+    attachment.format = mOcclusion.depthFormat;
+    attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference depthRef = { 0, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL };
+
+    VkSubpassDescription subpass{};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.pDepthStencilAttachment = &depthRef;
+
+    VkRenderPassCreateInfo renderPassInfo{};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassInfo.attachmentCount = 1;
+    renderPassInfo.pAttachments = &attachment;
+    renderPassInfo.subpassCount = 1;
+    renderPassInfo.pSubpasses = &subpass;
+    VkResult err = mDeviceFunctions->vkCreateRenderPass(mWindow->device(), &renderPassInfo, nullptr, &mOcclusion.renderPass);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create render pass: %d", err);
 }
 
-void Renderer::ensureInstanceBuffer()
+//Runs on a worker of its own once the pipeline cache is created, see initResources().
+//Compute shader for the light culling
+void Renderer::createLightCullPipeline()
 {
-    if (mInstCount == mPreparedInstCount && mInstBuf)
-        return;
+    VkDevice logicalDevice = mWindow->device();
 
-    Q_ASSERT(mInstCount <= MAX_INSTANCES);
+    VkDescriptorPoolSize descriptorPoolSizes[1]{};
+    descriptorPoolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    descriptorPoolSizes[0].descriptorCount = 2;
+
+    VkDescriptorPoolCreateInfo descriptorPoolInfo{};
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.maxSets = 1; // the frame slot is in the dynamic offsets
+    descriptorPoolInfo.poolSizeCount = sizeof(descriptorPoolSizes) / sizeof(descriptorPoolSizes[0]);
+    descriptorPoolInfo.pPoolSizes = descriptorPoolSizes;
+
+    VkResult err = mDeviceFunctions->vkCreateDescriptorPool(logicalDevice, &descriptorPoolInfo, nullptr, &mLightCullMaterial.descriptorPool);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create descriptor pool: %d", err);
+
+    // 0 = the point lights, 1 = the lights of each cluster
+    VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[2]{};
+    for (uint32_t i = 0; i < 2; ++i) {
+        descriptorSetLayoutBindings[i].binding = i;
+        descriptorSetLayoutBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+        descriptorSetLayoutBindings[i].descriptorCount = 1;
+        descriptorSetLayoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+
+    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutInfo{};
+    descriptorSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptorSetLayoutInfo.bindingCount = sizeof(descriptorSetLayoutBindings) / sizeof(descriptorSetLayoutBindings[0]);
+    descriptorSetLayoutInfo.pBindings = descriptorSetLayoutBindings;
+
+    err = mDeviceFunctions->vkCreateDescriptorSetLayout(logicalDevice, &descriptorSetLayoutInfo, nullptr, &mLightCullMaterial.descriptorSetLayout);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create descriptor set layout: %d", err);
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo{};
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.descriptorPool = mLightCullMaterial.descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = 1;
+    descriptorSetAllocateInfo.pSetLayouts = &mLightCullMaterial.descriptorSetLayout;
+
+    err = mDeviceFunctions->vkAllocateDescriptorSets(logicalDevice, &descriptorSetAllocateInfo, &mLightCullMaterial.descriptorSet);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to allocate descriptor set: %d", err);
+
+    // The view matrix, the cluster grid and the light count, see lightcull.comp.
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = 64 + 3 * 8 + 4;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &mLightCullMaterial.descriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+    err = mDeviceFunctions->vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &mLightCullMaterial.pipelineLayout);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create pipeline layout: %d", err);
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = mLightCullMaterial.cs.data()->shaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = mLightCullMaterial.pipelineLayout;
+
+    err = mDeviceFunctions->vkCreateComputePipelines(logicalDevice, mPipelineCache, 1, &pipelineInfo, nullptr, &mLightCullMaterial.pipeline);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create compute pipeline: %d", err);
+}
+
+//Runs on a worker of its own once the pipeline cache is created, see initResources().
+//The upscale pass, drawn in the default render pass
+void Renderer::createUpscalePipeline()
+{
+    VkDevice logicalDevice = mWindow->device();
+
+    // Bilinear, the offscreen target is only ever scaled up.
+    VkSamplerCreateInfo samplerInfo{};
+    samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter = VK_FILTER_LINEAR;
+    samplerInfo.minFilter = VK_FILTER_LINEAR;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.maxLod = 0.25f;
+    VkResult err = mDeviceFunctions->vkCreateSampler(logicalDevice, &samplerInfo, nullptr, &mUpscaleMaterial.sampler);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create sampler: %d", err);
+
+    // The image is written in ensureOffscreenTarget().
+    VkDescriptorPoolSize descriptorPoolSizes[1]{};
+    descriptorPoolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    descriptorPoolSizes[0].descriptorCount = 1;
+
+    VkDescriptorPoolCreateInfo descriptorPoolInfo{};
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.maxSets = 1;
+    descriptorPoolInfo.poolSizeCount = sizeof(descriptorPoolSizes) / sizeof(descriptorPoolSizes[0]);
+    descriptorPoolInfo.pPoolSizes = descriptorPoolSizes;
+
+    err = mDeviceFunctions->vkCreateDescriptorPool(logicalDevice, &descriptorPoolInfo, nullptr, &mUpscaleMaterial.descriptorPool);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create descriptor pool: %d", err);
+
+    VkDescriptorSetLayoutBinding descriptorSetLayoutBinding{};
+    descriptorSetLayoutBinding.binding = 0;
+    descriptorSetLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    descriptorSetLayoutBinding.descriptorCount = 1;
+    descriptorSetLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutInfo{};
+    descriptorSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptorSetLayoutInfo.bindingCount = 1;
+    descriptorSetLayoutInfo.pBindings = &descriptorSetLayoutBinding;
+
+    err = mDeviceFunctions->vkCreateDescriptorSetLayout(logicalDevice, &descriptorSetLayoutInfo, nullptr, &mUpscaleMaterial.descriptorSetLayout);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create descriptor set layout: %d", err);
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo{};
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.descriptorPool = mUpscaleMaterial.descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = 1;
+    descriptorSetAllocateInfo.pSetLayouts = &mUpscaleMaterial.descriptorSetLayout;
+
+    err = mDeviceFunctions->vkAllocateDescriptorSets(logicalDevice, &descriptorSetAllocateInfo, &mUpscaleMaterial.descriptorSet);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to allocate descriptor set: %d", err);
+
+    // The part of the target to sample, see upscale.frag.
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = 2 * 8;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &mUpscaleMaterial.descriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+    err = mDeviceFunctions->vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &mUpscaleMaterial.pipelineLayout);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create pipeline layout: %d", err);
+
+    VkPipelineShaderStageCreateInfo shaderStages[2]{};
+    shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shaderStages[0].module = mUpscaleMaterial.vs.data()->shaderModule;
+    shaderStages[0].pName = "main";
+    shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shaderStages[1].module = mUpscaleMaterial.fs.data()->shaderModule;
+    shaderStages[1].pName = "main";
+
+    // No vertex input, the vertex shader makes up the triangle.
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+    VkGraphicsPipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.pVertexInputState = &vertexInputInfo;
+
+    VkPipelineViewportStateCreateInfo viewport{};
+    viewport.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport.viewportCount = 1;
+    viewport.scissorCount = 1;
+    pipelineInfo.pViewportState = &viewport;
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+    inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    pipelineInfo.pInputAssemblyState = &inputAssembly;
+
+    VkPipelineRasterizationStateCreateInfo rasterization{};
+    rasterization.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterization.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterization.cullMode = VK_CULL_MODE_NONE;
+    rasterization.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    rasterization.lineWidth = 1.0f;
+    pipelineInfo.pRasterizationState = &rasterization;
+
+    VkPipelineMultisampleStateCreateInfo multisample{};
+    multisample.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisample.rasterizationSamples = mWindow->sampleCountFlagBits();
+    pipelineInfo.pMultisampleState = &multisample;
+
+    // Covers everything, nothing to test against.
+    VkPipelineDepthStencilStateCreateInfo depthStencil{};
+    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    pipelineInfo.pDepthStencilState = &depthStencil;
+
+    VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+    colorBlendAttachment.colorWriteMask = 0xF;
+
+    VkPipelineColorBlendStateCreateInfo colorBlend{};
+    colorBlend.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorBlend.attachmentCount = 1;
+    colorBlend.pAttachments = &colorBlendAttachment;
+    pipelineInfo.pColorBlendState = &colorBlend;
+
+    VkDynamicState dynamicEnable[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+    VkPipelineDynamicStateCreateInfo pipelineDynamicState{};
+    pipelineDynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    pipelineDynamicState.dynamicStateCount = sizeof(dynamicEnable) / sizeof(VkDynamicState);
+    pipelineDynamicState.pDynamicStates = dynamicEnable;
+    pipelineInfo.pDynamicState = &pipelineDynamicState;
+    pipelineInfo.layout = mUpscaleMaterial.pipelineLayout;
+    pipelineInfo.renderPass = mWindow->defaultRenderPass();
+
+    err = mDeviceFunctions->vkCreateGraphicsPipelines(logicalDevice, mPipelineCache, 1, &pipelineInfo, nullptr, &mUpscaleMaterial.pipeline);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create graphics pipeline: %d", err);
+}
+
+void Renderer::initSwapChainResources()
+{
+    mProj = mWindow->clipCorrectionMatrix();
+    const QSize sz = mWindow->swapChainImageSize();
+    mProj.perspective(45.0f, sz.width() / (float) sz.height(), 0.01f, 1000.0f);
+    // An error of e model units covers e * height * mProj(1, 1) / (2 * depth)
+    // pixels, the clip correction flips the sign.
+    mLodScale = sz.height() * qAbs(mProj(1, 1)) / (2.0f * LOD_ERROR_PIXELS);
+    // The governor keeps its level, updateRenderSize() applies it to the new size.
+    mRenderSize = QSize();
+    markViewProjDirty();
+    // No prepareFrame() is running, releaseSwapChainResources() waited for it.
+    if (mFramePrepared)
+        updateFrameMatrices();
+}
+
+void Renderer::releaseSwapChainResources()
+{
+    // It is important to finish the pending frame right here since this is the
+    // last opportunity to act with all resources intact.
+    mFrameWatcher.waitForFinished();
+    mPrepareFuture.waitForFinished();
+    // Cannot count on the finished() signal being emitted before returning
+    // from here.
+    if (mFramePending) {
+        mFramePending = false;
+        mTransfer.submitGraphicsWait();
+        mWindow->frameReady();
+    }
+
+    // Sized for the old swapchain.
+    releaseOffscreenTarget();
+    releaseOcclusionTarget();
+}
+
+void Renderer::releaseResources()
+{
+    if (DBG)
+        qDebug("Renderer release");
+
+    waitForPipelines();
+    mItemMaterial.optimizeFuture.waitForFinished();
+    mPrepareFuture.waitForFinished();
+
+    VkDevice dev = mWindow->device();
+
+    releaseChunkCommands();
+    mProfiler.releaseResources();
+
+    if (mItemMaterial.descriptorSetLayout) {
+        mDeviceFunctions->vkDestroyDescriptorSetLayout(dev, mItemMaterial.descriptorSetLayout, nullptr);
+        mItemMaterial.descriptorSetLayout = VK_NULL_HANDLE;
+    }
+
+    if (mItemMaterial.descriptorPool) {
+        mDeviceFunctions->vkDestroyDescriptorPool(dev, mItemMaterial.descriptorPool, nullptr);
+        mItemMaterial.descriptorPool = VK_NULL_HANDLE;
+    }
+
+    for (VkPipeline &pipeline : mItemMaterial.pipelines) {
+        if (pipeline) {
+            mDeviceFunctions->vkDestroyPipeline(dev, pipeline, nullptr);
+            pipeline = VK_NULL_HANDLE;
+        }
+    }
+
+    if (mItemMaterial.prepassPipeline) {
+        mDeviceFunctions->vkDestroyPipeline(dev, mItemMaterial.prepassPipeline, nullptr);
+        mItemMaterial.prepassPipeline = VK_NULL_HANDLE;
+    }
+
+    for (VkPipeline &pipeline : mItemMaterial.shadePipelines) {
+        if (pipeline) {
+            mDeviceFunctions->vkDestroyPipeline(dev, pipeline, nullptr);
+            pipeline = VK_NULL_HANDLE;
+        }
+    }
+
+    // The libraries after what was linked from them.
+    for (int i = 0; i < 2; ++i) {
+        for (VkPipeline &pipeline : mItemMaterial.optimizedPipelines[i]) {
+            if (pipeline) {
+                mDeviceFunctions->vkDestroyPipeline(dev, pipeline, nullptr);
+                pipeline = VK_NULL_HANDLE;
+            }
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        for (VkPipeline &pipeline : mItemMaterial.fragmentLibraries[i]) {
+            if (pipeline) {
+                mDeviceFunctions->vkDestroyPipeline(dev, pipeline, nullptr);
+                pipeline = VK_NULL_HANDLE;
+            }
+        }
+    }
+    for (VkPipeline *library : { &mItemMaterial.vertexInputLibrary, &mItemMaterial.preRasterizationLibrary,
+                                 &mItemMaterial.fragmentOutputLibrary }) {
+        if (*library) {
+            mDeviceFunctions->vkDestroyPipeline(dev, *library, nullptr);
+            *library = VK_NULL_HANDLE;
+        }
+    }
+
+    if (mItemMaterial.occluderPipeline) {
+        mDeviceFunctions->vkDestroyPipeline(dev, mItemMaterial.occluderPipeline, nullptr);
+        mItemMaterial.occluderPipeline = VK_NULL_HANDLE;
+    }
+
+    if (mItemMaterial.pipelineLayout) {
+        mDeviceFunctions->vkDestroyPipelineLayout(dev, mItemMaterial.pipelineLayout, nullptr);
+        mItemMaterial.pipelineLayout = VK_NULL_HANDLE;
+    }
+
+    if (mFloorMaterial.pipeline) {
+        mDeviceFunctions->vkDestroyPipeline(dev, mFloorMaterial.pipeline, nullptr);
+        mFloorMaterial.pipeline = VK_NULL_HANDLE;
+    }
+
+    if (mFloorMaterial.pipelineLayout) {
+        mDeviceFunctions->vkDestroyPipelineLayout(dev, mFloorMaterial.pipelineLayout, nullptr);
+        mFloorMaterial.pipelineLayout = VK_NULL_HANDLE;
+    }
+
+    if (mCullMaterial.pipeline) {
+        mDeviceFunctions->vkDestroyPipeline(dev, mCullMaterial.pipeline, nullptr);
+        mCullMaterial.pipeline = VK_NULL_HANDLE;
+    }
+
+    if (mCullMaterial.pipelineLayout) {
+        mDeviceFunctions->vkDestroyPipelineLayout(dev, mCullMaterial.pipelineLayout, nullptr);
+        mCullMaterial.pipelineLayout = VK_NULL_HANDLE;
+    }
+
+    if (mAnimateMaterial.pipeline) {
+        mDeviceFunctions->vkDestroyPipeline(dev, mAnimateMaterial.pipeline, nullptr);
+        mAnimateMaterial.pipeline = VK_NULL_HANDLE;
+    }
+
+    if (mAnimateMaterial.pipelineLayout) {
+        mDeviceFunctions->vkDestroyPipelineLayout(dev, mAnimateMaterial.pipelineLayout, nullptr);
+        mAnimateMaterial.pipelineLayout = VK_NULL_HANDLE;
+    }
+
+    if (mLightCullMaterial.pipeline) {
+        mDeviceFunctions->vkDestroyPipeline(dev, mLightCullMaterial.pipeline, nullptr);
+        mLightCullMaterial.pipeline = VK_NULL_HANDLE;
+    }
+
+    if (mLightCullMaterial.pipelineLayout) {
+        mDeviceFunctions->vkDestroyPipelineLayout(dev, mLightCullMaterial.pipelineLayout, nullptr);
+        mLightCullMaterial.pipelineLayout = VK_NULL_HANDLE;
+    }
+
+    if (mLightCullMaterial.descriptorSetLayout) {
+        mDeviceFunctions->vkDestroyDescriptorSetLayout(dev, mLightCullMaterial.descriptorSetLayout, nullptr);
+        mLightCullMaterial.descriptorSetLayout = VK_NULL_HANDLE;
+    }
+
+    if (mLightCullMaterial.descriptorPool) {
+        mDeviceFunctions->vkDestroyDescriptorPool(dev, mLightCullMaterial.descriptorPool, nullptr);
+        mLightCullMaterial.descriptorPool = VK_NULL_HANDLE;
+        mLightCullMaterial.descriptorSet = VK_NULL_HANDLE; // freed with the pool
+    }
+
+    if (mHizMaterial.pipeline) {
+        mDeviceFunctions->vkDestroyPipeline(dev, mHizMaterial.pipeline, nullptr);
+        mHizMaterial.pipeline = VK_NULL_HANDLE;
+    }
+
+    if (mHizMaterial.pipelineLayout) {
+        mDeviceFunctions->vkDestroyPipelineLayout(dev, mHizMaterial.pipelineLayout, nullptr);
+        mHizMaterial.pipelineLayout = VK_NULL_HANDLE;
+    }
+
+    if (mHizMaterial.descriptorSetLayout) {
+        mDeviceFunctions->vkDestroyDescriptorSetLayout(dev, mHizMaterial.descriptorSetLayout, nullptr);
+        mHizMaterial.descriptorSetLayout = VK_NULL_HANDLE;
+    }
+
+    if (mHizMaterial.descriptorPool) {
+        mDeviceFunctions->vkDestroyDescriptorPool(dev, mHizMaterial.descriptorPool, nullptr);
+        mHizMaterial.descriptorPool = VK_NULL_HANDLE;
+        for (VkDescriptorSet &set : mHizMaterial.descriptorSets)
+            set = VK_NULL_HANDLE; // freed with the pool
+    }
+
+    if (mHizMaterial.sampler) {
+        mDeviceFunctions->vkDestroySampler(dev, mHizMaterial.sampler, nullptr);
+        mHizMaterial.sampler = VK_NULL_HANDLE;
+    }
+
+    if (mUpscaleMaterial.pipeline) {
+        mDeviceFunctions->vkDestroyPipeline(dev, mUpscaleMaterial.pipeline, nullptr);
+        mUpscaleMaterial.pipeline = VK_NULL_HANDLE;
+    }
+
+    if (mUpscaleMaterial.pipelineLayout) {
+        mDeviceFunctions->vkDestroyPipelineLayout(dev, mUpscaleMaterial.pipelineLayout, nullptr);
+        mUpscaleMaterial.pipelineLayout = VK_NULL_HANDLE;
+    }
+
+    if (mUpscaleMaterial.descriptorSetLayout) {
+        mDeviceFunctions->vkDestroyDescriptorSetLayout(dev, mUpscaleMaterial.descriptorSetLayout, nullptr);
+        mUpscaleMaterial.descriptorSetLayout = VK_NULL_HANDLE;
+    }
+
+    if (mUpscaleMaterial.descriptorPool) {
+        mDeviceFunctions->vkDestroyDescriptorPool(dev, mUpscaleMaterial.descriptorPool, nullptr);
+        mUpscaleMaterial.descriptorPool = VK_NULL_HANDLE;
+        mUpscaleMaterial.descriptorSet = VK_NULL_HANDLE; // freed with the pool
+    }
+
+    if (mUpscaleMaterial.sampler) {
+        mDeviceFunctions->vkDestroySampler(dev, mUpscaleMaterial.sampler, nullptr);
+        mUpscaleMaterial.sampler = VK_NULL_HANDLE;
+    }
+
+    if (mCullMaterial.descriptorSetLayout) {
+        mDeviceFunctions->vkDestroyDescriptorSetLayout(dev, mCullMaterial.descriptorSetLayout, nullptr);
+        mCullMaterial.descriptorSetLayout = VK_NULL_HANDLE;
+    }
+
+    if (mCullMaterial.descriptorPool) {
+        mDeviceFunctions->vkDestroyDescriptorPool(dev, mCullMaterial.descriptorPool, nullptr);
+        mCullMaterial.descriptorPool = VK_NULL_HANDLE;
+    }
+
+    for (CullFrame &cullFrame : mCullFrames) {
+        mAllocator.destroyBuffer(&cullFrame.visibleBuf, &cullFrame.visibleBufAlloc);
+        cullFrame.visibleCapacity = 0;
+        mAllocator.destroyBuffer(&cullFrame.slotBuf, &cullFrame.slotBufAlloc);
+        mAllocator.destroyBuffer(&cullFrame.indirectBuf, &cullFrame.indirectBufAlloc);
+        mAllocator.destroyBuffer(&cullFrame.visibilityBuf, &cullFrame.visibilityBufAlloc);
+        cullFrame.visibilityCleared = false;
+        cullFrame.descriptorSet = VK_NULL_HANDLE; // freed with the pool
+        cullFrame.instanceStoreGeneration = 0;
+        cullFrame.occlusionGeneration = 0;
+    }
+
+    if (mPipelineCache) {
+        savePipelineCache();
+        mDeviceFunctions->vkDestroyPipelineCache(dev, mPipelineCache, nullptr);
+        mPipelineCache = VK_NULL_HANDLE;
+    }
+
+    mAllocator.destroyBuffer(&mArenaVertexBuf, &mArenaVertexBufAlloc);
+    mAllocator.destroyBuffer(&mArenaIndexBuf, &mArenaIndexBufAlloc);
+    mAllocator.destroyBuffer(&mFloorVertexBuf, &mFloorVertexBufAlloc);
+    mAllocator.destroyBuffer(&mUniBuf, &mUniBufAlloc);
+    mAllocator.destroyBuffer(&mLightBuf, &mLightBufAlloc);
+    mAllocator.destroyBuffer(&mClusterBuf, &mClusterBufAlloc);
+    releaseOffscreenTarget(); // normally gone with the swapchain already
+    releaseOcclusionTarget();
+    if (mOcclusion.renderPass) {
+        mDeviceFunctions->vkDestroyRenderPass(dev, mOcclusion.renderPass, nullptr);
+        mOcclusion.renderPass = VK_NULL_HANDLE;
+    }
+
+    mInstances.releaseResources();
+    mTransfer.releaseResources();
+    mAllocator.releaseResources();
+
+    if (mItemMaterial.vs.isValid()) {
+        mDeviceFunctions->vkDestroyShaderModule(dev, mItemMaterial.vs.data()->shaderModule, nullptr);
+        mItemMaterial.vs.reset();
+    }
+    if (mItemMaterial.fs.isValid()) {
+        mDeviceFunctions->vkDestroyShaderModule(dev, mItemMaterial.fs.data()->shaderModule, nullptr);
+        mItemMaterial.fs.reset();
+    }
+    if (mItemMaterial.prepassVs.isValid()) {
+        mDeviceFunctions->vkDestroyShaderModule(dev, mItemMaterial.prepassVs.data()->shaderModule, nullptr);
+        mItemMaterial.prepassVs.reset();
+    }
+
+    if (mFloorMaterial.vs.isValid()) {
+        mDeviceFunctions->vkDestroyShaderModule(dev, mFloorMaterial.vs.data()->shaderModule, nullptr);
+        mFloorMaterial.vs.reset();
+    }
+    if (mFloorMaterial.fs.isValid()) {
+        mDeviceFunctions->vkDestroyShaderModule(dev, mFloorMaterial.fs.data()->shaderModule, nullptr);
+        mFloorMaterial.fs.reset();
+    }
+
+    if (mCullMaterial.cs.isValid()) {
+        mDeviceFunctions->vkDestroyShaderModule(dev, mCullMaterial.cs.data()->shaderModule, nullptr);
+        mCullMaterial.cs.reset();
+    }
+
+    if (mAnimateMaterial.cs.isValid()) {
+        mDeviceFunctions->vkDestroyShaderModule(dev, mAnimateMaterial.cs.data()->shaderModule, nullptr);
+        mAnimateMaterial.cs.reset();
+    }
+
+    if (mLightCullMaterial.cs.isValid()) {
+        mDeviceFunctions->vkDestroyShaderModule(dev, mLightCullMaterial.cs.data()->shaderModule, nullptr);
+        mLightCullMaterial.cs.reset();
+    }
+
+    if (mHizMaterial.cs.isValid()) {
+        mDeviceFunctions->vkDestroyShaderModule(dev, mHizMaterial.cs.data()->shaderModule, nullptr);
+        mHizMaterial.cs.reset();
+    }
+
+    if (mUpscaleMaterial.vs.isValid()) {
+        mDeviceFunctions->vkDestroyShaderModule(dev, mUpscaleMaterial.vs.data()->shaderModule, nullptr);
+        mUpscaleMaterial.vs.reset();
+    }
+    if (mUpscaleMaterial.fs.isValid()) {
+        mDeviceFunctions->vkDestroyShaderModule(dev, mUpscaleMaterial.fs.data()->shaderModule, nullptr);
+        mUpscaleMaterial.fs.reset();
+    }
+}
+
+void Renderer::ensureBuffers()
+{
+    if (mArenaVertexBuf)
+        return;
 
     VkDevice dev = mWindow->device();
+    const int concurrentFrameCount = mWindow->concurrentFrameCount();
+
+    // Lay out the arena: the meshes one after the other, with 16 bit indices
+    // unless one of them needs 32. The draws follow the same order.
+    const MeshData *meshes[ItemMeshCount];
+    VkDeviceSize arenaVertexSize = 0;
+    int arenaIndexCount = 0;
+    int arenaIndexSize = 2;
+    mDrawCount = 0;
+    for (int m = 0; m < ItemMeshCount; ++m) {
+        meshes[m] = mItemMeshes[m].data();
+        mArenaRanges[m].vertexOffset = int32_t(arenaVertexSize / PACKED_VERTEX_BYTE_COUNT);
+        mArenaRanges[m].firstIndex = uint32_t(arenaIndexCount);
+        arenaVertexSize += meshes[m]->geom.size();
+        arenaIndexCount += meshes[m]->indices.size() / meshes[m]->indexSize;
+        arenaIndexSize = qMax(arenaIndexSize, meshes[m]->indexSize);
+        mFirstDraw[m] = mDrawCount;
+        mDrawCount += meshes[m]->lodCount;
+    }
+    mArenaIndexType = arenaIndexSize == 2 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+
+    // The arena and the floor. They never change, so they live in device
+    // local memory and get there through a staging buffer. The arena is
+    // filled mesh by mesh below.
+    struct {
+        VkBuffer *buf;
+        MemoryAllocator::Allocation *alloc;
+        const void *data;
+        VkDeviceSize size;
+        VkBufferUsageFlags usage;
+        VkDeviceSize stagingOffset;
+    } geomBufs[] = {
+        { &mArenaVertexBuf, &mArenaVertexBufAlloc, nullptr, arenaVertexSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 0 },
+        { &mArenaIndexBuf, &mArenaIndexBufAlloc, nullptr, VkDeviceSize(arenaIndexCount) * arenaIndexSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, 0 },
+        { &mFloorVertexBuf, &mFloorVertexBufAlloc, quadVert, sizeof(quadVert), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 0 }
+    };
+
+    VkDeviceSize stagingSize = 0;
+    for (auto &g : geomBufs) {
+        *g.buf = mAllocator.createBuffer(g.size, g.usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                         MemoryAllocator::DeviceLocal, g.alloc, "geometry");
+        g.stagingOffset = stagingSize;
+        stagingSize = aligned(stagingSize + g.size, 16);
+    }
+
+    // Staging buffer with all of them one after the other, only needed until the copy below has finished.
+    MemoryAllocator::Allocation stagingAlloc;
+    VkBuffer stagingBuf = mAllocator.createBuffer(stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                  MemoryAllocator::HostVisible, &stagingAlloc, "staging");
+
+    // Copy vertex and index data.
+    uint8_t *p = stagingAlloc.mapped;
+    for (const auto &g : geomBufs) {
+        if (g.data)
+            memcpy(p + g.stagingOffset, g.data, g.size);
+    }
+    uint8_t *arenaVertices = p + geomBufs[0].stagingOffset;
+    uint8_t *arenaIndices = p + geomBufs[1].stagingOffset;
+    for (const MeshData *md : meshes) {
+        memcpy(arenaVertices, md->geom.constData(), md->geom.size());
+        arenaVertices += md->geom.size();
+        const int indexCount = md->indices.size() / md->indexSize;
+        if (md->indexSize == arenaIndexSize) {
+            memcpy(arenaIndices, md->indices.constData(), md->indices.size());
+        } else {
+            // Widened to the 32 bit indices of the other mesh.
+            for (int i = 0; i < indexCount; ++i) {
+                quint16 v16;
+                memcpy(&v16, md->indices.constData() + i * 2, 2);
+                const quint32 v32 = v16;
+                memcpy(arenaIndices + i * 4, &v32, 4);
+            }
+        }
+        arenaIndices += indexCount * arenaIndexSize;
+    }
+    mAllocator.flush(stagingAlloc, 0, stagingSize);
+
+    VkCommandBuffer uploadCb = beginOneShotCommands();
+    for (const auto &g : geomBufs) {
+        VkBufferCopy region = { g.stagingOffset, 0, g.size };
+        mDeviceFunctions->vkCmdCopyBuffer(uploadCb, stagingBuf, *g.buf, 1, &region);
+    }
+
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+    mDeviceFunctions->vkCmdPipelineBarrier(uploadCb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                                           0, 1, &barrier, 0, nullptr, 0, nullptr);
+    endOneShotCommands(uploadCb);
+
+    mAllocator.destroyBuffer(&stagingBuf, &stagingAlloc);
+
+    // Uniform buffer. Instead of using multiple descriptor sets, we take a
+    // different approach: have a single dynamic uniform buffer and specify the
+    // active-frame-specific offset at the time of binding the descriptor set.
+    // Written every frame, so this is the only one left in host visible memory.
+    // The allocator keeps it mapped until releaseResources().
+    mUniBuf = mAllocator.createBuffer((mItemMaterial.vertUniSize + mItemMaterial.fragUniSize) * concurrentFrameCount,
+                                      VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, MemoryAllocator::HostVisible,
+                                      &mUniBufAlloc, "uniform");
+
+    // The point lights are written every frame too. The clusters only ever
+    // see the GPU, they are filled by the light culling and read by the items.
+    const VkDeviceSize storageAlignment = mWindow->physicalDeviceProperties()->limits.minStorageBufferOffsetAlignment;
+    mLightRegionSize = aligned(MAX_LIGHT_COUNT * PER_LIGHT_DATA_SIZE, storageAlignment);
+    mLightBuf = mAllocator.createBuffer(mLightRegionSize * concurrentFrameCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                        MemoryAllocator::HostVisible, &mLightBufAlloc, "light");
+    mClusterRegionSize = aligned(VkDeviceSize(CLUSTER_COUNT) * (MAX_LIGHTS_PER_CLUSTER + 1) * sizeof(uint32_t), storageAlignment);
+    mClusterBuf = mAllocator.createBuffer(mClusterRegionSize * concurrentFrameCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                          MemoryAllocator::DeviceLocal, &mClusterBufAlloc, "cluster");
+
+    if (DBG)
+        mAllocator.dump();
+
+    // Write descriptors for the uniform buffers in the vertex and fragment shaders.
+    // OEF: I have done it the same way but only have it for Vertex shader for now.
+    // The set is allocated in createItemPipeline(), which may still be running.
+    mItemMaterial.pipelineFuture.waitForFinished();
+    VkDescriptorBufferInfo vertUniformBufferInfo{};
+    vertUniformBufferInfo.buffer = mUniBuf;
+    vertUniformBufferInfo.offset = 0;
+    vertUniformBufferInfo.range = mItemMaterial.vertUniSize;
+
+    VkDescriptorBufferInfo fragUniformBufferInfo{};
+    fragUniformBufferInfo.buffer = mUniBuf;
+    fragUniformBufferInfo.offset = mItemMaterial.vertUniSize;
+    fragUniformBufferInfo.range = mItemMaterial.fragUniSize;
+
+    VkDescriptorBufferInfo lightBufferInfo{};
+    lightBufferInfo.buffer = mLightBuf;
+    lightBufferInfo.offset = 0;
+    lightBufferInfo.range = mLightRegionSize;
+
+    VkDescriptorBufferInfo clusterBufferInfo{};
+    clusterBufferInfo.buffer = mClusterBuf;
+    clusterBufferInfo.offset = 0;
+    clusterBufferInfo.range = mClusterRegionSize;
+
+    VkWriteDescriptorSet writeDescriptorSet[6]{};
+    writeDescriptorSet[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeDescriptorSet[0].dstSet = mItemMaterial.descriptorSet;
+    writeDescriptorSet[0].dstBinding = 0;
+    writeDescriptorSet[0].descriptorCount = 1;
+    writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    writeDescriptorSet[0].pBufferInfo = &vertUniformBufferInfo;
+
+    writeDescriptorSet[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeDescriptorSet[1].dstSet = mItemMaterial.descriptorSet;
+    writeDescriptorSet[1].dstBinding = 1;
+    writeDescriptorSet[1].descriptorCount = 1;
+    writeDescriptorSet[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    writeDescriptorSet[1].pBufferInfo = &fragUniformBufferInfo;
+
+    // The same two buffers for the items and for the light culling, the
+    // light culling's set comes from createLightCullPipeline().
+    mLightCullMaterial.pipelineFuture.waitForFinished();
+    const VkDescriptorBufferInfo *storageBufferInfos[] = { &lightBufferInfo, &clusterBufferInfo };
+    for (int i = 0; i < 4; ++i) {
+        VkWriteDescriptorSet &w(writeDescriptorSet[2 + i]);
+        w.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        w.dstSet = i < 2 ? mItemMaterial.descriptorSet : mLightCullMaterial.descriptorSet;
+        w.dstBinding = i < 2 ? 2 + i : i - 2;
+        w.descriptorCount = 1;
+        w.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+        w.pBufferInfo = storageBufferInfos[i % 2];
+    }
+
+    mDeviceFunctions->vkUpdateDescriptorSets(dev, 6, writeDescriptorSet, 0, nullptr);
+}
+
+//For uploads that happen once. Called on the render thread while the GUI
+//thread waits for the frame, so nothing else is using the graphics queue.
+VkCommandBuffer Renderer::beginOneShotCommands()
+{
+    VkDevice dev = mWindow->device();
+
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = mWindow->graphicsQueueFamilyIndex();
+    VkResult err = mDeviceFunctions->vkCreateCommandPool(dev, &poolInfo, nullptr, &mOneShotCommandPool);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create command pool: %d", err);
+
+    VkCommandBufferAllocateInfo cbInfo{};
+    cbInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cbInfo.commandPool = mOneShotCommandPool;
+    cbInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cbInfo.commandBufferCount = 1;
+    VkCommandBuffer cb;
+    err = mDeviceFunctions->vkAllocateCommandBuffers(dev, &cbInfo, &cb);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to allocate command buffer: %d", err);
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    mDeviceFunctions->vkBeginCommandBuffer(cb, &beginInfo);
+    return cb;
+}
+
+//Submits and waits, so whatever the commands read from can be freed afterwards.
+void Renderer::endOneShotCommands(VkCommandBuffer cb)
+{
+    VkDevice dev = mWindow->device();
+
+    VkResult err = mDeviceFunctions->vkEndCommandBuffer(cb);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to end command buffer: %d", err);
+
+    VkFenceCreateInfo fenceInfo{};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VkFence fence;
+    err = mDeviceFunctions->vkCreateFence(dev, &fenceInfo, nullptr, &fence);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create fence: %d", err);
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cb;
+    err = mDeviceFunctions->vkQueueSubmit(mWindow->graphicsQueue(), 1, &submitInfo, fence);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to submit upload: %d", err);
+
+    mDeviceFunctions->vkWaitForFences(dev, 1, &fence, VK_TRUE, UINT64_MAX);
+    mDeviceFunctions->vkDestroyFence(dev, fence, nullptr);
+
+    // Frees the command buffer too.
+    mDeviceFunctions->vkDestroyCommandPool(dev, mOneShotCommandPool, nullptr);
+    mOneShotCommandPool = VK_NULL_HANDLE;
+}
+
+//Called from buildFrame() the first time the scene goes below full resolution.
+void Renderer::ensureOffscreenTarget()
+{
+    if (mOffscreen.renderPass)
+        return;
+
+    VkDevice dev = mWindow->device();
+    const QSize sz = mWindow->swapChainImageSize();
+    const bool msaa = mWindow->sampleCountFlagBits() > VK_SAMPLE_COUNT_1_BIT;
+    const VkFormat colorFormat = mWindow->colorFormat();
+    const VkFormat depthFormat = mWindow->depthStencilFormat();
+    mOffscreen.size = QSize(qCeil(sz.width() * QualityGovernor::scale(1)), qCeil(sz.height() * QualityGovernor::scale(1)));
+
+    VkImageAspectFlags depthAspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+    if (depthFormat == VK_FORMAT_D16_UNORM_S8_UINT || depthFormat == VK_FORMAT_D24_UNORM_S8_UINT
+            || depthFormat == VK_FORMAT_D32_SFLOAT_S8_UINT)
+        depthAspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+
+    struct {
+        VkImage *image;
+        MemoryAllocator::Allocation *alloc;
+        VkImageView *view;
+        VkFormat format;
+        VkSampleCountFlagBits samples;
+        VkImageUsageFlags usage;
+        VkImageAspectFlags aspect;
+        VkImageLayout layout;
+    } images[] = {
+        { &mOffscreen.colorImage, &mOffscreen.colorAlloc, &mOffscreen.colorView, colorFormat, VK_SAMPLE_COUNT_1_BIT,
+          VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_ASPECT_COLOR_BIT,
+          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+        { &mOffscreen.depthImage, &mOffscreen.depthAlloc, &mOffscreen.depthView, depthFormat, mWindow->sampleCountFlagBits(),
+          VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT, depthAspect,
+          VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL },
+        { &mOffscreen.msaaImage, &mOffscreen.msaaAlloc, &mOffscreen.msaaView, colorFormat, mWindow->sampleCountFlagBits(),
+          VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT, VK_IMAGE_ASPECT_COLOR_BIT,
+          VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL }
+    };
+    const int imageCount = msaa ? 3 : 2;
+
+    // Straight into the layouts they are kept in, see mOffscreen.
+    VkCommandBuffer cb = beginOneShotCommands();
+    for (int i = 0; i < imageCount; ++i) {
+        VkImageCreateInfo imageInfo{};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageInfo.format = images[i].format;
+        imageInfo.extent = { uint32_t(mOffscreen.size.width()), uint32_t(mOffscreen.size.height()), 1 };
+        imageInfo.mipLevels = 1;
+        imageInfo.arrayLayers = 1;
+        imageInfo.samples = images[i].samples;
+        imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageInfo.usage = images[i].usage;
+        imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        *images[i].image = mAllocator.createImage(imageInfo, images[i].alloc, "offscreen");
+
+        VkImageViewCreateInfo viewInfo{};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.image = *images[i].image;
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = images[i].format;
+        viewInfo.subresourceRange = { images[i].aspect, 0, 1, 0, 1 };
+        VkResult err = mDeviceFunctions->vkCreateImageView(dev, &viewInfo, nullptr, images[i].view);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create image view: %d", err);
+
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = images[i].layout;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = *images[i].image;
+        barrier.subresourceRange = viewInfo.subresourceRange;
+        mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                               0, 0, nullptr, 0, nullptr, 1, &barrier);
+    }
+    endOneShotCommands(cb);
+
+    // Laid out like the default render pass of QVulkanWindow: with MSAA the
+    // color is the resolve target and the multisample image comes last. The
+    // layouts and the load and store ops are all it can differ in, so that
+    // the two stay compatible. buildFrame() takes care of the barriers.
+    VkAttachmentDescription attachments[3]{};
+    attachments[0].format = colorFormat;
+    attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachments[0].loadOp = msaa ? VK_ATTACHMENT_LOAD_OP_DONT_CARE : VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[0].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[0].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    attachments[1].format = depthFormat;
+    attachments[1].samples = mWindow->sampleCountFlagBits();
+    attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[1].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    attachments[2].format = colorFormat;
+    attachments[2].samples = mWindow->sampleCountFlagBits();
+    attachments[2].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachments[2].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[2].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[2].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[2].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[2].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference colorRef = { uint32_t(msaa ? 2 : 0), VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+    VkAttachmentReference resolveRef = { 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+    VkAttachmentReference depthRef = { 1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL };
+
+    VkSubpassDescription subpass{};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 1;
+    subpass.pColorAttachments = &colorRef;
+    subpass.pResolveAttachments = msaa ? &resolveRef : nullptr;
+    subpass.pDepthStencilAttachment = &depthRef;
+
+    VkRenderPassCreateInfo renderPassInfo{};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassInfo.attachmentCount = imageCount;
+    renderPassInfo.pAttachments = attachments;
+    renderPassInfo.subpassCount = 1;
+    renderPassInfo.pSubpasses = &subpass;
+    VkResult err = mDeviceFunctions->vkCreateRenderPass(dev, &renderPassInfo, nullptr, &mOffscreen.renderPass);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create render pass: %d", err);
+
+    VkImageView views[] = { mOffscreen.colorView, mOffscreen.depthView, mOffscreen.msaaView };
+    VkFramebufferCreateInfo framebufferInfo{};
+    framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebufferInfo.renderPass = mOffscreen.renderPass;
+    framebufferInfo.attachmentCount = imageCount;
+    framebufferInfo.pAttachments = views;
+    framebufferInfo.width = uint32_t(mOffscreen.size.width());
+    framebufferInfo.height = uint32_t(mOffscreen.size.height());
+    framebufferInfo.layers = 1;
+    err = mDeviceFunctions->vkCreateFramebuffer(dev, &framebufferInfo, nullptr, &mOffscreen.framebuffer);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create framebuffer: %d", err);
+
+    // The set is allocated in createUpscalePipeline(), waited for in buildFrame().
+    VkDescriptorImageInfo imageInfo{};
+    imageInfo.sampler = mUpscaleMaterial.sampler;
+    imageInfo.imageView = mOffscreen.colorView;
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    VkWriteDescriptorSet writeDescriptorSet{};
+    writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeDescriptorSet.dstSet = mUpscaleMaterial.descriptorSet;
+    writeDescriptorSet.dstBinding = 0;
+    writeDescriptorSet.descriptorCount = 1;
+    writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    writeDescriptorSet.pImageInfo = &imageInfo;
+    mDeviceFunctions->vkUpdateDescriptorSets(dev, 1, &writeDescriptorSet, 0, nullptr);
+
+    if (DBG) {
+        qDebug("Offscreen target of %dx%d", mOffscreen.size.width(), mOffscreen.size.height());
+        mAllocator.dump();
+    }
+}
+
+//The frame releaseSwapChainResources() just submitted may still render into it.
+void Renderer::releaseOffscreenTarget()
+{
+    if (!mOffscreen.renderPass)
+        return;
+
+    VkDevice dev = mWindow->device();
+    mDeviceFunctions->vkDeviceWaitIdle(dev);
+
+    mDeviceFunctions->vkDestroyFramebuffer(dev, mOffscreen.framebuffer, nullptr);
+    mOffscreen.framebuffer = VK_NULL_HANDLE;
+    mDeviceFunctions->vkDestroyRenderPass(dev, mOffscreen.renderPass, nullptr);
+    mOffscreen.renderPass = VK_NULL_HANDLE;
+
+    VkImageView *views[] = { &mOffscreen.colorView, &mOffscreen.msaaView, &mOffscreen.depthView };
+    for (VkImageView *view : views) {
+        if (*view) {
+            mDeviceFunctions->vkDestroyImageView(dev, *view, nullptr);
+            *view = VK_NULL_HANDLE;
+        }
+    }
+    mAllocator.destroyImage(&mOffscreen.colorImage, &mOffscreen.colorAlloc);
+    mAllocator.destroyImage(&mOffscreen.msaaImage, &mOffscreen.msaaAlloc);
+    mAllocator.destroyImage(&mOffscreen.depthImage, &mOffscreen.depthAlloc);
+    mOffscreen.size = QSize();
+}
+
+//Called from buildFrame() once the pipelines are there, the descriptor sets
+//of the pyramid come with them.
+void Renderer::ensureOcclusionTarget()
+{
+    if (mOcclusion.framebuffer)
+        return;
+
+    VkDevice dev = mWindow->device();
+    // The occluders are drawn with the same pixel centers as the items, at
+    // a lower resolution they would cover pixels they do not in the end. So
+    // the depth is as large as the swapchain, for any render resolution.
+    mOcclusion.depthSize = mWindow->swapChainImageSize();
+    // Powers of two all the way down, see hizreduce.comp. What is past the
+    // depth is as far away as it gets.
+    const int hizWidth = int(qNextPowerOfTwo(quint32((mOcclusion.depthSize.width() + 1) / 2 - 1)));
+    const int hizHeight = int(qNextPowerOfTwo(quint32((mOcclusion.depthSize.height() + 1) / 2 - 1)));
+    mOcclusion.hizSize = QSize(hizWidth, hizHeight);
+    mOcclusion.hizLevelCount = 1;
+    while ((qMax(hizWidth, hizHeight) >> (mOcclusion.hizLevelCount - 1)) > 1 && mOcclusion.hizLevelCount < HIZ_MAX_LEVELS)
+        ++mOcclusion.hizLevelCount;
+
+    VkImageCreateInfo imageInfo{};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = mOcclusion.depthFormat;
+    imageInfo.extent = { uint32_t(mOcclusion.depthSize.width()), uint32_t(mOcclusion.depthSize.height()), 1 };
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    mOcclusion.depthImage = mAllocator.createImage(imageInfo, &mOcclusion.depthAlloc, "occlusion depth");
+
+    imageInfo.format = VK_FORMAT_R32_SFLOAT;
+    imageInfo.extent = { uint32_t(hizWidth), uint32_t(hizHeight), 1 };
+    imageInfo.mipLevels = uint32_t(mOcclusion.hizLevelCount);
+    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    mOcclusion.hizImage = mAllocator.createImage(imageInfo, &mOcclusion.hizAlloc, "depth pyramid");
+
+    VkImageViewCreateInfo viewInfo{};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = mOcclusion.depthImage;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = mOcclusion.depthFormat;
+    viewInfo.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
+    VkResult err = mDeviceFunctions->vkCreateImageView(dev, &viewInfo, nullptr, &mOcclusion.depthView);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create image view: %d", err);
+
+    viewInfo.image = mOcclusion.hizImage;
+    viewInfo.format = VK_FORMAT_R32_SFLOAT;
+    viewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, uint32_t(mOcclusion.hizLevelCount), 0, 1 };
+    err = mDeviceFunctions->vkCreateImageView(dev, &viewInfo, nullptr, &mOcclusion.hizView);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create image view: %d", err);
+    for (int i = 0; i < mOcclusion.hizLevelCount; ++i) {
+        viewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, uint32_t(i), 1, 0, 1 };
+        err = mDeviceFunctions->vkCreateImageView(dev, &viewInfo, nullptr, &mOcclusion.hizLevelViews[i]);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to create image view: %d", err);
+    }
+
+    // The pyramid stays in GENERAL, the depth starts out undefined every frame.
+    VkCommandBuffer cb = beginOneShotCommands();
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = mOcclusion.hizImage;
+    barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, uint32_t(mOcclusion.hizLevelCount), 0, 1 };
+    mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                           0, 0, nullptr, 0, nullptr, 1, &barrier);
+    endOneShotCommands(cb);
+
+    VkFramebufferCreateInfo framebufferInfo{};
+    framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebufferInfo.renderPass = mOcclusion.renderPass;
+    framebufferInfo.attachmentCount = 1;
+    framebufferInfo.pAttachments = &mOcclusion.depthView;
+    framebufferInfo.width = uint32_t(mOcclusion.depthSize.width());
+    framebufferInfo.height = uint32_t(mOcclusion.depthSize.height());
+    framebufferInfo.layers = 1;
+    err = mDeviceFunctions->vkCreateFramebuffer(dev, &framebufferInfo, nullptr, &mOcclusion.framebuffer);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create framebuffer: %d", err);
+
+    // Each level from the one below, level 0 from the depth.
+    VkDescriptorImageInfo imageInfos[HIZ_MAX_LEVELS][2]{};
+    VkWriteDescriptorSet writeDescriptorSets[HIZ_MAX_LEVELS][2]{};
+    for (int i = 0; i < mOcclusion.hizLevelCount; ++i) {
+        imageInfos[i][0].sampler = mHizMaterial.sampler;
+        imageInfos[i][0].imageView = i == 0 ? mOcclusion.depthView : mOcclusion.hizLevelViews[i - 1];
+        imageInfos[i][0].imageLayout = i == 0 ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+        imageInfos[i][1].imageView = mOcclusion.hizLevelViews[i];
+        imageInfos[i][1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        for (uint32_t b = 0; b < 2; ++b) {
+            writeDescriptorSets[i][b].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writeDescriptorSets[i][b].dstSet = mHizMaterial.descriptorSets[i];
+            writeDescriptorSets[i][b].dstBinding = b;
+            writeDescriptorSets[i][b].descriptorCount = 1;
+            writeDescriptorSets[i][b].descriptorType = b == 0 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            writeDescriptorSets[i][b].pImageInfo = &imageInfos[i][b];
+        }
+    }
+    mDeviceFunctions->vkUpdateDescriptorSets(dev, uint32_t(mOcclusion.hizLevelCount * 2), writeDescriptorSets[0], 0, nullptr);
+
+    // The culling's sets follow in ensureCullBuffers().
+    ++mOcclusion.generation;
+
+    if (DBG)
+        qDebug("Occlusion depth of %dx%d, %d pyramid levels", mOcclusion.depthSize.width(), mOcclusion.depthSize.height(),
+               mOcclusion.hizLevelCount);
+}
+
+//Same as releaseOffscreenTarget(), the render pass stays.
+void Renderer::releaseOcclusionTarget()
+{
+    if (!mOcclusion.framebuffer)
+        return;
+
+    VkDevice dev = mWindow->device();
+    mDeviceFunctions->vkDeviceWaitIdle(dev);
+
+    mDeviceFunctions->vkDestroyFramebuffer(dev, mOcclusion.framebuffer, nullptr);
+    mOcclusion.framebuffer = VK_NULL_HANDLE;
+    for (int i = 0; i < mOcclusion.hizLevelCount; ++i) {
+        mDeviceFunctions->vkDestroyImageView(dev, mOcclusion.hizLevelViews[i], nullptr);
+        mOcclusion.hizLevelViews[i] = VK_NULL_HANDLE;
+    }
+    mDeviceFunctions->vkDestroyImageView(dev, mOcclusion.hizView, nullptr);
+    mOcclusion.hizView = VK_NULL_HANDLE;
+    mDeviceFunctions->vkDestroyImageView(dev, mOcclusion.depthView, nullptr);
+    mOcclusion.depthView = VK_NULL_HANDLE;
+    mAllocator.destroyImage(&mOcclusion.hizImage, &mOcclusion.hizAlloc);
+    mAllocator.destroyImage(&mOcclusion.depthImage, &mOcclusion.depthAlloc);
+    mOcclusion.hizLevelCount = 0;
+    mOcclusion.depthSize = QSize();
+    mOcclusion.hizSize = QSize();
+}
+
+//A command pool per chunk and frame slot. A pool must not be used from two
+//threads at once, and the slot's previous frame has finished when its pool is
+//reset again, so this way no locking is needed.
+void Renderer::ensureChunkCommands()
+{
+    if (mChunkCommands[0][0].pool)
+        return;
+
+    VkDevice dev = mWindow->device();
+    for (int i = 0; i < mWindow->concurrentFrameCount(); ++i) {
+        for (int c = 0; c < SceneChunkCount; ++c) {
+            VkCommandPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            poolInfo.queueFamilyIndex = mWindow->graphicsQueueFamilyIndex();
+            VkResult err = mDeviceFunctions->vkCreateCommandPool(dev, &poolInfo, nullptr, &mChunkCommands[i][c].pool);
+            if (err != VK_SUCCESS)
+                qFatal("Failed to create command pool: %d", err);
+
+            VkCommandBufferAllocateInfo cbInfo{};
+            cbInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            cbInfo.commandPool = mChunkCommands[i][c].pool;
+            cbInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            cbInfo.commandBufferCount = 1;
+            err = mDeviceFunctions->vkAllocateCommandBuffers(dev, &cbInfo, &mChunkCommands[i][c].cb);
+            if (err != VK_SUCCESS)
+                qFatal("Failed to allocate command buffer: %d", err);
+        }
+    }
+}
 
-    // allocate only once, for the maximum instance count
-    if (!mInstBuf) {
-        VkBufferCreateInfo bufInfo{};
-        bufInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-        bufInfo.size = MAX_INSTANCES * PER_INSTANCE_DATA_SIZE;
-        bufInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+//Called on a worker, see buildFrame(). Records one chunk of the render pass
+//into the secondary command buffer for the current frame slot. A reusable one
+//is not tied to the framebuffer, which changes with the swapchain image.
+void Renderer::recordChunk(SceneChunk chunk, bool reusable)
+{
+    ChunkCommands &cc(mChunkCommands[mWindow->currentFrame()][chunk]);
 
-        // Keep a copy of the data since we may lose all graphics resources on
-        // unexpose, and reinitializing to new random positions afterwards
-        // would not be nice.
-        mInstData.resize(bufInfo.size);
+    VkResult err = mDeviceFunctions->vkResetCommandPool(mWindow->device(), cc.pool, 0);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to reset command pool: %d", err);
+
+    // Below full resolution the chunks go into the offscreen target.
+    const bool offscreen = mRenderSize != mWindow->swapChainImageSize();
+    VkCommandBufferInheritanceInfo inheritanceInfo{};
+    inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritanceInfo.renderPass = offscreen ? mOffscreen.renderPass : mWindow->defaultRenderPass();
+    inheritanceInfo.subpass = 0;
+    if (!reusable)
+        inheritanceInfo.framebuffer = offscreen ? mOffscreen.framebuffer : mWindow->currentFramebuffer();
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    if (!reusable)
+        beginInfo.flags |= VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    beginInfo.pInheritanceInfo = &inheritanceInfo;
+    err = mDeviceFunctions->vkBeginCommandBuffer(cc.cb, &beginInfo);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to begin command buffer: %d", err);
 
-        VkResult err = mDeviceFunctions->vkCreateBuffer(dev, &bufInfo, nullptr, &mInstBuf);
-        if (err != VK_SUCCESS)
-            qFatal("Failed to create instance buffer: %d", err);
+    // Dynamic state is not inherited from the primary.
+    const QSize sz = mRenderSize;
+    VkViewport viewport = {
+        0, 0,
+        float(sz.width()), float(sz.height()),
+        0, 1
+    };
+    mDeviceFunctions->vkCmdSetViewport(cc.cb, 0, 1, &viewport);
 
-        VkMemoryRequirements memReq;
-        mDeviceFunctions->vkGetBufferMemoryRequirements(dev, mInstBuf, &memReq);
-        if (DBG)
-            qDebug("Allocating %u bytes for instance data", uint32_t(memReq.size));
-
-        VkMemoryAllocateInfo memAllocInfo{};
-		memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		memAllocInfo.allocationSize = memReq.size;
-		memAllocInfo.memoryTypeIndex = mWindow->hostVisibleMemoryIndex();
-        
-        err = mDeviceFunctions->vkAllocateMemory(dev, &memAllocInfo, nullptr, &mInstBufMem);
-        if (err != VK_SUCCESS)
-            qFatal("Failed to allocate memory: %d", err);
+    VkRect2D scissor = {
+        { 0, 0 },
+        { uint32_t(sz.width()), uint32_t(sz.height()) }
+    };
+    mDeviceFunctions->vkCmdSetScissor(cc.cb, 0, 1, &scissor);
+
+    switch (chunk) {
+    case FloorChunk: {
+        Profiler::ScopedTimer timer(&mProfiler, Profiler::CpuFloorRecording);
+        mProfiler.writeTimestamp(cc.cb, Profiler::GpuFloor, false);
+        buildDrawCallsForFloor(cc.cb);
+        mProfiler.writeTimestamp(cc.cb, Profiler::GpuFloor, true);
+        break;
+    }
+    case ItemChunk: {
+        Profiler::ScopedTimer timer(&mProfiler, Profiler::CpuItemRecording);
+        mProfiler.writeTimestamp(cc.cb, Profiler::GpuItems, false);
+        buildDrawCallsForItems(cc.cb);
+        mProfiler.writeTimestamp(cc.cb, Profiler::GpuItems, true);
+        break;
+    }
+    default:
+        break;
+    }
 
-        err = mDeviceFunctions->vkBindBufferMemory(dev, mInstBuf, mInstBufMem, 0);
-        if (err != VK_SUCCESS)
-            qFatal("Failed to bind instance buffer memory: %d", err);
+    err = mDeviceFunctions->vkEndCommandBuffer(cc.cb);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to end command buffer: %d", err);
+}
+
+void Renderer::releaseChunkCommands()
+{
+    VkDevice dev = mWindow->device();
+    for (auto &frameCommands : mChunkCommands) {
+        for (ChunkCommands &cc : frameCommands) {
+            // Frees the command buffer too.
+            if (cc.pool) {
+                mDeviceFunctions->vkDestroyCommandPool(dev, cc.pool, nullptr);
+                cc.pool = VK_NULL_HANDLE;
+                cc.cb = VK_NULL_HANDLE;
+            }
+        }
     }
+    for (quint64 &recorded : mChunkCacheRecorded)
+        recorded = 0;
+}
 
-    if (mInstCount != mPreparedInstCount) {
-        if (DBG)
-            qDebug("Preparing instances %d..%d", mPreparedInstCount, mInstCount - 1);
+quint8 Renderer::instanceMesh(int instance) const
+{
+    if (mMixedMeshes)
+        return quint8(instance % ItemMeshCount);
+    return mUseLogo ? LogoMesh : BlockMesh;
+}
 
+//CPU only, the upload happens in ensureInstanceBuffer().
+void Renderer::prepareInstances()
+{
+    // Switching meshes rewrites the instances, not the commands.
+    if (mMeshIdsDirty) {
+        mMeshIdsDirty = false;
         char *p = mInstData.data();
-        p += mPreparedInstCount * PER_INSTANCE_DATA_SIZE;
-        auto gen = [](int a, int b) {
-            return float(QRandomGenerator::global()->bounded(double(b - a)) + a);
-        };
-
-        for (int i = mPreparedInstCount; i < mInstCount; ++i) {
-            // Apply a random translation to each instance of the mesh.
-            float t[] = { gen(-5, 5), gen(-4, 6), gen(-30, 5) };
-            memcpy(p, t, 12);
-            // Apply a random adjustment to the diffuse color for each instance. (default is 0.7)
-            float d[] = { gen(-6, 3) / 10.0f, gen(-6, 3) / 10.0f, gen(-6, 3) / 10.0f };
-            memcpy(p + 12, d, 12);
-            p += PER_INSTANCE_DATA_SIZE;
+        for (int i = 0; i < mPreparedInstCount; ++i)
+            p[i * PER_INSTANCE_DATA_SIZE + 15] = char(instanceMesh(i));
+        mInstances.markDirty(0, mPreparedInstCount);
+    }
+
+    if (mLoadingScene) {
+        // Whatever was read since the last frame, ensureInstanceBuffer()
+        // uploads it like any new instances.
+        bool finished;
+        mSceneLoader.take(mSceneGeneration, &mInstData, &finished);
+        if (mInstData.size() > qint64(mMaxInstCount) * PER_INSTANCE_DATA_SIZE) {
+            qWarning("The scene has more instances than the buffers hold, keeping the first %d", mMaxInstCount);
+            mInstData.resize(qint64(mMaxInstCount) * PER_INSTANCE_DATA_SIZE);
+        }
+        const int loadedCount = int(mInstData.size() / PER_INSTANCE_DATA_SIZE);
+        if (loadedCount != mInstCount) {
+            mInstCount = mPreparedInstCount = loadedCount;
+            invalidateChunkCache();
+        }
+        // For the GUI, and so that adding more continues from here. What was
+        // asked for since the last frame is not lost, it waits for the load.
+        int requested = mRequestedInstCount.load(std::memory_order_acquire);
+        while (!mRequestedInstCount.compare_exchange_weak(requested, mInstCount, std::memory_order_acq_rel))
+            ;
+        mQueuedInstCount += requested - mLoadRequestBase;
+        mLoadRequestBase = mInstCount;
+        if (finished) {
+            mLoadingScene = false;
+            if (DBG)
+                qDebug("Loaded a scene of %d instances", mInstCount);
+            if (mQueuedInstCount) {
+                if (DBG)
+                    qDebug("Adding the %d instances requested while the scene was loading", mQueuedInstCount);
+                mRequestedInstCount.fetch_add(qMax(mQueuedInstCount, -mInstCount), std::memory_order_acq_rel);
+                mQueuedInstCount = 0;
+            }
         }
+    } else if (mInstCount != mPreparedInstCount) {
+        if (DBG)
+            qDebug("Preparing instances %d..%d", mPreparedInstCount, mInstCount - 1);
+
+        // Keep a copy of the data since we may lose all graphics resources on
+        // unexpose, and reinitializing to new random positions afterwards
+        // would not be nice.
+        mInstData.resize(mInstCount * PER_INSTANCE_DATA_SIZE);
+
+        // Random translation, adjustment to the diffuse color, spin axis,
+        // speed, starting angle and size for each instance.
+        mInstanceGenerator.generate(mInstData.data() + mPreparedInstCount * PER_INSTANCE_DATA_SIZE,
+                                    mPreparedInstCount, mInstCount - mPreparedInstCount,
+                                    instanceMesh(0), mMixedMeshes ? ItemMeshCount : 1);
         mPreparedInstCount = mInstCount;
     }
 
-    uint8_t* p{ nullptr };
-    VkResult err = mDeviceFunctions->vkMapMemory(dev, mInstBufMem, 0, mInstCount * PER_INSTANCE_DATA_SIZE, 0,
-                                           reinterpret_cast<void **>(&p));
-    if (err != VK_SUCCESS)
-        qFatal("Failed to map memory: %d", err);
-    memcpy(p, mInstData.constData(), mInstData.size());
-    mDeviceFunctions->vkUnmapMemory(dev, mInstBufMem);
+    QString saveFileName;
+    {
+        QMutexLocker locker(&mSceneSaveMutex);
+        saveFileName.swap(mRequestedSceneSave);
+    }
+    if (!saveFileName.isEmpty()) {
+        // A shallow copy, written out as it is while the frames go on. The
+        // mesh bytes already index the item meshes.
+        const QByteArray instData = mInstData;
+        mSceneSaveFuture = QtConcurrent::run([saveFileName, instData] {
+            writeSceneFile(saveFileName, instData, itemMeshFiles());
+        });
+    }
+}
+
+void Renderer::ensureInstanceBuffer()
+{
+    Profiler::ScopedTimer timer(&mProfiler, Profiler::CpuInstanceUpload);
+
+    // Grows the device local buffer and uploads only what is not there yet,
+    // as opposed to copying all of mInstData every frame.
+    mInstances.update(mWindow->currentCommandBuffer(), mInstData, mInstCount);
+
+    // For the GUI, which must not touch mInstances itself.
+    mPublishedCapacity.store(mInstances.capacity(), std::memory_order_release);
+    mPublishedBytesUsed.store(mInstances.bytesUsed(), std::memory_order_release);
+    mPublishedBytesAllocated.store(mInstances.bytesAllocated(), std::memory_order_release);
 }
 
-void Renderer::getMatrices(QMatrix4x4 *vp, QMatrix4x4 *model, QMatrix3x3 *modelNormal, QVector3D *eyePos)
+void Renderer::ensureCullBuffers()
 {
-    model->setToIdentity();
-    if (mUseLogo)
-        model->rotate(90, 1, 0, 0);
-    model->rotate(mRotation, 1, 1, 0);
+    VkDevice dev = mWindow->device();
+    const int concurrentFrameCount = mWindow->concurrentFrameCount();
+
+    // The indirect draw commands, allocated only once.
+    if (!mCullFrames[0].indirectBuf) {
+        for (int i = 0; i < concurrentFrameCount; ++i) {
+            mCullFrames[i].indirectBuf = mAllocator.createBuffer(sizeof(CullIndirect),
+                                                                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                                                 MemoryAllocator::DeviceLocal, &mCullFrames[i].indirectBufAlloc, "indirect draw");
+        }
+    }
+
+    // The GPU is done with everything belonging to the current frame slot, so
+    // its visible buffer can be replaced and its descriptor set rewritten
+    // right away when the instance store has grown.
+    CullFrame &cullFrame(mCullFrames[mWindow->currentFrame()]);
+    bool writeDescriptors = cullFrame.instanceStoreGeneration != mInstances.generation()
+            || cullFrame.occlusionGeneration != mOcclusion.generation;
+
+    if (cullFrame.visibleCapacity < mInstances.capacity()) {
+        mAllocator.destroyBuffer(&cullFrame.visibleBuf, &cullFrame.visibleBufAlloc);
+
+        // Same layout as the instance store, read as the per-instance vertex input by the item pipeline.
+        const int bucketCount = mMultiDrawIndirect ? 1 : mDrawCount;
+        cullFrame.visibleBuf = mAllocator.createBuffer(VkDeviceSize(mInstances.capacity()) * bucketCount * PER_INSTANCE_DATA_SIZE,
+                                                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                                                       MemoryAllocator::DeviceLocal, &cullFrame.visibleBufAlloc, "visible instance");
+
+        // Only read with the buckets back to back, but the descriptor set always has it.
+        mAllocator.destroyBuffer(&cullFrame.slotBuf, &cullFrame.slotBufAlloc);
+        cullFrame.slotBuf = mAllocator.createBuffer(VkDeviceSize(mInstances.capacity()) * sizeof(uint32_t),
+                                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                    MemoryAllocator::DeviceLocal, &cullFrame.slotBufAlloc, "instance slot");
+
+        // Starts out with nothing visible, which only means no occluders the first time.
+        mAllocator.destroyBuffer(&cullFrame.visibilityBuf, &cullFrame.visibilityBufAlloc);
+        cullFrame.visibilityBuf = mAllocator.createBuffer(VkDeviceSize(mInstances.capacity()) * sizeof(uint32_t),
+                                                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                                          MemoryAllocator::DeviceLocal, &cullFrame.visibilityBufAlloc, "visibility");
+        cullFrame.visibilityCleared = false;
+
+        cullFrame.visibleCapacity = mInstances.capacity();
+        writeDescriptors = true;
+        // The cached item chunk for this slot binds the old buffer.
+        mChunkCacheRecorded[mWindow->currentFrame()] = 0;
+    }
+
+    if (!writeDescriptors)
+        return;
 
-    *modelNormal = model->normalMatrix();
+    VkDescriptorBufferInfo bufferInfo[6]{};
+    bufferInfo[0].buffer = mInstances.buffer();
+    bufferInfo[0].range = VK_WHOLE_SIZE;
+    bufferInfo[1].buffer = cullFrame.visibleBuf;
+    bufferInfo[1].range = VK_WHOLE_SIZE;
+    bufferInfo[2].buffer = cullFrame.indirectBuf;
+    bufferInfo[2].range = VK_WHOLE_SIZE;
+    bufferInfo[3].buffer = cullFrame.visibilityBuf;
+    bufferInfo[3].range = VK_WHOLE_SIZE;
+    bufferInfo[5].buffer = cullFrame.slotBuf;
+    bufferInfo[5].range = VK_WHOLE_SIZE;
+
+    // The pyramid from ensureOcclusionTarget(), which buildFrame() calls first.
+    VkDescriptorImageInfo imageInfo{};
+    imageInfo.sampler = mHizMaterial.sampler;
+    imageInfo.imageView = mOcclusion.hizView;
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    VkWriteDescriptorSet writeDescriptorSet[6]{};
+    for (uint32_t b = 0; b < 6; ++b) {
+        writeDescriptorSet[b].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeDescriptorSet[b].dstSet = cullFrame.descriptorSet;
+        writeDescriptorSet[b].dstBinding = b;
+        writeDescriptorSet[b].descriptorCount = 1;
+        if (b != 4) {
+            writeDescriptorSet[b].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            writeDescriptorSet[b].pBufferInfo = &bufferInfo[b];
+        } else {
+            writeDescriptorSet[b].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            writeDescriptorSet[b].pImageInfo = &imageInfo;
+        }
+    }
+    mDeviceFunctions->vkUpdateDescriptorSets(dev, 6, writeDescriptorSet, 0, nullptr);
+    cullFrame.instanceStoreGeneration = mInstances.generation();
+    cullFrame.occlusionGeneration = mOcclusion.generation;
+}
 
-    QMatrix4x4 view = mCam.viewMatrix();
-    *vp = mProj * view;
+void Renderer::getMatrices(QMatrix4x4 *vp, QVector3D *eyePos)
+{
+    const QMatrix4x4 view = mCam.viewMatrix();
+    multiplyMatrix4(vp->data(), mProj.constData(), view.constData());
 
-    *eyePos = view.inverted().column(3).toVector3D();
+    // The camera only turns and moves, no need for a general inverse.
+    *eyePos = rigidInverseTranslation(view.constData());
 }
 
-void Renderer::writeFragUni(uint8_t *p, const QVector3D &eyePos)
+void Renderer::writeFragUni(uint8_t *p, const QVector3D &eyePos, const QVector4D &viewDepth)
 {
     float ECCameraPosition[] = { eyePos.x(), eyePos.y(), eyePos.z() };
     memcpy(p, ECCameraPosition, 12);
     p += 16;
 
-    // Material
-    float ka[] = { 0.05f, 0.05f, 0.05f };
-    memcpy(p, ka, 12);
-    p += 16;
-
-    float kd[] = { 0.7f, 0.7f, 0.7f };
-    memcpy(p, kd, 12);
-    p += 16;
-
-    float ks[] = { 0.66f, 0.66f, 0.66f };
-    memcpy(p, ks, 12);
-    p += 16;
+    // The material is in the specialization constants, see createItemPipeline().
 
     // Light parameters
     float ECLightPosition[] = { mLightPos.x(), mLightPos.y(), mLightPos.z() };
@@ -777,15 +2579,21 @@ void Renderer::writeFragUni(uint8_t *p, const QVector3D &eyePos)
 
     float color[] = { 1.0f, 1.0f, 1.0f };
     memcpy(p, color, 12);
-    p += 12; // next we have two floats which have an alignment of 4, hence 12 only
+    p += 12; // next we have a float which has an alignment of 4, hence 12 only
 
     float intensity = 0.8f;
     memcpy(p, &intensity, 4);
-    p += 4;
+    p += 4; // the vec4s below are 16 byte aligned
+
+    // What the fragment shader needs to find its cluster, see lightcull.comp for the slices.
+    const float viewDepthRow[] = { viewDepth.x(), viewDepth.y(), viewDepth.z(), viewDepth.w() };
+    memcpy(p, viewDepthRow, 16);
+    p += 16;
 
-    float specularExp = 150.0f;
-    memcpy(p, &specularExp, 4);
-    p += 4;
+    const float sliceScale = CLUSTER_Z / std::log(CLUSTER_FAR / CLUSTER_NEAR);
+    const float cluster[] = { mClusterTileScale[0], mClusterTileScale[1], sliceScale, -std::log(CLUSTER_NEAR) * sliceScale };
+    memcpy(p, cluster, 16);
+    p += 16;
 }
 
 void Renderer::startNextFrame()
@@ -795,21 +2603,198 @@ void Renderer::startNextFrame()
     // finished.
     Q_ASSERT(!mFramePending);
     mFramePending = true;
-    QFuture<void> future = QtConcurrent::run(&Renderer::buildFrame, this);
+    mFrameTimer.start();
+    QFuture<void> future = QtConcurrent::run([this] {
+        // Usually long done, started when the previous frame was submitted.
+        mPrepareFuture.waitForFinished();
+        buildFrame();
+    });
     mFrameWatcher.setFuture(future);
 }
 
+//Everything about the next frame that does not depend on its frame slot: the
+//input, the animation, new instances and the matrices. Either runs ahead on
+//a worker, see the frame watcher in the constructor, or from buildFrame().
+void Renderer::prepareFrame()
+{
+    Profiler::ScopedTimer timer(&mProfiler, Profiler::CpuPrepareFrame);
+
+    consumeInput();
+    prepareInstances();
+    updateFrameMatrices();
+    updateLights();
+    mFramePrepared = true;
+}
+
+void Renderer::updateFrameMatrices()
+{
+    getMatrices(&mFrame.vp, &mFrame.eyePos);
+    mFrame.view = mCam.viewMatrix();
+    mFrame.viewDepth = mFrame.view.row(2);
+    multiplyMatrix4(mFrame.floorMvp.data(), mFrame.vp.constData(), mFloorModel.constData());
+
+    // Gribb-Hartmann: the frustum planes are sums and differences of the rows of
+    // the view-projection matrix. The clip space depth range is 0..1 in Vulkan,
+    // hence just row 2 for the near plane.
+    const QMatrix4x4 &vp(mFrame.vp);
+    const QVector4D r0 = vp.row(0), r1 = vp.row(1), r2 = vp.row(2), r3 = vp.row(3);
+    const QVector4D planes[6] = { r3 + r0, r3 - r0, r3 + r1, r3 - r1, r2, r3 - r2 };
+    for (int i = 0; i < 6; ++i) {
+        const QVector4D plane = planes[i] / planes[i].toVector3D().length();
+        mFrame.planes[i][0] = plane.x();
+        mFrame.planes[i][1] = plane.y();
+        mFrame.planes[i][2] = plane.z();
+        mFrame.planes[i][3] = plane.w();
+    }
+
+    for (int m = 0; m < ItemMeshCount; ++m) {
+        // Each instance rotates and scales the result on its own, see color_phong.vert.
+        QMatrix4x4 model;
+        if (m == LogoMesh)
+            model.rotate(90, 1, 0, 0);
+        normalMatrixStd140(mFrame.modelNormal[m], model.constData());
+
+        // A sphere around the aabb, the culling rotates and scales it per instance.
+        const MeshData *meshData = mItemMeshes[m].data();
+        const float *aabb = meshData->aabb;
+        const QVector3D aabbMin(aabb[0], aabb[2], aabb[4]);
+        const QVector3D aabbMax(aabb[1], aabb[3], aabb[5]);
+        const QVector3D center = model.map((aabbMin + aabbMax) * 0.5f);
+        CullMesh &cullMesh(mFrame.cullMeshes[m]);
+        cullMesh.sphere[0] = center.x();
+        cullMesh.sphere[1] = center.y();
+        cullMesh.sphere[2] = center.z();
+        cullMesh.sphere[3] = (aabbMax - aabbMin).length() * 0.5f;
+
+        // And the aabb itself for the occlusion test, the model only swaps axes.
+        const QVector3D halfExtent = (aabbMax - aabbMin) * 0.5f;
+        for (int i = 0; i < 3; ++i) {
+            cullMesh.aabbCenter[i] = center[i];
+            cullMesh.aabbExtent[i] = qAbs(model(i, 0)) * halfExtent.x() + qAbs(model(i, 1)) * halfExtent.y()
+                    + qAbs(model(i, 2)) * halfExtent.z();
+        }
+        cullMesh.aabbCenter[3] = 0.0f;
+        cullMesh.aabbExtent[3] = 0.0f;
+
+        // The depths where the next coarser level of detail gets no bigger than
+        // LOD_ERROR_PIXELS on screen. Levels the mesh does not have never take over.
+        for (int i = 1; i < MAX_LOD_COUNT; ++i)
+            cullMesh.lodDepths[i - 1] = i < meshData->lodCount ? meshData->lods[i].error * mLodScale : FLT_MAX;
+
+        // The vertex positions are quantized to the aabb, scale them back to
+        // model space before anything else. The normal matrix stays as it is.
+        mFrame.itemModel[m] = model;
+        mFrame.itemModel[m].translate((aabb[0] + aabb[1]) * 0.5f, (aabb[2] + aabb[3]) * 0.5f, (aabb[4] + aabb[5]) * 0.5f);
+        mFrame.itemModel[m].scale((aabb[1] - aabb[0]) * 0.5f, (aabb[3] - aabb[2]) * 0.5f, (aabb[5] - aabb[4]) * 0.5f);
+    }
+}
+
+//The lights move on the CPU, there are few enough of them.
+void Renderer::updateLights()
+{
+    if (mAnimating)
+        mLightTime += 1.0f;
+
+    mFrame.lightCount = mLightCount;
+    for (int i = 0; i < mLightCount; ++i) {
+        const PointLight &light(mLights[i]);
+        const float a = light.phase + mLightTime * light.orbitSpeed;
+        float *l = mFrame.lights[i];
+        l[0] = light.center.x() + light.orbitRadius * std::cos(a);
+        l[1] = light.center.y() + 0.5f * light.orbitRadius * std::sin(2.0f * a);
+        l[2] = light.center.z() + light.orbitRadius * std::sin(a);
+        l[3] = light.radius;
+        l[4] = light.color.x();
+        l[5] = light.color.y();
+        l[6] = light.color.z();
+        l[7] = 0.0f;
+    }
+}
+
+//Called from buildFrame() once the GPU timings of the slot's previous frame are in.
+void Renderer::updateRenderSize()
+{
+    float scale = 1.0f;
+    if (mAdaptiveResolution) {
+        double gpuMs;
+        if (mProfiler.latest(Profiler::GpuFrame, &gpuMs) && mGovernor.addFrame(float(gpuMs)) && DBG)
+            qDebug("Render scale %.2f after %.2f ms on the GPU", mGovernor.renderScale(), gpuMs);
+        scale = mGovernor.renderScale();
+    } else {
+        mGovernor.reset();
+    }
+
+    const QSize sz = mWindow->swapChainImageSize();
+    const QSize renderSize = scale < 1.0f ? QSize(qMax(1, int(sz.width() * scale)), qMax(1, int(sz.height() * scale))) : sz;
+    mPublishedRenderScale.store(scale, std::memory_order_release);
+    if (renderSize == mRenderSize)
+        return;
+    mRenderSize = renderSize;
+
+    // Whole pixels per tile, the last column and row of tiles may reach past the edge.
+    const float tileWidth = std::ceil(renderSize.width() / float(CLUSTER_X));
+    const float tileHeight = std::ceil(renderSize.height() / float(CLUSTER_Y));
+    mClusterTileScale[0] = 1.0f / tileWidth;
+    mClusterTileScale[1] = 1.0f / tileHeight;
+    mClusterTileNdcSize[0] = 2.0f * tileWidth / renderSize.width();
+    mClusterTileNdcSize[1] = 2.0f * tileHeight / renderSize.height();
+
+    // The fragment uniforms have the tiles, the chunks the viewport.
+    markViewProjDirty();
+}
+
 void Renderer::buildFrame()
 {
-    QMutexLocker locker(&mGuiMutex);
+    Profiler::ScopedTimer timer(&mProfiler, Profiler::CpuBuildFrame);
+
+    if (!mFramePrepared)
+        prepareFrame();
+    mFramePrepared = false;
 
     ensureBuffers();
     ensureInstanceBuffer();
-    mPipelinesFuture.waitForFinished();
+    waitForPipelines();
+    ensureOcclusionTarget();
+    ensureCullBuffers(); // needs the descriptor sets from createCullPipeline(), the instance store and the pyramid
+    ensureChunkCommands();
 
     VkCommandBuffer cb = mWindow->currentCommandBuffer();
     const QSize sz = mWindow->swapChainImageSize();
 
+    // Collects the GPU timings this slot produced last time.
+    mProfiler.beginFrame(cb);
+    mProfiler.writeTimestamp(cb, Profiler::GpuFrame, false);
+
+    // Which the governor looks at for the resolution of this frame.
+    updateRenderSize();
+    const bool offscreen = mRenderSize != sz;
+    if (offscreen)
+        ensureOffscreenTarget();
+
+    // Culling runs in compute, so record it before the render pass begins.
+    // Same for the lights, which only the fragment shader waits for.
+    buildCullCommands();
+    buildLightCullCommands();
+
+    // The contents of the render pass are recorded in chunks, all but the
+    // last one on other workers, the last one on this thread. The chunks this
+    // slot recorded last time are replayed as long as nothing has changed
+    // since, see invalidateChunkCache(). The animation happens in the instance
+    // data, so that includes while animating.
+    const int frame = mWindow->currentFrame();
+    const bool reusable = mCacheCommands;
+    if (!reusable || mChunkCacheRecorded[frame] != mChunkCacheGeneration) {
+        QFuture<void> chunkFutures[SceneChunkCount - 1];
+        for (int c = 0; c < SceneChunkCount - 1; ++c)
+            chunkFutures[c] = QtConcurrent::run(&Renderer::recordChunk, this, SceneChunk(c), reusable);
+        recordChunk(SceneChunk(SceneChunkCount - 1), reusable);
+        for (QFuture<void> &f : chunkFutures)
+            f.waitForFinished();
+        mChunkCacheRecorded[frame] = reusable ? mChunkCacheGeneration : 0;
+    } else if (DBG) {
+        qDebug("Reusing the command buffers of frame slot %d", frame);
+    }
+
     VkClearColorValue clearColor = {{ 0.67f, 0.84f, 0.9f, 1.0f }};
     VkClearDepthStencilValue clearDS = { 1, 0 };
     VkClearValue clearValues[3]{};
@@ -819,146 +2804,711 @@ void Renderer::buildFrame()
 
     VkRenderPassBeginInfo rpBeginInfo{};
     rpBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    rpBeginInfo.renderPass = mWindow->defaultRenderPass();
-    rpBeginInfo.framebuffer = mWindow->currentFramebuffer();
-    rpBeginInfo.renderArea.extent.width = sz.width();
-    rpBeginInfo.renderArea.extent.height = sz.height();
+    rpBeginInfo.renderPass = offscreen ? mOffscreen.renderPass : mWindow->defaultRenderPass();
+    rpBeginInfo.framebuffer = offscreen ? mOffscreen.framebuffer : mWindow->currentFramebuffer();
+    rpBeginInfo.renderArea.extent.width = mRenderSize.width();
+    rpBeginInfo.renderArea.extent.height = mRenderSize.height();
     rpBeginInfo.clearValueCount = mWindow->sampleCountFlagBits() > VK_SAMPLE_COUNT_1_BIT ? 3 : 2;
     rpBeginInfo.pClearValues = clearValues;
-    VkCommandBuffer cmdBuf = mWindow->currentCommandBuffer();
-    mDeviceFunctions->vkCmdBeginRenderPass(cmdBuf, &rpBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-    VkViewport viewport = {
-        0, 0,
-        float(sz.width()), float(sz.height()),
-        0, 1
-    };
-    mDeviceFunctions->vkCmdSetViewport(cb, 0, 1, &viewport);
+    // The previous frame may still be reading the color in its upscale, and
+    // all attachments are shared by the frames in flight.
+    VkMemoryBarrier attachmentBarrier{};
+    VkImageMemoryBarrier colorBarrier{};
+    if (offscreen) {
+        attachmentBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        attachmentBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        attachmentBarrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+                | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+        colorBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        colorBarrier.srcAccessMask = 0;
+        colorBarrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        colorBarrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        colorBarrier.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        colorBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        colorBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        colorBarrier.image = mOffscreen.colorImage;
+        colorBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+                                               | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                                               VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+                                               | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                                               0, 1, &attachmentBarrier, 0, nullptr, 1, &colorBarrier);
+    }
 
-    VkRect2D scissor = {
-        { 0, 0 },
-        { uint32_t(sz.width()), uint32_t(sz.height()) }
+    mDeviceFunctions->vkCmdBeginRenderPass(cb, &rpBeginInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+    // In chunk order, the floor goes first.
+    VkCommandBuffer secondaries[SceneChunkCount];
+    for (int c = 0; c < SceneChunkCount; ++c)
+        secondaries[c] = mChunkCommands[mWindow->currentFrame()][c].cb;
+    mDeviceFunctions->vkCmdExecuteCommands(cb, SceneChunkCount, secondaries);
+
+    mDeviceFunctions->vkCmdEndRenderPass(cb);
+
+    // Then scale it up to the window in the default render pass.
+    if (offscreen) {
+        colorBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        colorBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        colorBarrier.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        colorBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                               0, 0, nullptr, 0, nullptr, 1, &colorBarrier);
+
+        rpBeginInfo.renderPass = mWindow->defaultRenderPass();
+        rpBeginInfo.framebuffer = mWindow->currentFramebuffer();
+        rpBeginInfo.renderArea.extent.width = sz.width();
+        rpBeginInfo.renderArea.extent.height = sz.height();
+        mDeviceFunctions->vkCmdBeginRenderPass(cb, &rpBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+        buildUpscaleCommands(cb);
+        mDeviceFunctions->vkCmdEndRenderPass(cb);
+    }
+
+    mProfiler.writeTimestamp(cb, Profiler::GpuFrame, true);
+}
+
+void Renderer::buildCullCommands()
+{
+    VkCommandBuffer cb = mWindow->currentCommandBuffer();
+    CullFrame &cullFrame(mCullFrames[mWindow->currentFrame()]);
+
+    // Start from empty draws, one per level of each mesh, the shader bumps
+    // instanceCount for each visible instance in the draw's bucket. With a
+    // single call for all draws the buckets are back to back, the scatter
+    // dispatch sets firstInstance once they have all been counted.
+    CullIndirect indirect{};
+    for (int m = 0; m < ItemMeshCount; ++m) {
+        const MeshData *meshData = mItemMeshes[m].data();
+        for (int i = 0; i < meshData->lodCount; ++i) {
+            const int d = mFirstDraw[m] + i;
+            indirect.draws[d].indexCount = uint32_t(meshData->lods[i].indexCount);
+            indirect.draws[d].firstIndex = mArenaRanges[m].firstIndex + uint32_t(meshData->lods[i].firstIndex);
+            indirect.draws[d].vertexOffset = mArenaRanges[m].vertexOffset;
+        }
+        indirect.meshes[m] = mFrame.cullMeshes[m];
+        indirect.meshes[m].firstDraw = uint32_t(mFirstDraw[m]);
+    }
+    indirect.bucketCapacity = mMultiDrawIndirect ? 0 : uint32_t(cullFrame.visibleCapacity);
+    memcpy(indirect.viewProj, mFrame.vp.constData(), sizeof(indirect.viewProj));
+    indirect.renderSize[0] = float(mRenderSize.width());
+    indirect.renderSize[1] = float(mRenderSize.height());
+    indirect.hizLevelCount = uint32_t(mOcclusion.hizLevelCount);
+    mDeviceFunctions->vkCmdUpdateBuffer(cb, cullFrame.indirectBuf, 0, sizeof(indirect), &indirect);
+    if (!cullFrame.visibilityCleared) {
+        mDeviceFunctions->vkCmdFillBuffer(cb, cullFrame.visibilityBuf, 0, VK_WHOLE_SIZE, 0);
+        cullFrame.visibilityCleared = true;
+    }
+
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                           0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    // Instances still waiting in the staging ring are left out until they have made it to the GPU.
+    const uint32_t instCount = uint32_t(mInstances.drawableCount());
+
+    // Spin the instances in place in the instance store, before the culling
+    // looks at their rotation.
+    if (mAnimating) {
+        mDeviceFunctions->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, mAnimateMaterial.pipeline);
+        mDeviceFunctions->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE, mAnimateMaterial.pipelineLayout, 0, 1,
+                                                  &cullFrame.descriptorSet, 0, nullptr);
+        mDeviceFunctions->vkCmdPushConstants(cb, mAnimateMaterial.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                                             sizeof(instCount), &instCount);
+        mProfiler.writeTimestamp(cb, Profiler::GpuAnimate, false);
+        dispatchInstances(cb, instCount);
+        mProfiler.writeTimestamp(cb, Profiler::GpuAnimate, true);
+
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                               0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
+
+    // The modes of cull.comp.
+    enum { CullFrustum, CullOccluders, CullOcclusion, CullScatter };
+    struct {
+        float planes[6][4];
+        uint32_t instCount;
+        uint32_t mode;
+    } pc;
+
+    // The planes come from updateFrameMatrices(), like the meshes above.
+    memcpy(pc.planes, mFrame.planes, sizeof(pc.planes));
+    pc.instCount = instCount;
+    pc.mode = mOcclusionCulling ? CullOccluders : CullFrustum;
+
+    // With the buckets back to back, a second dispatch copies the instances
+    // in once the first one has counted them all.
+    auto scatter = [&] {
+        if (!mMultiDrawIndirect)
+            return;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                               0, 1, &barrier, 0, nullptr, 0, nullptr);
+        const uint32_t mode = pc.mode;
+        pc.mode = CullScatter;
+        mDeviceFunctions->vkCmdPushConstants(cb, mCullMaterial.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+        dispatchInstances(cb, pc.instCount);
+        pc.mode = mode;
     };
+
+    mDeviceFunctions->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, mCullMaterial.pipeline);
+    mDeviceFunctions->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE, mCullMaterial.pipelineLayout, 0, 1,
+                                              &cullFrame.descriptorSet, 0, nullptr);
+    mDeviceFunctions->vkCmdPushConstants(cb, mCullMaterial.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+    mProfiler.writeTimestamp(cb, Profiler::GpuCull, false);
+    dispatchInstances(cb, pc.instCount);
+    scatter();
+
+    // Draw the occluders, then start over from empty draws and test
+    // everything in the frustum against the pyramid built from them.
+    if (mOcclusionCulling) {
+        buildOcclusionCommands(cb);
+
+        mDeviceFunctions->vkCmdUpdateBuffer(cb, cullFrame.indirectBuf, 0, sizeof(indirect), &indirect);
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                               VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        pc.mode = CullOcclusion;
+        mDeviceFunctions->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, mCullMaterial.pipeline);
+        mDeviceFunctions->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE, mCullMaterial.pipelineLayout, 0, 1,
+                                                  &cullFrame.descriptorSet, 0, nullptr);
+        mDeviceFunctions->vkCmdPushConstants(cb, mCullMaterial.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+        dispatchInstances(cb, pc.instCount);
+        scatter();
+    }
+    mProfiler.writeTimestamp(cb, Profiler::GpuCull, true);
+
+    // The draw reads the instance count from the indirect buffer and the
+    // instances themselves as vertex input. The uploads and the growing of
+    // the instance store in the next frames must not overtake the animation.
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT
+            | VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                           VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                           0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+//One invocation per instance in groups of 64. Past what a single row of
+//groups may have, the rest go in more rows, animate.comp and cull.comp
+//number the instances on across them.
+void Renderer::dispatchInstances(VkCommandBuffer cb, uint32_t instCount)
+{
+    const uint32_t groupCount = (instCount + 63) / 64;
+    const uint32_t x = qMin(groupCount, mWindow->physicalDeviceProperties()->limits.maxComputeWorkGroupCount[0]);
+    if (x)
+        mDeviceFunctions->vkCmdDispatch(cb, x, (groupCount + x - 1) / x, 1);
+}
+
+//Called from buildCullCommands() between the two culling dispatches. The
+//occluders go into the depth of mOcclusion, with the item uniforms of this
+//frame, which are in place by the time it is submitted. Then the pyramid is
+//built from it, one level after the other.
+void Renderer::buildOcclusionCommands(VkCommandBuffer cb)
+{
+    // The occluders are read as the draws and their instances. The depth was
+    // last read by the pyramid of an earlier frame.
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+
+    VkImageMemoryBarrier depthBarrier{};
+    depthBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    depthBarrier.srcAccessMask = 0;
+    depthBarrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    depthBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depthBarrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depthBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    depthBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    depthBarrier.image = mOcclusion.depthImage;
+    depthBarrier.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
+    mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                           VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT
+                                           | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                                           0, 1, &barrier, 0, nullptr, 1, &depthBarrier);
+
+    mProfiler.writeTimestamp(cb, Profiler::GpuOcclusion, false);
+
+    VkClearValue clearValue{};
+    clearValue.depthStencil = { 1, 0 };
+    VkRenderPassBeginInfo rpBeginInfo{};
+    rpBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    rpBeginInfo.renderPass = mOcclusion.renderPass;
+    rpBeginInfo.framebuffer = mOcclusion.framebuffer;
+    rpBeginInfo.renderArea.extent.width = uint32_t(mOcclusion.depthSize.width());
+    rpBeginInfo.renderArea.extent.height = uint32_t(mOcclusion.depthSize.height());
+    rpBeginInfo.clearValueCount = 1;
+    rpBeginInfo.pClearValues = &clearValue;
+    mDeviceFunctions->vkCmdBeginRenderPass(cb, &rpBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+    // Cleared whole, the rest is far away for the pyramid. The items are
+    // drawn at the render resolution, so are the occluders.
+    VkViewport viewport = { 0, 0, float(mRenderSize.width()), float(mRenderSize.height()), 0, 1 };
+    mDeviceFunctions->vkCmdSetViewport(cb, 0, 1, &viewport);
+    VkRect2D scissor = { { 0, 0 }, { uint32_t(mRenderSize.width()), uint32_t(mRenderSize.height()) } };
     mDeviceFunctions->vkCmdSetScissor(cb, 0, 1, &scissor);
 
-    buildDrawCallsForFloor();
-    buildDrawCallsForItems();
+    // Bound like in buildDrawCallsForItems(), only the vertex uniforms are read.
+    mDeviceFunctions->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, mItemMaterial.occluderPipeline);
+    VkDeviceSize vbOffset = 0;
+    mDeviceFunctions->vkCmdBindVertexBuffers(cb, 0, 1, &mArenaVertexBuf, &vbOffset);
+    mDeviceFunctions->vkCmdBindIndexBuffer(cb, mArenaIndexBuf, 0, mArenaIndexType);
+    const int frame = mWindow->currentFrame();
+    const uint32_t frameUniOffset = frame * (mItemMaterial.vertUniSize + mItemMaterial.fragUniSize);
+    const uint32_t frameUniOffsets[] = { frameUniOffset, frameUniOffset,
+                                         uint32_t(frame * mLightRegionSize), uint32_t(frame * mClusterRegionSize) };
+    mDeviceFunctions->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, mItemMaterial.pipelineLayout, 0, 1,
+                                              &mItemMaterial.descriptorSet, 4, frameUniOffsets);
+    drawItems(cb);
+
+    mDeviceFunctions->vkCmdEndRenderPass(cb);
+
+    // For the pyramid to read the depth. The second culling dispatch
+    // rewrites the draws and the instances the occluders were drawn from,
+    // and the previous frame's one may still be reading the pyramid.
+    barrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    depthBarrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    depthBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    depthBarrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depthBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT
+                                           | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                           0, 1, &barrier, 0, nullptr, 1, &depthBarrier);
+
+    mDeviceFunctions->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, mHizMaterial.pipeline);
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    for (int i = 0; i < mOcclusion.hizLevelCount; ++i) {
+        const uint32_t width = uint32_t(qMax(1, mOcclusion.hizSize.width() >> i));
+        const uint32_t height = uint32_t(qMax(1, mOcclusion.hizSize.height() >> i));
+        mDeviceFunctions->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE, mHizMaterial.pipelineLayout, 0, 1,
+                                                  &mHizMaterial.descriptorSets[i], 0, nullptr);
+        mDeviceFunctions->vkCmdDispatch(cb, (width + 7) / 8, (height + 7) / 8, 1);
+        mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                               0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
 
-    mDeviceFunctions->vkCmdEndRenderPass(cmdBuf);
+    mProfiler.writeTimestamp(cb, Profiler::GpuOcclusion, true);
 }
 
-void Renderer::buildDrawCallsForItems()
+void Renderer::buildLightCullCommands()
 {
-    VkDevice dev = mWindow->device();
     VkCommandBuffer cb = mWindow->currentCommandBuffer();
+    const int frame = mWindow->currentFrame();
+
+    // The slot's part of the light buffer is no longer read by the frame
+    // that used it last, the submit makes the host write visible.
+    memcpy(mLightBufAlloc.mapped + frame * mLightRegionSize, mFrame.lights, mFrame.lightCount * PER_LIGHT_DATA_SIZE);
+    mAllocator.flush(mLightBufAlloc, frame * mLightRegionSize, qMax(mFrame.lightCount, 1) * PER_LIGHT_DATA_SIZE);
+
+    struct {
+        float view[16];
+        float tileNdcSize[2];
+        float invProj[2];
+        float depthRange[2];
+        uint32_t lightCount;
+    } pc;
+
+    memcpy(pc.view, mFrame.view.constData(), sizeof(pc.view));
+    pc.tileNdcSize[0] = mClusterTileNdcSize[0];
+    pc.tileNdcSize[1] = mClusterTileNdcSize[1];
+    // Signed, the clip correction flips y.
+    pc.invProj[0] = 1.0f / mProj(0, 0);
+    pc.invProj[1] = 1.0f / mProj(1, 1);
+    pc.depthRange[0] = CLUSTER_NEAR;
+    pc.depthRange[1] = CLUSTER_FAR;
+    pc.lightCount = uint32_t(mFrame.lightCount);
+
+    const uint32_t offsets[] = { uint32_t(frame * mLightRegionSize), uint32_t(frame * mClusterRegionSize) };
+    mDeviceFunctions->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, mLightCullMaterial.pipeline);
+    mDeviceFunctions->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE, mLightCullMaterial.pipelineLayout, 0, 1,
+                                              &mLightCullMaterial.descriptorSet, 2, offsets);
+    mDeviceFunctions->vkCmdPushConstants(cb, mLightCullMaterial.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+    mProfiler.writeTimestamp(cb, Profiler::GpuLightCull, false);
+    mDeviceFunctions->vkCmdDispatch(cb, (CLUSTER_COUNT + 63) / 64, 1, 1);
+    mProfiler.writeTimestamp(cb, Profiler::GpuLightCull, true);
+
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    mDeviceFunctions->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                           0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
 
-    mDeviceFunctions->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, mItemMaterial.pipeline);
+void Renderer::buildDrawCallsForItems(VkCommandBuffer cb)
+{
+    mDeviceFunctions->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                        mDepthPrepass ? mItemMaterial.prepassPipeline : mItemMaterial.pipelines[mItemVariant]);
 
+    // All meshes at once, which one an instance uses is up to its data.
     VkDeviceSize vbOffset = 0;
-    mDeviceFunctions->vkCmdBindVertexBuffers(cb, 0, 1, mUseLogo ? &mLogoVertexBuf : &mBlockVertexBuf, &vbOffset);
-    mDeviceFunctions->vkCmdBindVertexBuffers(cb, 1, 1, &mInstBuf, &vbOffset);
+    mDeviceFunctions->vkCmdBindVertexBuffers(cb, 0, 1, &mArenaVertexBuf, &vbOffset);
+    mDeviceFunctions->vkCmdBindIndexBuffer(cb, mArenaIndexBuf, 0, mArenaIndexType);
 
     // Now provide offsets so that the two dynamic buffers point to the
     // beginning of the vertex and fragment uniform data for the current frame.
-    uint32_t frameUniOffset = mWindow->currentFrame() * (mItemMaterial.vertUniSize + mItemMaterial.fragUniSize);
-    uint32_t frameUniOffsets[] = { frameUniOffset, frameUniOffset };
+    // The lights and the clusters have their own stride.
+    const int frame = mWindow->currentFrame();
+    uint32_t frameUniOffset = frame * (mItemMaterial.vertUniSize + mItemMaterial.fragUniSize);
+    uint32_t frameUniOffsets[] = { frameUniOffset, frameUniOffset,
+                                   uint32_t(frame * mLightRegionSize), uint32_t(frame * mClusterRegionSize) };
     mDeviceFunctions->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, mItemMaterial.pipelineLayout, 0, 1,
-                                        &mItemMaterial.descriptorSet, 2, frameUniOffsets);
+                                        &mItemMaterial.descriptorSet, 4, frameUniOffsets);
 
-    if (mAnimating)
-        mRotation += 0.5;
-
-    if (mAnimating || mVpDirty) {
-        if (mVpDirty)
-            --mVpDirty;
-        QMatrix4x4 vp, model;
-        QMatrix3x3 modelNormal;
-        QVector3D eyePos;
-        getMatrices(&vp, &model, &modelNormal, &eyePos);
-
-        // Map the uniform data for the current frame, ignore the geometry data at
-        // the beginning and the uniforms for other frames.
-        uint8_t* p{ nullptr };
-        VkResult err = mDeviceFunctions->vkMapMemory(dev, mBufMem,
-                                               mItemMaterial.uniMemStartOffset + frameUniOffset,
-                                               mItemMaterial.vertUniSize + mItemMaterial.fragUniSize,
-                                               0, reinterpret_cast<void **>(&p));
-        if (err != VK_SUCCESS)
-            qFatal("Failed to map memory: %d", err);
+    if (mVpDirty) {
+        --mVpDirty;
 
-        // Vertex shader uniforms
-        memcpy(p, vp.constData(), 64);
-        memcpy(p + 64, model.constData(), 64);
-        const float *mnp = modelNormal.constData();
-        memcpy(p + 128, mnp, 12);
-        memcpy(p + 128 + 16, mnp + 3, 12);
-        memcpy(p + 128 + 32, mnp + 6, 12);
+        // The uniform data for the current frame in the persistent mapping, ignore
+        // the uniforms for other frames.
+        uint8_t *p = mUniBufAlloc.mapped + frameUniOffset;
+
+        // Vertex shader uniforms, the meshes with the std140 array stride of 112
+        memcpy(p, mFrame.vp.constData(), 64);
+        for (int m = 0; m < ItemMeshCount; ++m) {
+            uint8_t *meshUni = p + 64 + m * (64 + 48);
+            memcpy(meshUni, mFrame.itemModel[m].constData(), 64);
+            memcpy(meshUni + 64, mFrame.modelNormal[m], 48);
+        }
 
         // Fragment shader uniforms
         p += mItemMaterial.vertUniSize;
-        writeFragUni(p, eyePos);
+        writeFragUni(p, mFrame.eyePos, mFrame.viewDepth);
+
+        mAllocator.flush(mUniBufAlloc, frameUniOffset, mItemMaterial.vertUniSize + mItemMaterial.fragUniSize);
+    }
 
-        mDeviceFunctions->vkUnmapMemory(dev, mBufMem);
+    drawItems(cb);
+
+    // The same draws once more, the layout and the bindings stay.
+    if (mDepthPrepass) {
+        mDeviceFunctions->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, mItemMaterial.shadePipelines[mItemVariant]);
+        drawItems(cb);
     }
+}
+
+void Renderer::drawItems(VkCommandBuffer cb)
+{
+    const CullFrame &cullFrame(mCullFrames[mWindow->currentFrame()]);
+    VkDeviceSize vbOffset = 0;
 
-    mDeviceFunctions->vkCmdDraw(cb, (mUseLogo ? mLogoMesh.data() : mBlockMesh.data())->vertexCount, mInstCount, 0, 0);
+    // Each draw takes its instances from its bucket in the culling output.
+    // Empty draws cost next to nothing. Without multiDrawIndirect and
+    // drawIndirectFirstInstance every draw is a call of its own, with its
+    // bucket bound so that firstInstance can stay 0. The buckets then have
+    // room for all instances each, as their offsets have to be known here.
+    if (mMultiDrawIndirect) {
+        mDeviceFunctions->vkCmdBindVertexBuffers(cb, 1, 1, &cullFrame.visibleBuf, &vbOffset);
+        mDeviceFunctions->vkCmdDrawIndexedIndirect(cb, cullFrame.indirectBuf, 0, uint32_t(mDrawCount),
+                                                   sizeof(VkDrawIndexedIndirectCommand));
+    } else {
+        for (int d = 0; d < mDrawCount; ++d) {
+            const VkDeviceSize bucketOffset = VkDeviceSize(d) * cullFrame.visibleCapacity * PER_INSTANCE_DATA_SIZE;
+            mDeviceFunctions->vkCmdBindVertexBuffers(cb, 1, 1, &cullFrame.visibleBuf, &bucketOffset);
+            mDeviceFunctions->vkCmdDrawIndexedIndirect(cb, cullFrame.indirectBuf, d * sizeof(VkDrawIndexedIndirectCommand),
+                                                       1, sizeof(VkDrawIndexedIndirectCommand));
+        }
+    }
 }
 
-void Renderer::buildDrawCallsForFloor()
+void Renderer::buildUpscaleCommands(VkCommandBuffer cb)
+{
+    const QSize sz = mWindow->swapChainImageSize();
+    VkViewport viewport = { 0, 0, float(sz.width()), float(sz.height()), 0, 1 };
+    mDeviceFunctions->vkCmdSetViewport(cb, 0, 1, &viewport);
+    VkRect2D scissor = { { 0, 0 }, { uint32_t(sz.width()), uint32_t(sz.height()) } };
+    mDeviceFunctions->vkCmdSetScissor(cb, 0, 1, &scissor);
+
+    const float targetWidth = mOffscreen.size.width();
+    const float targetHeight = mOffscreen.size.height();
+    const float pc[] = {
+        mRenderSize.width() / targetWidth, mRenderSize.height() / targetHeight,
+        (mRenderSize.width() - 0.5f) / targetWidth, (mRenderSize.height() - 0.5f) / targetHeight
+    };
+
+    mDeviceFunctions->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, mUpscaleMaterial.pipeline);
+    mDeviceFunctions->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, mUpscaleMaterial.pipelineLayout, 0, 1,
+                                              &mUpscaleMaterial.descriptorSet, 0, nullptr);
+    mDeviceFunctions->vkCmdPushConstants(cb, mUpscaleMaterial.pipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(pc), pc);
+    mProfiler.writeTimestamp(cb, Profiler::GpuUpscale, false);
+    mDeviceFunctions->vkCmdDraw(cb, 3, 1, 0, 0);
+    mProfiler.writeTimestamp(cb, Profiler::GpuUpscale, true);
+}
+
+void Renderer::buildDrawCallsForFloor(VkCommandBuffer cb)
 {
-    VkCommandBuffer cb = mWindow->currentCommandBuffer();
 
     mDeviceFunctions->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, mFloorMaterial.pipeline);
 
     VkDeviceSize vbOffset = 0;
     mDeviceFunctions->vkCmdBindVertexBuffers(cb, 0, 1, &mFloorVertexBuf, &vbOffset);
 
-    QMatrix4x4 mvp = mProj * mCam.viewMatrix() * mFloorModel;
-    mDeviceFunctions->vkCmdPushConstants(cb, mFloorMaterial.pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, 64, mvp.constData());
+    mDeviceFunctions->vkCmdPushConstants(cb, mFloorMaterial.pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, 64, mFrame.floorMvp.constData());
     float color[] = { 0.67f, 1.0f, 0.2f };
     mDeviceFunctions->vkCmdPushConstants(cb, mFloorMaterial.pipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 64, 12, color);
 
     mDeviceFunctions->vkCmdDraw(cb, 4, 1, 0, 0);
 }
 
+//The setters below are called on the GUI thread. They only queue the input or
+//store the requested state, consumeInput() applies it at the start of the next
+//frame on the render worker. No lock is shared between the two, so neither
+//has to wait for the other.
+void Renderer::setAnimating(bool a)
+{
+    mRequestedAnimating.store(a, std::memory_order_release);
+}
+
+void Renderer::setDepthPrepass(bool enable)
+{
+    mRequestedDepthPrepass.store(enable, std::memory_order_release);
+    if (!mRequestedAnimating.load(std::memory_order_acquire))
+        mWindow->requestUpdate();
+}
+
+void Renderer::setOcclusionCulling(bool enable)
+{
+    mRequestedOcclusionCulling.store(enable, std::memory_order_release);
+    if (!mRequestedAnimating.load(std::memory_order_acquire))
+        mWindow->requestUpdate();
+}
+
+void Renderer::setAdaptiveResolution(bool enable)
+{
+    mRequestedAdaptiveResolution.store(enable, std::memory_order_release);
+    if (!mRequestedAnimating.load(std::memory_order_acquire))
+        mWindow->requestUpdate();
+}
+
+void Renderer::setLightCount(int count)
+{
+    mRequestedLightCount.store(qBound(0, count, MAX_LIGHT_COUNT), std::memory_order_release);
+    if (!mRequestedAnimating.load(std::memory_order_acquire))
+        mWindow->requestUpdate();
+}
+
+void Renderer::setSpecular(bool enable)
+{
+    mRequestedSpecular.store(enable, std::memory_order_release);
+    if (!mRequestedAnimating.load(std::memory_order_acquire))
+        mWindow->requestUpdate();
+}
+
+void Renderer::setPrepareAhead(bool enable)
+{
+    mPrepareAhead = enable;
+}
+
+void Renderer::setCommandCaching(bool enable)
+{
+    mRequestedCacheCommands.store(enable, std::memory_order_release);
+}
+
 void Renderer::addNew()
 {
-    QMutexLocker locker(&mGuiMutex);
-    mInstCount = qMin(mInstCount + 16, MAX_INSTANCES);
+    // Up to what the device can hold, consumeInput() clamps anything else.
+    const int maxInstCount = mPublishedMaxInstCount.load(std::memory_order_acquire);
+    int count = mRequestedInstCount.load(std::memory_order_relaxed);
+    while (count < maxInstCount
+           && !mRequestedInstCount.compare_exchange_weak(count, qMin(count + 16, maxInstCount), std::memory_order_acq_rel))
+        ;
+    if (count >= maxInstCount)
+        qWarning("Not adding instances, %d is all the buffers hold", maxInstCount);
+}
+
+void Renderer::setInstanceCount(int count)
+{
+    mRequestedInstCount.store(count, std::memory_order_release);
+}
+
+bool Renderer::loadScene(const QString &fileName)
+{
+    if (!mSceneLoader.start(fileName, itemMeshFiles()))
+        return false;
+    if (!mRequestedAnimating.load(std::memory_order_acquire))
+        mWindow->requestUpdate();
+    return true;
+}
+
+void Renderer::saveScene(const QString &fileName)
+{
+    QMutexLocker locker(&mSceneSaveMutex);
+    mRequestedSceneSave = fileName;
+    if (!mRequestedAnimating.load(std::memory_order_acquire))
+        mWindow->requestUpdate();
+}
+
+int Renderer::instanceCapacity() const
+{
+    return mPublishedCapacity.load(std::memory_order_acquire);
+}
+
+VkDeviceSize Renderer::instanceBytesUsed() const
+{
+    return mPublishedBytesUsed.load(std::memory_order_acquire);
+}
+
+VkDeviceSize Renderer::instanceBytesAllocated() const
+{
+    return mPublishedBytesAllocated.load(std::memory_order_acquire);
+}
+
+void Renderer::pushInput(InputEvent::Type type, float amount)
+{
+    if (mInput.push({ type, amount }))
+        return;
+    mDroppedInputCount.fetch_add(1, std::memory_order_relaxed);
+    if (DBG)
+        qDebug("Input queue full, dropping input");
 }
 
 void Renderer::yaw(float degrees)
 {
-    QMutexLocker locker(&mGuiMutex);
-    mCam.yaw(degrees);
-    markViewProjDirty();
+    pushInput(InputEvent::Yaw, degrees);
 }
 
 void Renderer::pitch(float degrees)
 {
-    QMutexLocker locker(&mGuiMutex);
-    mCam.pitch(degrees);
-    markViewProjDirty();
+    pushInput(InputEvent::Pitch, degrees);
 }
 
 void Renderer::walk(float amount)
 {
-    QMutexLocker locker(&mGuiMutex);
-    mCam.walk(amount);
-    markViewProjDirty();
+    pushInput(InputEvent::Walk, amount);
 }
 
 void Renderer::strafe(float amount)
 {
-    QMutexLocker locker(&mGuiMutex);
-    mCam.strafe(amount);
-    markViewProjDirty();
+    pushInput(InputEvent::Strafe, amount);
 }
 
 void Renderer::setUseLogo(bool b)
 {
-    QMutexLocker locker(&mGuiMutex);
-    mUseLogo = b;
-    if (!mAnimating)
+    mRequestedUseLogo.store(b, std::memory_order_release);
+    if (!mRequestedAnimating.load(std::memory_order_acquire))
+        mWindow->requestUpdate();
+}
+
+void Renderer::setMixedMeshes(bool b)
+{
+    mRequestedMixedMeshes.store(b, std::memory_order_release);
+    if (!mRequestedAnimating.load(std::memory_order_acquire))
         mWindow->requestUpdate();
 }
+
+//Called at the start of buildFrame(). Everything read here stays the same for the whole frame.
+void Renderer::consumeInput()
+{
+    InputEvent e;
+    bool camMoved = false;
+    while (mInput.pop(&e)) {
+        switch (e.type) {
+        case InputEvent::Yaw:
+            mCam.yaw(e.amount);
+            break;
+        case InputEvent::Pitch:
+            mCam.pitch(e.amount);
+            break;
+        case InputEvent::Walk:
+            mCam.walk(e.amount);
+            break;
+        case InputEvent::Strafe:
+            mCam.strafe(e.amount);
+            break;
+        }
+        camMoved = true;
+    }
+    if (camMoved)
+        markViewProjDirty();
+
+    // A new scene replaces all the instances, prepareInstances() adds them
+    // back as they are read.
+    const quint32 sceneGeneration = mSceneLoader.generation();
+    if (sceneGeneration != mSceneGeneration) {
+        mSceneGeneration = sceneGeneration;
+        if (!mLoadingScene) {
+            mLoadRequestBase = mRequestedInstCount.load(std::memory_order_acquire);
+            mQueuedInstCount = 0;
+        }
+        mLoadingScene = true;
+        mInstData.clear();
+        mInstCount = 0;
+        mPreparedInstCount = 0;
+        mInstances.clear();
+        invalidateChunkCache();
+    }
+
+    int instCount = mRequestedInstCount.load(std::memory_order_acquire);
+    if (instCount > mMaxInstCount) {
+        qWarning("%d instances requested, the buffers hold at most %d", instCount, mMaxInstCount);
+        instCount = mMaxInstCount;
+        mRequestedInstCount.store(instCount, std::memory_order_release);
+    }
+    if (!mLoadingScene && instCount != mInstCount) {
+        mInstCount = instCount;
+        invalidateChunkCache();
+    }
+
+    // Only the instance data changes, the commands stay the same.
+    const bool useLogo = mRequestedUseLogo.load(std::memory_order_acquire);
+    const bool mixedMeshes = mRequestedMixedMeshes.load(std::memory_order_acquire);
+    if (useLogo != mUseLogo || mixedMeshes != mMixedMeshes) {
+        mUseLogo = useLogo;
+        mMixedMeshes = mixedMeshes;
+        mMeshIdsDirty = true;
+    }
+
+    // Only decides whether animate.comp runs, the commands stay the same.
+    mAnimating = mRequestedAnimating.load(std::memory_order_acquire);
+
+    // A push constant of the light culling, outside the render pass.
+    mLightCount = mRequestedLightCount.load(std::memory_order_acquire);
+    mSpecular = mRequestedSpecular.load(std::memory_order_acquire);
+
+    // Binds other pipelines, so the recorded commands cannot stay either. The
+    // quickly linked ones may still be drawing, they go when everything does.
+    if (mPipelineLibraries && !mItemMaterial.optimized && mItemMaterial.optimizeFuture.isFinished()) {
+        for (int v = 0; v < ItemVariantCount; ++v) {
+            std::swap(mItemMaterial.pipelines[v], mItemMaterial.optimizedPipelines[0][v]);
+            std::swap(mItemMaterial.shadePipelines[v], mItemMaterial.optimizedPipelines[1][v]);
+        }
+        mItemMaterial.optimized = true;
+        invalidateChunkCache();
+    }
+
+    // The pipelines were all created up front, but the recorded commands bind the old one.
+    const int itemVariant = (mSpecular ? ItemSpecular : 0) | (mLightCount > 0 ? ItemPointLights : 0);
+    if (itemVariant != mItemVariant) {
+        mItemVariant = itemVariant;
+        invalidateChunkCache();
+    }
+
+    // Only changes the culling, the draws stay the same.
+    mOcclusionCulling = mRequestedOcclusionCulling.load(std::memory_order_acquire);
+
+    // Takes effect in updateRenderSize(), which invalidates what it has to.
+    mAdaptiveResolution = mRequestedAdaptiveResolution.load(std::memory_order_acquire);
+
+    const bool depthPrepass = mRequestedDepthPrepass.load(std::memory_order_acquire);
+    if (depthPrepass != mDepthPrepass) {
+        mDepthPrepass = depthPrepass;
+        invalidateChunkCache();
+    }
+
+    const bool cacheCommands = mRequestedCacheCommands.load(std::memory_order_acquire);
+    if (cacheCommands != mCacheCommands) {
+        mCacheCommands = cacheCommands;
+        invalidateChunkCache();
+    }
+}
@@ -8,13 +8,25 @@
 #include "mesh.h"
 #include "shader.h"
 #include "camera.h"
+#include "instancestore.h"
+#include "transferqueue.h"
+#include "spscqueue.h"
+#include "profiler.h"
+#include "memoryallocator.h"
+#include "utilities.h"
+#include "qualitygovernor.h"
+#include "instancegenerator.h"
+#include "scenefile.h"
 #include <QFutureWatcher>
+#include <QElapsedTimer>
 #include <QMutex>
+#include <atomic>
 
 class Renderer : public QVulkanWindowRenderer
 {
 public:
-    Renderer(VulkanWindow *w, int initialCount);
+    // The seed is for the instance data, a fixed one gives the same scene every run.
+    Renderer(VulkanWindow *w, int initialCount, quint32 seed);
 
     void preInitResources() override;
     void initResources() override;
@@ -24,11 +36,69 @@ public:
 
     void startNextFrame() override;
 
-    bool animating() const { return mAnimating; }
-    void setAnimating(bool a) { mAnimating = a; }
+    // Called on the GUI thread, the changes apply from the next frame on.
+    bool animating() const { return mRequestedAnimating.load(std::memory_order_acquire); }
+    void setAnimating(bool a);
 
-    int instanceCount() const { return mInstCount; }
+    // Replay the recorded render pass contents while paused and nothing changes.
+    bool commandCaching() const { return mRequestedCacheCommands.load(std::memory_order_acquire); }
+    void setCommandCaching(bool enable);
+
+    // Lay down the depth of the items first, then shade only the fragments
+    // that are visible in the end.
+    bool depthPrepass() const { return mRequestedDepthPrepass.load(std::memory_order_acquire); }
+    void setDepthPrepass(bool enable);
+
+    // Also cull what is hidden behind the instances drawn last time, on top of
+    // the frustum culling.
+    bool occlusionCulling() const { return mRequestedOcclusionCulling.load(std::memory_order_acquire); }
+    void setOcclusionCulling(bool enable);
+
+    // Lower the resolution of the scene while the GPU takes longer than the
+    // frame budget, see QualityGovernor.
+    bool adaptiveResolution() const { return mRequestedAdaptiveResolution.load(std::memory_order_acquire); }
+    void setAdaptiveResolution(bool enable);
+    // As of the last frame built, 1 = full resolution.
+    float renderScale() const { return mPublishedRenderScale.load(std::memory_order_acquire); }
+    // Camera input that did not fit into the queue to the render thread.
+    int droppedInputCount() const { return mDroppedInputCount.load(std::memory_order_relaxed); }
+
+    // The point lights moving around the instances, up to MAX_LIGHT_COUNT.
+    int lightCount() const { return mRequestedLightCount.load(std::memory_order_acquire); }
+    void setLightCount(int count);
+
+    // The specular highlights of the items, off drops them from the shader.
+    bool specular() const { return mRequestedSpecular.load(std::memory_order_acquire); }
+    void setSpecular(bool enable);
+
+    // Build the CPU side of the next frame while the current one is submitted.
+    // GUI thread only, like frameWaitMs().
+    bool prepareAhead() const { return mPrepareAhead; }
+    void setPrepareAhead(bool enable);
+    // How long the frames waited for their build after startNextFrame(), smoothed.
+    float frameWaitMs() const { return mFrameWaitMs; }
+
+    // CPU and GPU timings, thread-safe.
+    const Profiler *profiler() const { return &mProfiler; }
+    Profiler *profiler() { return &mProfiler; }
+
+    int instanceCount() const { return mRequestedInstCount.load(std::memory_order_acquire); }
+    // As of the last frame built.
+    int instanceCapacity() const;
+    // What the device's buffers hold at most, more instances are not added.
+    int maxInstanceCount() const { return mPublishedMaxInstCount.load(std::memory_order_acquire); }
+    VkDeviceSize instanceBytesUsed() const;
+    VkDeviceSize instanceBytesAllocated() const;
     void addNew();
+    void setInstanceCount(int count);
+
+    // Replaces the instances with the ones in a scene file, see scenefile.h.
+    // They show up over the next frames while the file is read. False when
+    // the file cannot be loaded, the instances stay as they are then.
+    bool loadScene(const QString &fileName);
+    // Writes the instances to a scene file in the background, as they were
+    // created or loaded, without what animate.comp did to them since.
+    void saveScene(const QString &fileName);
 
     void yaw(float degrees);
     void pitch(float degrees);
@@ -36,44 +106,157 @@ public:
     void strafe(float amount);
 
     void setUseLogo(bool b);
+    // Every other instance a block, the others the logo. Overrides setUseLogo().
+    void setMixedMeshes(bool b);
 
 private:
-    void createPipelines();
+    // The meshes the instances can be drawn with, the mesh of an instance is
+    // part of its data, see prepareInstances().
+    enum ItemMesh {
+        BlockMesh,
+        LogoMesh,
+        ItemMeshCount
+    };
+    // A draw for each level of detail of each mesh.
+    static const int MAX_DRAW_COUNT = ItemMeshCount * MAX_LOD_COUNT;
+
+    // The specialization constants of color_phong.frag that switch code paths
+    // on and off. Every combination gets its pipelines up front, so changing
+    // them never waits for a compile.
+    enum ItemVariantFlag {
+        ItemSpecular = 0x1,
+        ItemPointLights = 0x2,
+        ItemVariantCount = 4
+    };
+
+    // Camera input from the GUI thread, in the order it happened.
+    struct InputEvent {
+        enum Type {
+            Yaw,
+            Pitch,
+            Walk,
+            Strafe
+        } type;
+        float amount;
+    };
+    void pushInput(InputEvent::Type type, float amount);
+    void consumeInput();
+
+    void createPipelineCache();
+    void waitForPipelines();
+    QString pipelineCacheFileName() const;
+    QByteArray loadPipelineCacheData() const;
+    void savePipelineCache();
     void createItemPipeline();
+    void createItemVariants(VkGraphicsPipelineCreateInfo pipelineInfo, VkPipeline *pipelines,
+                            VkPipeline *fragmentLibraries);
+#ifdef VK_EXT_graphics_pipeline_library
+    VkPipeline createItemLibrary(VkGraphicsPipelineCreateInfo info, VkGraphicsPipelineLibraryFlagsEXT parts);
+    VkPipeline linkItemPipeline(VkPipeline fragmentLibrary, bool optimize);
+#endif
+    void optimizeItemPipelines();
     void createFloorPipeline();
+    void createCullPipeline();
+    void createAnimatePipeline();
+    void createLightCullPipeline();
+    void createUpscalePipeline();
+    void createHizPipeline();
+    void createOcclusionRenderPass();
     void ensureBuffers();
+    VkCommandBuffer beginOneShotCommands();
+    void endOneShotCommands(VkCommandBuffer cb);
+    quint8 instanceMesh(int instance) const;
+    void prepareInstances();
     void ensureInstanceBuffer();
-    void getMatrices(QMatrix4x4 *mvp, QMatrix4x4 *model, QMatrix3x3 *modelNormal, QVector3D *eyePos);
-    void writeFragUni(uint8_t *p, const QVector3D &eyePos);
+    void ensureCullBuffers();
+    void ensureOffscreenTarget();
+    void releaseOffscreenTarget();
+    void ensureOcclusionTarget();
+    void releaseOcclusionTarget();
+
+    // The render pass contents, each recorded into a secondary command buffer
+    // of its own. Recorded in parallel and executed in this order.
+    enum SceneChunk {
+        FloorChunk,
+        ItemChunk,
+        SceneChunkCount
+    };
+    void ensureChunkCommands();
+    void recordChunk(SceneChunk chunk, bool reusable);
+    void releaseChunkCommands();
+    void getMatrices(QMatrix4x4 *vp, QVector3D *eyePos);
+    void writeFragUni(uint8_t *p, const QVector3D &eyePos, const QVector4D &viewDepth);
+    void prepareFrame();
+    void updateFrameMatrices();
+    void updateLights();
+    void updateRenderSize();
     void buildFrame();
-    void buildDrawCallsForItems();
-    void buildDrawCallsForFloor();
+    void buildCullCommands();
+    void buildOcclusionCommands(VkCommandBuffer cb);
+    void dispatchInstances(VkCommandBuffer cb, uint32_t instCount);
+    void buildLightCullCommands();
+    void buildDrawCallsForItems(VkCommandBuffer cb);
+    void drawItems(VkCommandBuffer cb);
+    void buildDrawCallsForFloor(VkCommandBuffer cb);
+    void buildUpscaleCommands(VkCommandBuffer cb);
 
-    void markViewProjDirty() { mVpDirty = mWindow->concurrentFrameCount(); }
+    void markViewProjDirty() { mVpDirty = mWindow->concurrentFrameCount(); invalidateChunkCache(); }
+    // Anything that changes what the chunks record, the matrices included
+    // since the floor pushes its mvp as a push constant.
+    void invalidateChunkCache() { ++mChunkCacheGeneration; }
 
     VulkanWindow *mWindow{nullptr};
     QVulkanDeviceFunctions *mDeviceFunctions{nullptr};
     const VkDevice mLogicalDevice{nullptr};
 
     bool mUseLogo{false};
-    Mesh mBlockMesh;
-    Mesh mLogoMesh;
-    VkBuffer mBlockVertexBuf{VK_NULL_HANDLE};
-    VkBuffer mLogoVertexBuf{VK_NULL_HANDLE};
+    bool mMixedMeshes{false};
+    bool mMeshIdsDirty{false}; // the instances already prepared need their mesh rewritten
+    Mesh mItemMeshes[ItemMeshCount];
+
+    // The geometry arena: all item meshes in one vertex and one index buffer,
+    // each with a range of its own. The indices stay relative to the mesh,
+    // the draws add vertexOffset.
+    VkBuffer mArenaVertexBuf{VK_NULL_HANDLE};
+    VkBuffer mArenaIndexBuf{VK_NULL_HANDLE};
+    VkIndexType mArenaIndexType{VK_INDEX_TYPE_UINT16};
+    struct {
+        int32_t vertexOffset;
+        uint32_t firstIndex;
+    } mArenaRanges[ItemMeshCount]{};
     VkBuffer mFloorVertexBuf{ VK_NULL_HANDLE };
 
 	// Item material = phong shader
     struct {
         VkDeviceSize vertUniSize;
         VkDeviceSize fragUniSize;
-        VkDeviceSize uniMemStartOffset;
         Shader vs;
         Shader fs;
+        Shader prepassVs;
         VkDescriptorPool descriptorPool{VK_NULL_HANDLE};
         VkDescriptorSetLayout descriptorSetLayout{VK_NULL_HANDLE};
         VkDescriptorSet descriptorSet;
         VkPipelineLayout pipelineLayout{VK_NULL_HANDLE};
-        VkPipeline pipeline{VK_NULL_HANDLE};
+        // Indexed by the ItemVariantFlags.
+        VkPipeline pipelines[ItemVariantCount]{};
+        // With the depth pre-pass: depth only, then shading on equal depth without writing it.
+        VkPipeline prepassPipeline{VK_NULL_HANDLE};
+        VkPipeline shadePipelines[ItemVariantCount]{};
+        // Depth only into the occlusion target, for the occlusion culling.
+        VkPipeline occluderPipeline{VK_NULL_HANDLE};
+        QFuture<void> pipelineFuture;
+        // With pipeline libraries, the parts the variants are linked from,
+        // the fragment shaders of pipelines and shadePipelines last. The
+        // variants are linked quickly at first, optimizeFuture links them
+        // once more with link time optimization. Once swapped in, the first
+        // ones are kept in optimizedPipelines until released.
+        VkPipeline vertexInputLibrary{VK_NULL_HANDLE};
+        VkPipeline preRasterizationLibrary{VK_NULL_HANDLE};
+        VkPipeline fragmentOutputLibrary{VK_NULL_HANDLE};
+        VkPipeline fragmentLibraries[2][ItemVariantCount]{};
+        VkPipeline optimizedPipelines[2][ItemVariantCount]{};
+        bool optimized{false};
+        QFuture<void> optimizeFuture;
     } mItemMaterial;
 
 	// Floor material = color shader
@@ -82,34 +265,307 @@ private:
         Shader fs;
         VkPipelineLayout pipelineLayout{VK_NULL_HANDLE};
         VkPipeline pipeline{VK_NULL_HANDLE};
+        QFuture<void> pipelineFuture;
     } mFloorMaterial;
 
-    VkDeviceMemory mBufMem{VK_NULL_HANDLE};
+    // Frustum culling = compute shader, compacts the visible instances into
+    // one bucket per level of detail and fills in the instance count of each
+    // bucket's vkCmdDrawIndexedIndirect
+    struct {
+        Shader cs;
+        VkDescriptorPool descriptorPool{VK_NULL_HANDLE};
+        VkDescriptorSetLayout descriptorSetLayout{VK_NULL_HANDLE};
+        VkPipelineLayout pipelineLayout{VK_NULL_HANDLE};
+        VkPipeline pipeline{VK_NULL_HANDLE};
+        QFuture<void> pipelineFuture;
+    } mCullMaterial;
+
+    // Instance animation = compute shader, advances the spin of every
+    // instance in the instance store. Uses the descriptor sets of the culling.
+    struct {
+        Shader cs;
+        VkPipelineLayout pipelineLayout{VK_NULL_HANDLE};
+        VkPipeline pipeline{VK_NULL_HANDLE};
+        QFuture<void> pipelineFuture;
+    } mAnimateMaterial;
+
+    // Light culling = compute shader, bins the point lights into the
+    // clusters the fragment shader of the items picks them up from. A single
+    // descriptor set, the frame slot's part of the buffers is a dynamic offset.
+    struct {
+        Shader cs;
+        VkDescriptorPool descriptorPool{VK_NULL_HANDLE};
+        VkDescriptorSetLayout descriptorSetLayout{VK_NULL_HANDLE};
+        VkDescriptorSet descriptorSet{VK_NULL_HANDLE};
+        VkPipelineLayout pipelineLayout{VK_NULL_HANDLE};
+        VkPipeline pipeline{VK_NULL_HANDLE};
+        QFuture<void> pipelineFuture;
+    } mLightCullMaterial;
+
+    // Depth pyramid = compute shader, one dispatch per level, each reading
+    // the level below it. A descriptor set per level.
+    struct {
+        Shader cs;
+        VkSampler sampler{VK_NULL_HANDLE}; // nearest, also for the culling's view of the pyramid
+        VkDescriptorPool descriptorPool{VK_NULL_HANDLE};
+        VkDescriptorSetLayout descriptorSetLayout{VK_NULL_HANDLE};
+        VkDescriptorSet descriptorSets[HIZ_MAX_LEVELS]{};
+        VkPipelineLayout pipelineLayout{VK_NULL_HANDLE};
+        VkPipeline pipeline{VK_NULL_HANDLE};
+        QFuture<void> pipelineFuture;
+    } mHizMaterial;
+
+    // Upscale material = a triangle over the whole window sampling the
+    // offscreen target, for when the scene is rendered at reduced resolution
+    struct {
+        Shader vs;
+        Shader fs;
+        VkSampler sampler{VK_NULL_HANDLE};
+        VkDescriptorPool descriptorPool{VK_NULL_HANDLE};
+        VkDescriptorSetLayout descriptorSetLayout{VK_NULL_HANDLE};
+        VkDescriptorSet descriptorSet{VK_NULL_HANDLE};
+        VkPipelineLayout pipelineLayout{VK_NULL_HANDLE};
+        VkPipeline pipeline{VK_NULL_HANDLE};
+        QFuture<void> pipelineFuture;
+    } mUpscaleMaterial;
+
+    // Where the scene goes below full resolution, into the top left
+    // mRenderSize of it. Created when first needed, sized for the largest
+    // reduced level, released with the swapchain. The same attachments as the
+    // default render pass, so the item and floor pipelines work with both.
+    // Kept in the layouts the render pass expects in between, the color in
+    // SHADER_READ_ONLY_OPTIMAL for the upscale.
+    struct {
+        VkImage colorImage{VK_NULL_HANDLE};
+        MemoryAllocator::Allocation colorAlloc;
+        VkImageView colorView{VK_NULL_HANDLE};
+        VkImage msaaImage{VK_NULL_HANDLE}; // only with MSAA, resolved into the color
+        MemoryAllocator::Allocation msaaAlloc;
+        VkImageView msaaView{VK_NULL_HANDLE};
+        VkImage depthImage{VK_NULL_HANDLE};
+        MemoryAllocator::Allocation depthAlloc;
+        VkImageView depthView{VK_NULL_HANDLE};
+        VkRenderPass renderPass{VK_NULL_HANDLE};
+        VkFramebuffer framebuffer{VK_NULL_HANDLE};
+        QSize size;
+    } mOffscreen;
+
+    // What the occlusion culling draws its occluders into and builds the
+    // depth pyramid from, see buildOcclusionCommands(). Shared by the frame
+    // slots, the barriers keep them apart. Sized for the swapchain, the
+    // render pass stays. The pyramid is kept in VK_IMAGE_LAYOUT_GENERAL, the
+    // depth goes back and forth every frame.
+    struct {
+        VkFormat depthFormat{VK_FORMAT_UNDEFINED};
+        VkImage depthImage{VK_NULL_HANDLE};
+        MemoryAllocator::Allocation depthAlloc;
+        VkImageView depthView{VK_NULL_HANDLE};
+        VkImage hizImage{VK_NULL_HANDLE};
+        MemoryAllocator::Allocation hizAlloc;
+        VkImageView hizView{VK_NULL_HANDLE}; // all levels, for the culling
+        VkImageView hizLevelViews[HIZ_MAX_LEVELS]{};
+        int hizLevelCount{0};
+        VkRenderPass renderPass{VK_NULL_HANDLE};
+        VkFramebuffer framebuffer{VK_NULL_HANDLE};
+        QSize depthSize; // the swapchain's, the occluders only cover mRenderSize of it
+        QSize hizSize; // level 0
+        quint32 generation{0}; // of the views, for the culling's descriptor sets
+    } mOcclusion;
+
+    // What the culling needs to know about a mesh, see MeshInfo in cull.comp.
+    struct CullMesh {
+        float sphere[4];
+        float lodDepths[MAX_LOD_COUNT - 1]; // where levels 1, 2 and 3 take over
+        uint32_t firstDraw;
+        float aabbCenter[4];
+        float aabbExtent[4];
+    };
+
+    // The contents of a frame slot's indirect buffer, see IndirectBuf in cull.comp.
+    struct CullIndirect {
+        VkDrawIndexedIndirectCommand draws[MAX_DRAW_COUNT];
+        uint32_t bucketCapacity;
+        uint32_t padding[3]; // the matrix is 16 byte aligned in std430
+        float viewProj[16];
+        float renderSize[2];
+        uint32_t hizLevelCount;
+        uint32_t padding2;
+        CullMesh meshes[ItemMeshCount];
+    };
+
+    // The culling output is written every frame while the previous frame may
+    // still be drawing from its own copy, so keep one set per concurrent frame.
+    // The visible buffer follows the capacity of the instance store. With
+    // multi-draw-indirect the buckets of the draws are back to back and it
+    // holds each instance once. Otherwise every one of the mDrawCount draws
+    // has a bucket with room for all instances, bound at a fixed offset.
+    struct CullFrame {
+        VkBuffer visibleBuf{VK_NULL_HANDLE};
+        MemoryAllocator::Allocation visibleBufAlloc;
+        int visibleCapacity{0};
+        // Where the counting dispatch put each instance, one uint per
+        // instance. Read back by the dispatch that fills the buckets.
+        VkBuffer slotBuf{VK_NULL_HANDLE};
+        MemoryAllocator::Allocation slotBufAlloc;
+        VkBuffer indirectBuf{VK_NULL_HANDLE};
+        MemoryAllocator::Allocation indirectBufAlloc;
+        // What passed the occlusion test last time in this slot, one uint per
+        // instance. Only picks the occluders, so it does not need to be any newer.
+        VkBuffer visibilityBuf{VK_NULL_HANDLE};
+        MemoryAllocator::Allocation visibilityBufAlloc;
+        bool visibilityCleared{false};
+        VkDescriptorSet descriptorSet{VK_NULL_HANDLE};
+        uint32_t instanceStoreGeneration{0};
+        quint32 occlusionGeneration{0};
+    };
+    CullFrame mCullFrames[QVulkanWindow::MAX_CONCURRENT_FRAME_COUNT];
+    int mDrawCount{1};
+    int mFirstDraw[ItemMeshCount]{}; // the draw of each mesh's level 0, the other levels follow
+    // All draws in a single vkCmdDrawIndexedIndirect, otherwise one call per draw.
+    bool mMultiDrawIndirect{false};
+    // The most instances the buffers sized by the instance count can hold,
+    // see initResources(). More are not added.
+    int mMaxInstCount{0};
+    std::atomic<int> mPublishedMaxInstCount{INT_MAX}; // for addNew() on the GUI thread
+    // View depth per model unit of error that still looks the same on screen.
+    float mLodScale{0.0f};
+
+    //Device local, for the vertex and index buffers above
+    MemoryAllocator::Allocation mArenaVertexBufAlloc;
+    MemoryAllocator::Allocation mArenaIndexBufAlloc;
+    MemoryAllocator::Allocation mFloorVertexBufAlloc;
+
     VkBuffer mUniBuf{VK_NULL_HANDLE};           //For the uniforms in the Phong shader
+    MemoryAllocator::Allocation mUniBufAlloc;   //Host visible, mapped for as long as it exists
+
+    // The point lights, written every frame, and the clusters they are binned
+    // into on the GPU. One region per frame slot in each, like the uniforms.
+    VkBuffer mLightBuf{VK_NULL_HANDLE};
+    MemoryAllocator::Allocation mLightBufAlloc;     //Host visible
+    VkDeviceSize mLightRegionSize{0};
+    VkBuffer mClusterBuf{VK_NULL_HANDLE};
+    MemoryAllocator::Allocation mClusterBufAlloc;   //Device local
+    VkDeviceSize mClusterRegionSize{0};
+
+    VkCommandPool mOneShotCommandPool{VK_NULL_HANDLE};
+
+    struct ChunkCommands {
+        VkCommandPool pool{VK_NULL_HANDLE};
+        VkCommandBuffer cb{VK_NULL_HANDLE};
+    };
+    ChunkCommands mChunkCommands[QVulkanWindow::MAX_CONCURRENT_FRAME_COUNT][SceneChunkCount];
+    bool mCacheCommands{true};
+    bool mDepthPrepass{false};
+    bool mOcclusionCulling{true};
+    bool mSpecular{true};
+    int mItemVariant{ItemSpecular | ItemPointLights};
+    // VK_EXT_graphics_pipeline_library, decided when the device is created.
+    bool mPipelineLibraries{false};
+#ifdef VK_EXT_graphics_pipeline_library
+    VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT mPipelineLibraryFeatures{};
+#endif
+    // The chunks of a slot can be replayed when recorded at the current generation, 0 = not reusable.
+    quint64 mChunkCacheGeneration{1};
+    quint64 mChunkCacheRecorded[QVulkanWindow::MAX_CONCURRENT_FRAME_COUNT]{};
 
     VkPipelineCache mPipelineCache{VK_NULL_HANDLE};
-    QFuture<void> mPipelinesFuture;
+    QFuture<void> mPipelineCacheFuture;
 
-    QVector3D mLightPos;
+    QVector3D mLightPos; // the main light, no clustering for that one
     Camera mCam;
 
     QMatrix4x4 mProj;
     int mVpDirty{0};
     QMatrix4x4 mFloorModel;
 
+    // Each point light circles around a point of its own in the volume of the instances.
+    struct PointLight {
+        QVector3D center;
+        float orbitRadius;
+        float orbitSpeed; // radians per frame
+        float phase;
+        float radius;     // of influence, nothing beyond it
+        QVector3D color;
+    };
+    PointLight mLights[MAX_LIGHT_COUNT];
+    int mLightCount{DEFAULT_LIGHT_COUNT};
+    float mLightTime{0.0f}; // in frames, stands still while paused
+    // See updateRenderSize(), the first two for the fragment shader, the
+    // others for the light culling.
+    float mClusterTileScale[2]{};
+    float mClusterTileNdcSize[2]{};
+
+    bool mAdaptiveResolution{false};
+    QualityGovernor mGovernor;
+    // What the scene is rendered at this frame, the swapchain size unless the governor lowered it.
+    QSize mRenderSize;
+
     bool mAnimating{false};
-    float mRotation{0.0f};
 
     int mInstCount;
     int mPreparedInstCount{0};
+    SceneLoader mSceneLoader;
+    quint32 mSceneGeneration{0};
+    bool mLoadingScene{false}; // the instance count follows the loaded records until done
+    // What the GUI asked for on top while loading, added once the load is done.
+    int mLoadRequestBase{0};
+    int mQueuedInstCount{0};
+    QFuture<void> mSceneSaveFuture;
+    InstanceGenerator mInstanceGenerator;
     QByteArray mInstData;
-    VkBuffer mInstBuf{VK_NULL_HANDLE};
-    VkDeviceMemory mInstBufMem{VK_NULL_HANDLE};
+    // All the renderer's buffers live in its blocks, so it goes after them.
+    MemoryAllocator mAllocator;
+    TransferQueue mTransfer;
+    InstanceStore mInstances;
+
+    Profiler mProfiler;
+
+    // Computed by prepareFrame(), read while recording.
+    struct {
+        QMatrix4x4 vp;
+        QMatrix4x4 itemModel[ItemMeshCount]; // the model matrix with the dequantization of the vertex positions
+        float modelNormal[ItemMeshCount][12]; // std140 mat3
+        CullMesh cullMeshes[ItemMeshCount]; // firstDraw is left to buildCullCommands()
+        QVector3D eyePos;
+        QMatrix4x4 floorMvp;
+        float planes[6][4];
+        QMatrix4x4 view;
+        QVector4D viewDepth; // the row of the view matrix that gives -depth
+        float lights[MAX_LIGHT_COUNT][8]; // see lightcull.comp
+        int lightCount;
+    } mFrame;
+    bool mFramePrepared{false};
+    QFuture<void> mPrepareFuture;
 
     QFutureWatcher<void> mFrameWatcher;
     bool mFramePending{false};
+    bool mPrepareAhead{true};
+    QElapsedTimer mFrameTimer;
+    float mFrameWaitMs{0.0f};
+
+    // Written by the GUI thread, picked up by consumeInput(). The members
+    // above are only touched by the frame being built.
+    SpscQueue<InputEvent, 1024> mInput;
+    std::atomic<int> mDroppedInputCount{0};
+    std::atomic<int> mRequestedInstCount;
+    std::atomic<bool> mRequestedUseLogo{false};
+    std::atomic<bool> mRequestedMixedMeshes{false};
+    std::atomic<bool> mRequestedAnimating{false};
+    std::atomic<bool> mRequestedCacheCommands{true};
+    std::atomic<bool> mRequestedDepthPrepass{false};
+    std::atomic<bool> mRequestedOcclusionCulling{true};
+    std::atomic<int> mRequestedLightCount{DEFAULT_LIGHT_COUNT};
+    std::atomic<bool> mRequestedSpecular{true};
+    std::atomic<bool> mRequestedAdaptiveResolution{false};
+    QMutex mSceneSaveMutex;
+    QString mRequestedSceneSave; // picked up by prepareInstances()
 
-    QMutex mGuiMutex;
+    // Written at the end of ensureInstanceBuffer() for the GUI to read.
+    std::atomic<int> mPublishedCapacity{0};
+    std::atomic<VkDeviceSize> mPublishedBytesUsed{0};
+    std::atomic<VkDeviceSize> mPublishedBytesAllocated{0};
+    // Written by updateRenderSize().
+    std::atomic<float> mPublishedRenderScale{1.0f};
 };
 
 #endif
@@ -0,0 +1,187 @@
+#include "scenefile.h"
+#include "utilities.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QtConcurrentRun>
+#include <climits>
+#include <cstring>
+
+static const char SCENE_MAGIC[8] = { 'V', 'K', 'C', 'S', 'C', 'E', 'N', 'E' };
+static const quint32 SCENE_VERSION = 1;
+// Records per read, a few MB.
+static const qint64 SCENE_CHUNK_RECORDS = 65536;
+// Where the mesh byte is in a record, see utilities.h.
+static const int RECORD_MESH_OFFSET = 15;
+static const int MAX_MESH_NAME_LENGTH = 1024;
+
+// Followed by meshCount names, each a quint32 length and that many bytes of
+// UTF-8, then the records.
+struct SceneHeader {
+    char magic[8];
+    quint32 version;
+    quint32 recordSize;
+    quint32 meshCount;
+    quint32 reserved;
+    quint64 instanceCount;
+};
+
+bool writeSceneFile(const QString &fileName, const QByteArray &instData, const QStringList &meshNames)
+{
+    SceneHeader header{};
+    memcpy(header.magic, SCENE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_VERSION;
+    header.recordSize = quint32(PER_INSTANCE_DATA_SIZE);
+    header.meshCount = quint32(meshNames.size());
+    header.instanceCount = quint64(instData.size()) / PER_INSTANCE_DATA_SIZE;
+
+    QByteArray meshTable;
+    for (const QString &name : meshNames) {
+        const QByteArray utf8 = name.toUtf8();
+        const quint32 length = quint32(utf8.size());
+        meshTable.append(reinterpret_cast<const char *>(&length), sizeof(length));
+        meshTable.append(utf8);
+    }
+
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+    // Like the pipeline cache, a failure halfway leaves the old file alone.
+    // The records go out as they are, no copy of them is made.
+    QSaveFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly)
+            || f.write(reinterpret_cast<const char *>(&header), sizeof(header)) != qint64(sizeof(header))
+            || f.write(meshTable) != meshTable.size()
+            || f.write(instData) != instData.size()
+            || !f.commit()) {
+        qWarning("Failed to write scene %s", qPrintable(fileName));
+        return false;
+    }
+    return true;
+}
+
+SceneLoader::~SceneLoader()
+{
+    {
+        QMutexLocker locker(&mMutex);
+        ++mGeneration;
+    }
+    mFuture.waitForFinished();
+}
+
+bool SceneLoader::start(const QString &fileName, const QStringList &meshNames)
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly)) {
+        qWarning("Failed to open scene %s", qPrintable(fileName));
+        return false;
+    }
+
+    SceneHeader header;
+    if (f.read(reinterpret_cast<char *>(&header), sizeof(header)) != qint64(sizeof(header))
+            || memcmp(header.magic, SCENE_MAGIC, sizeof(header.magic))
+            || header.version != SCENE_VERSION
+            || header.recordSize != PER_INSTANCE_DATA_SIZE
+            || header.meshCount == 0 || header.meshCount > 256
+            || header.instanceCount > quint64(INT_MAX)) {
+        qWarning("%s is not a scene this version can load", qPrintable(fileName));
+        return false;
+    }
+
+    // Scene mesh to renderer mesh, for every value the mesh byte can have,
+    // anything beyond the table gets the first. Always applied, even with
+    // the renderer's own table the records must not index past it.
+    QByteArray meshMap(256, 0);
+    for (quint32 m = 0; m < header.meshCount; ++m) {
+        quint32 length;
+        if (f.read(reinterpret_cast<char *>(&length), sizeof(length)) != qint64(sizeof(length))
+                || length > quint32(MAX_MESH_NAME_LENGTH)) {
+            qWarning("Broken mesh table in scene %s", qPrintable(fileName));
+            return false;
+        }
+        const QString name = QString::fromUtf8(f.read(length));
+        const qsizetype index = meshNames.indexOf(name);
+        if (index < 0) {
+            qWarning("Scene %s uses the unknown mesh %s", qPrintable(fileName), qPrintable(name));
+            return false;
+        }
+        meshMap[m] = char(index);
+    }
+    for (int m = int(header.meshCount); m < 256; ++m)
+        meshMap[m] = meshMap[0];
+
+    const qint64 offset = f.pos();
+    const qint64 available = (f.size() - offset) / qint64(PER_INSTANCE_DATA_SIZE);
+    qint64 instanceCount = qint64(header.instanceCount);
+    if (available < instanceCount) {
+        qWarning("Scene %s is truncated, loading %lld of %lld instances", qPrintable(fileName),
+                 available, instanceCount);
+        instanceCount = available;
+    }
+    f.close();
+
+    quint32 generation;
+    {
+        QMutexLocker locker(&mMutex);
+        generation = ++mGeneration;
+        mPending.clear();
+        mDone = false;
+    }
+    // Stops at its next chunk, the generation changed.
+    mFuture.waitForFinished();
+    mFuture = QtConcurrent::run([this, fileName, offset, instanceCount, meshMap, generation] {
+        read(fileName, offset, instanceCount, meshMap, generation);
+    });
+    return true;
+}
+
+quint32 SceneLoader::generation() const
+{
+    QMutexLocker locker(&mMutex);
+    return mGeneration;
+}
+
+void SceneLoader::take(quint32 generation, QByteArray *dst, bool *finished)
+{
+    QByteArray records;
+    {
+        QMutexLocker locker(&mMutex);
+        if (generation != mGeneration) {
+            *finished = true;
+            return;
+        }
+        records.swap(mPending);
+        *finished = mDone;
+    }
+    dst->append(records);
+}
+
+void SceneLoader::read(const QString &fileName, qint64 offset, qint64 instanceCount, const QByteArray &meshMap,
+                       quint32 generation)
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly) || !f.seek(offset)) {
+        qWarning("Failed to read scene %s", qPrintable(fileName));
+        instanceCount = 0;
+    }
+
+    for (qint64 first = 0; first < instanceCount; first += SCENE_CHUNK_RECORDS) {
+        const qint64 count = qMin(SCENE_CHUNK_RECORDS, instanceCount - first);
+        QByteArray chunk = f.read(count * qint64(PER_INSTANCE_DATA_SIZE));
+        if (chunk.size() != count * qint64(PER_INSTANCE_DATA_SIZE)) {
+            qWarning("Failed to read scene %s after %lld instances", qPrintable(fileName), first);
+            break;
+        }
+        char *p = chunk.data() + RECORD_MESH_OFFSET;
+        for (qint64 i = 0; i < count; ++i, p += PER_INSTANCE_DATA_SIZE)
+            *p = meshMap[quint8(*p)];
+
+        QMutexLocker locker(&mMutex);
+        if (generation != mGeneration)
+            return;
+        mPending.append(chunk);
+    }
+
+    QMutexLocker locker(&mMutex);
+    if (generation == mGeneration)
+        mDone = true;
+}
@@ -0,0 +1,50 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include <QByteArray>
+#include <QFuture>
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+
+// A scene on disk: a header, the meshes the instances use by the name of
+// their file, then the instance records exactly as in the instance buffer,
+// PER_INSTANCE_DATA_SIZE bytes each. The mesh byte of a record indexes the
+// scene's mesh table, which the loader maps to the renderer's meshes. Native
+// byte order, the records are copied as they are.
+
+// Writes instData, which holds the records with the mesh byte indexing
+// meshNames. Slow for big scenes, meant for a worker thread.
+bool writeSceneFile(const QString &fileName, const QByteArray &instData, const QStringList &meshNames);
+
+// Streams a scene in on a worker thread, a chunk of records at a time. The
+// render thread takes what has arrived so far every frame, so the scene
+// shows up while it loads.
+class SceneLoader
+{
+public:
+    ~SceneLoader();
+
+    // GUI thread. Checks the header and the meshes right away and fails
+    // without touching anything when they are no good, otherwise the records
+    // of any previous load stop coming. meshNames are the renderer's meshes.
+    bool start(const QString &fileName, const QStringList &meshNames);
+
+    // Render thread. A new value means a new scene replaces the instances.
+    quint32 generation() const;
+    // Appends the records of the given load that arrived since the last
+    // call to dst. Sets finished once that load is done, failed or replaced.
+    void take(quint32 generation, QByteArray *dst, bool *finished);
+
+private:
+    void read(const QString &fileName, qint64 offset, qint64 instanceCount, const QByteArray &meshMap,
+              quint32 generation);
+
+    mutable QMutex mMutex;
+    quint32 mGeneration{0};
+    QByteArray mPending; // read, not taken yet
+    bool mDone{true};
+    QFuture<void> mFuture;
+};
+
+#endif
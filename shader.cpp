@@ -2,47 +2,68 @@
 // SPDX-License-Identifier: LicenseRef-Qt-Commercial OR BSD-3-Clause
 
 #include "shader.h"
-#include <QtConcurrentRun>
 #include <QFile>
+#include <QHash>
+#include <QMutex>
 #include <QVulkanDeviceFunctions>
 
 void Shader::load(QVulkanInstance *inst, VkDevice dev, const QString &fileName)
 {
     reset();
-    mMaybeRunning = true;
-    mFuture = QtConcurrent::run([inst, dev, fileName]() {
-        ShaderData sd;
-        QFile file(fileName);
-        if (!file.open(QIODevice::ReadOnly)) {
-            qWarning("Failed to open %s", qPrintable(fileName));
-            return sd;
-        }
-        QByteArray blob = file.readAll();
-        VkShaderModuleCreateInfo shaderInfo{};
-        shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-        shaderInfo.codeSize = blob.size();
-        shaderInfo.pCode = reinterpret_cast<const uint32_t *>(blob.constData());
-
-        VkResult err = inst->deviceFunctions(dev)->vkCreateShaderModule(dev, &shaderInfo, nullptr, &sd.shaderModule);
-        if (err != VK_SUCCESS) {
-            qWarning("Failed to create shader module: %d", err);
-            return sd;
-        }
-        return sd;
-    }
-    );
+    mInstance = inst;
+    mDevice = dev;
+    mFileName = fileName;
 }
 
 ShaderData *Shader::data()
 {
-    if (mMaybeRunning && !mData.isValid())
-        mData = mFuture.result();   //blocks and waits till mFuture is ready
+    if (mData.isValid() || mFileName.isEmpty())
+        return &mData;
+
+    // Tried once, a failure stays one.
+    const QByteArray blob = spirv(mFileName);
+    mFileName.clear();
+    if (blob.isEmpty())
+        return &mData;
+
+    VkShaderModuleCreateInfo shaderInfo{};
+    shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    shaderInfo.codeSize = blob.size();
+    shaderInfo.pCode = reinterpret_cast<const uint32_t *>(blob.constData());
+
+    VkResult err = mInstance->deviceFunctions(mDevice)->vkCreateShaderModule(mDevice, &shaderInfo, nullptr, &mData.shaderModule);
+    if (err != VK_SUCCESS)
+        qWarning("Failed to create shader module: %d", err);
 
     return &mData;
 }
 
 void Shader::reset()
 {
-    *data() = ShaderData();
-    mMaybeRunning = false;
+    mData = ShaderData();
+    mFileName.clear();
+}
+
+QByteArray Shader::spirv(const QString &fileName)
+{
+    static QMutex mutex;
+    static QHash<QString, QByteArray> cache;
+    {
+        QMutexLocker locker(&mutex);
+        const auto it = cache.constFind(fileName);
+        if (it != cache.cend())
+            return *it;
+    }
+
+    // Outside the lock, the pipeline workers read their shaders in parallel.
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning("Failed to open %s", qPrintable(fileName));
+        return QByteArray();
+    }
+    const QByteArray blob = file.readAll();
+
+    QMutexLocker locker(&mutex);
+    cache.insert(fileName, blob);
+    return blob;
 }
@@ -5,7 +5,8 @@
 #define SHADER_H
 
 #include <QVulkanInstance>
-#include <QFuture>
+#include <QByteArray>
+#include <QString>
 
 struct ShaderData
 {
@@ -16,14 +17,22 @@ struct ShaderData
 class Shader
 {
 public:
+    // Only remembers the file, the module is created by the first data(),
+    // on the thread that builds the pipeline needing it.
     void load(QVulkanInstance *inst, VkDevice dev, const QString & fileName);
     ShaderData *data();
-    bool isValid() { return data()->isValid(); }
+    // Whether the module has been created, does not create it.
+    bool isValid() const { return mData.isValid(); }
     void reset();
 
+    // The contents of a .spv, read once per process and kept for every
+    // device after. Thread-safe.
+    static QByteArray spirv(const QString &fileName);
+
 private:
-    bool mMaybeRunning{ false };
-    QFuture<ShaderData> mFuture;
+    QVulkanInstance *mInstance{ nullptr };
+    VkDevice mDevice{ VK_NULL_HANDLE };
+    QString mFileName; // until the module is created
     ShaderData mData;
 };
 
@@ -0,0 +1,213 @@
+#include "transferqueue.h"
+#include "vulkanwindow.h"
+#include "utilities.h"
+
+// Has to outlive the device creation, Qt only keeps the pointer.
+static const float TRANSFER_QUEUE_PRIORITY = 0.5f;
+
+void TransferQueue::preInit(VulkanWindow *w)
+{
+    mWindow = w;
+    mFamilyRequested = false;
+    mTimelineSemaphores = false;
+
+    w->setQueueCreateInfoModifier([this](const VkQueueFamilyProperties *props, uint32_t count,
+                                         QList<VkDeviceQueueCreateInfo> &createInfos) {
+        for (uint32_t i = 0; i < count; ++i) {
+            const VkQueueFlags flags = props[i].queueFlags;
+            if (!(flags & VK_QUEUE_TRANSFER_BIT) || (flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))
+                    || !props[i].queueCount)
+                continue;
+            bool taken = false;
+            for (const VkDeviceQueueCreateInfo &info : std::as_const(createInfos))
+                taken = taken || info.queueFamilyIndex == i;
+            if (taken)
+                continue;
+
+            VkDeviceQueueCreateInfo info{};
+            info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+            info.queueFamilyIndex = i;
+            info.queueCount = 1;
+            info.pQueuePriorities = &TRANSFER_QUEUE_PRIORITY;
+            createInfos.append(info);
+            mFamilyIndex = i;
+            mFamilyRequested = true;
+            return;
+        }
+    });
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 7, 0)
+// Qt has filled in what the device supports and enables all of it but
+// robustBufferAccess, so only look for timeline semaphores.
+void TransferQueue::checkFeatures(const VkPhysicalDeviceFeatures2 &features)
+{
+    for (auto *s = static_cast<const VkBaseInStructure *>(features.pNext); s; s = s->pNext) {
+        if (s->sType == VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES)
+            mTimelineSemaphores = reinterpret_cast<const VkPhysicalDeviceVulkan12Features *>(s)->timelineSemaphore;
+    }
+}
+#endif
+
+void TransferQueue::init(VulkanWindow *w, QVulkanDeviceFunctions *devFuncs)
+{
+    mWindow = w;
+    mDeviceFunctions = devFuncs;
+    mSubmitted = 0;
+    mGraphicsWaitValue.store(0, std::memory_order_relaxed);
+    mGraphicsWaitedValue = 0;
+
+    VkDevice dev = w->device();
+    if (mFamilyRequested && mTimelineSemaphores && w->physicalDeviceProperties()->apiVersion >= VK_API_VERSION_1_2) {
+        mGetSemaphoreCounterValue = reinterpret_cast<PFN_vkGetSemaphoreCounterValue>(
+                w->vulkanInstance()->functions()->vkGetDeviceProcAddr(dev, "vkGetSemaphoreCounterValue"));
+    }
+    if (!mGetSemaphoreCounterValue) {
+        if (DBG)
+            qDebug("Transfer queue: no, uploads go through the frame's command buffer");
+        return;
+    }
+    if (DBG)
+        qDebug("Transfer queue: family %u", mFamilyIndex);
+
+    mDeviceFunctions->vkGetDeviceQueue(dev, mFamilyIndex, 0, &mQueue);
+
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolInfo.queueFamilyIndex = mFamilyIndex;
+    VkResult err = mDeviceFunctions->vkCreateCommandPool(dev, &poolInfo, nullptr, &mCommandPool);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create transfer command pool: %d", err);
+
+    VkSemaphoreTypeCreateInfo typeInfo{};
+    typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    typeInfo.initialValue = 0;
+    VkSemaphoreCreateInfo semInfo{};
+    semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semInfo.pNext = &typeInfo;
+    err = mDeviceFunctions->vkCreateSemaphore(dev, &semInfo, nullptr, &mSemaphore);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to create timeline semaphore: %d", err);
+}
+
+void TransferQueue::releaseResources()
+{
+    if (!mQueue)
+        return;
+
+    VkDevice dev = mWindow->device();
+    mDeviceFunctions->vkQueueWaitIdle(mQueue);
+    for (const CommandBuffer &c : std::as_const(mCommandBuffers))
+        mDeviceFunctions->vkFreeCommandBuffers(dev, mCommandPool, 1, &c.cb);
+    mCommandBuffers.clear();
+    mDeviceFunctions->vkDestroyCommandPool(dev, mCommandPool, nullptr);
+    mCommandPool = VK_NULL_HANDLE;
+    mDeviceFunctions->vkDestroySemaphore(dev, mSemaphore, nullptr);
+    mSemaphore = VK_NULL_HANDLE;
+    mQueue = VK_NULL_HANDLE;
+    mGetSemaphoreCounterValue = nullptr;
+}
+
+// Command buffers are reused once the semaphore says they are done.
+VkCommandBuffer TransferQueue::begin()
+{
+    VkCommandBuffer cb = VK_NULL_HANDLE;
+    const quint64 done = completed();
+    for (CommandBuffer &c : mCommandBuffers) {
+        if (c.value <= done) {
+            c.value = UINT64_MAX; // until submitted
+            cb = c.cb;
+            mDeviceFunctions->vkResetCommandBuffer(cb, 0);
+            break;
+        }
+    }
+    if (!cb) {
+        VkCommandBufferAllocateInfo cbInfo{};
+        cbInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        cbInfo.commandPool = mCommandPool;
+        cbInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        cbInfo.commandBufferCount = 1;
+        VkResult err = mDeviceFunctions->vkAllocateCommandBuffers(mWindow->device(), &cbInfo, &cb);
+        if (err != VK_SUCCESS)
+            qFatal("Failed to allocate transfer command buffer: %d", err);
+        mCommandBuffers.append({ cb, UINT64_MAX });
+    }
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    mDeviceFunctions->vkBeginCommandBuffer(cb, &beginInfo);
+    return cb;
+}
+
+quint64 TransferQueue::submit(VkCommandBuffer cb)
+{
+    mDeviceFunctions->vkEndCommandBuffer(cb);
+
+    const quint64 value = mSubmitted + 1;
+    VkTimelineSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &value;
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cb;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &mSemaphore;
+    VkResult err = mDeviceFunctions->vkQueueSubmit(mQueue, 1, &submitInfo, VK_NULL_HANDLE);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to submit transfer: %d", err);
+
+    mSubmitted = value;
+    for (CommandBuffer &c : mCommandBuffers) {
+        if (c.cb == cb)
+            c.value = value;
+    }
+    return value;
+}
+
+quint64 TransferQueue::completed() const
+{
+    quint64 value = 0;
+    VkResult err = mGetSemaphoreCounterValue(mWindow->device(), mSemaphore, &value);
+    if (err != VK_SUCCESS)
+        qWarning("Failed to get the transfer semaphore value: %d", err);
+    return value;
+}
+
+void TransferQueue::requireGraphicsWait(quint64 value)
+{
+    quint64 current = mGraphicsWaitValue.load(std::memory_order_relaxed);
+    while (current < value && !mGraphicsWaitValue.compare_exchange_weak(current, value, std::memory_order_release))
+        ;
+}
+
+void TransferQueue::submitGraphicsWait()
+{
+    if (!mQueue)
+        return;
+    const quint64 value = mGraphicsWaitValue.load(std::memory_order_acquire);
+    if (value <= mGraphicsWaitedValue)
+        return;
+
+    // Anything that reads the uploads, including the copy into a bigger buffer.
+    const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    VkTimelineSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.waitSemaphoreValueCount = 1;
+    timelineInfo.pWaitSemaphoreValues = &value;
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.waitSemaphoreCount = 1;
+    submitInfo.pWaitSemaphores = &mSemaphore;
+    submitInfo.pWaitDstStageMask = &waitStage;
+    VkResult err = mDeviceFunctions->vkQueueSubmit(mWindow->graphicsQueue(), 1, &submitInfo, VK_NULL_HANDLE);
+    if (err != VK_SUCCESS)
+        qFatal("Failed to submit the wait for the transfers: %d", err);
+    mGraphicsWaitedValue = value;
+}
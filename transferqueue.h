@@ -0,0 +1,74 @@
+#ifndef TRANSFERQUEUE_H
+#define TRANSFERQUEUE_H
+
+#include <QVulkanWindow>
+#include <QVulkanFunctions>
+#include <QList>
+#include <atomic>
+
+class VulkanWindow;
+
+// A queue of a family that does transfers only, for uploads that do not have
+// to wait for the frame they are recorded in. Every submission signals the
+// next value of a timeline semaphore. The render thread polls it to know what
+// has landed, the graphics queue waits for it before frames that read what
+// was uploaded.
+//
+// Needs a device with such a family, Vulkan 1.2 timeline semaphores and Qt
+// 6.7 to enable them. Without, isActive() is false and the uploads stay in
+// the frame's command buffer.
+class TransferQueue
+{
+public:
+    // From Renderer::preInitResources(), before the device is created. Asks
+    // for the queue.
+    void preInit(VulkanWindow *w);
+#if QT_VERSION >= QT_VERSION_CHECK(6, 7, 0)
+    // From the enabled features modifier the renderer sets, checks for the feature.
+    void checkFeatures(const VkPhysicalDeviceFeatures2 &features);
+#endif
+    void init(VulkanWindow *w, QVulkanDeviceFunctions *devFuncs);
+    // Waits for everything submitted.
+    void releaseResources();
+
+    bool isActive() const { return mQueue != VK_NULL_HANDLE; }
+    uint32_t familyIndex() const { return mFamilyIndex; }
+
+    // Render thread. A command buffer to record into, then submit() it.
+    VkCommandBuffer begin();
+    // Returns the value the semaphore has once the commands are done.
+    quint64 submit(VkCommandBuffer cb);
+    quint64 lastSubmitted() const { return mSubmitted; }
+    quint64 completed() const;
+
+    // Render thread. The next frame handed to the graphics queue must not
+    // start before value.
+    void requireGraphicsWait(quint64 value);
+    // GUI thread, right before QVulkanWindow::frameReady(). A submission of
+    // nothing but the wait, which holds up everything submitted after it too.
+    void submitGraphicsWait();
+
+private:
+    struct CommandBuffer {
+        VkCommandBuffer cb;
+        quint64 value; // done once the semaphore reaches it
+    };
+
+    VulkanWindow *mWindow{nullptr};
+    QVulkanDeviceFunctions *mDeviceFunctions{nullptr};
+    PFN_vkGetSemaphoreCounterValue mGetSemaphoreCounterValue{nullptr};
+
+    uint32_t mFamilyIndex{0};
+    bool mFamilyRequested{false};
+    bool mTimelineSemaphores{false};
+    VkQueue mQueue{VK_NULL_HANDLE};
+    VkCommandPool mCommandPool{VK_NULL_HANDLE};
+    VkSemaphore mSemaphore{VK_NULL_HANDLE};
+    QList<CommandBuffer> mCommandBuffers;
+    quint64 mSubmitted{0};
+
+    std::atomic<quint64> mGraphicsWaitValue{0};
+    quint64 mGraphicsWaitedValue{0}; // GUI thread only
+};
+
+#endif
@@ -0,0 +1,18 @@
+#version 440
+
+layout(location = 0) in vec2 vUV;
+
+// The scene at reduced resolution, in the top left corner of the target.
+layout(binding = 0) uniform sampler2D scene;
+
+layout(push_constant) uniform PC {
+    vec2 uvScale;   // the rendered part of the target
+    vec2 uvMax;     // half a texel inside it, the filter must not reach the rest
+} pc;
+
+layout(location = 0) out vec4 fragColor;
+
+void main()
+{
+    fragColor = vec4(texture(scene, min(vUV * pc.uvScale, pc.uvMax)).rgb, 1.0);
+}
@@ -1,6 +1,7 @@
 #ifndef UTILITIES_H
 #define UTILITIES_H
 
+#include <QVulkanWindow>
 #include <QVulkanFunctions>
 
 static float quadVert[] = { // Y up, front = CW
@@ -12,12 +13,57 @@ static float quadVert[] = { // Y up, front = CW
 
 #define DBG Q_UNLIKELY(mWindow->isDebugEnabled())
 
-const int MAX_INSTANCES = 16384;
-const VkDeviceSize PER_INSTANCE_DATA_SIZE = 6 * sizeof(float); // instTranslate, instDiffuseAdjust
+// How far off on screen, in pixels, a simplified level of the mesh may be where it is used.
+const float LOD_ERROR_PIXELS = 2.0f;
+
+const int INITIAL_INSTANCE_CAPACITY = 16384; // the instance store grows beyond this when needed
+// instTranslate as 3 floats, instDiffuseAdjust as 3x 8 bit snorm, the mesh as 8 bit uint,
+// then the rotation as 4x 16 bit snorm, the spin as 3x 8 bit snorm, the scale as 8 bit unorm and the angle as a float
+const VkDeviceSize PER_INSTANCE_DATA_SIZE = 8 * sizeof(float);
+// What the 8 bit spin speed and scale of an instance stand for, same as in the shaders.
+const float INSTANCE_MAX_SPIN = 0.03f; // radians per frame
+const float INSTANCE_MAX_SCALE = 2.0f;
+const VkDeviceSize INSTANCE_STAGING_RING_SIZE = 16 * 1024 * 1024; // shared by the frames in flight
+
+// The light clusters: tiles on screen, times exponentially spaced slices in
+// depth between CLUSTER_NEAR and CLUSTER_FAR. Same as in the shaders.
+const int CLUSTER_X = 16;
+const int CLUSTER_Y = 9;
+const int CLUSTER_Z = 24;
+const int CLUSTER_COUNT = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+const int MAX_LIGHTS_PER_CLUSTER = 63; // plus the count makes 256 bytes per cluster
+const float CLUSTER_NEAR = 1.0f;
+const float CLUSTER_FAR = 100.0f;
+const int MAX_LIGHT_COUNT = 1024;
+const int DEFAULT_LIGHT_COUNT = 256;
+// The position and radius, then the color, as 2x vec4
+const VkDeviceSize PER_LIGHT_DATA_SIZE = 8 * sizeof(float);
+
+// The occlusion culling draws its occluders at the render resolution, level
+// 0 of the pyramid is half of that rounded up to powers of two. Down to 1x1
+// for windows up to 16384 pixels wide, larger boxes are never culled.
+const int HIZ_MAX_LEVELS = 14;
 
 static inline VkDeviceSize aligned(VkDeviceSize v, VkDeviceSize byteAlign)
 {
     return (v + byteAlign - 1) & ~(byteAlign - 1);
 }
 
+// Makes the host writes to [offset, offset + size) of a persistently mapped,
+// non-coherent allocation visible. The range is widened to nonCoherentAtomSize.
+static inline void flushMappedRange(QVulkanWindow *w, VkDeviceMemory mem, VkDeviceSize memSize,
+                                    VkDeviceSize offset, VkDeviceSize size)
+{
+    const VkDeviceSize atomSize = w->physicalDeviceProperties()->limits.nonCoherentAtomSize;
+    VkMappedMemoryRange range{};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = mem;
+    range.offset = offset & ~(atomSize - 1);
+    const VkDeviceSize end = aligned(offset + size, atomSize);
+    range.size = end < memSize ? end - range.offset : VK_WHOLE_SIZE;
+    VkResult err = w->vulkanInstance()->deviceFunctions(w->device())->vkFlushMappedMemoryRanges(w->device(), 1, &range);
+    if (err != VK_SUCCESS)
+        qWarning("Failed to flush mapped memory: %d", err);
+}
+
 #endif // UTILITIES_H
@@ -5,6 +5,7 @@
 #include "renderer.h"
 #include <QMouseEvent>
 #include <QKeyEvent>
+#include <QRandomGenerator>
 
 VulkanWindow::VulkanWindow(bool dbg)
     : mDebug(dbg)
@@ -13,7 +14,9 @@ VulkanWindow::VulkanWindow(bool dbg)
 
 QVulkanWindowRenderer *VulkanWindow::createRenderer()
 {
-    mRenderer = new Renderer(this, 128);
+    mRenderer = new Renderer(this, 128, mFixedSeed ? mSeed : QRandomGenerator::global()->generate());
+    if (!mSceneFile.isEmpty())
+        mRenderer->loadScene(mSceneFile);
     return mRenderer;
 }
 
@@ -32,6 +35,46 @@ void VulkanWindow::meshSwitched(bool enable)
     mRenderer->setUseLogo(enable);
 }
 
+void VulkanWindow::mixedMeshesSwitched(bool enable)
+{
+    mRenderer->setMixedMeshes(enable);
+}
+
+void VulkanWindow::commandCachingSwitched(bool enable)
+{
+    mRenderer->setCommandCaching(enable);
+}
+
+void VulkanWindow::depthPrepassSwitched(bool enable)
+{
+    mRenderer->setDepthPrepass(enable);
+}
+
+void VulkanWindow::lightCountChanged(int count)
+{
+    mRenderer->setLightCount(count);
+}
+
+void VulkanWindow::specularSwitched(bool enable)
+{
+    mRenderer->setSpecular(enable);
+}
+
+void VulkanWindow::adaptiveResolutionSwitched(bool enable)
+{
+    mRenderer->setAdaptiveResolution(enable);
+}
+
+void VulkanWindow::occlusionCullingSwitched(bool enable)
+{
+    mRenderer->setOcclusionCulling(enable);
+}
+
+void VulkanWindow::prepareAheadSwitched(bool enable)
+{
+    mRenderer->setPrepareAhead(enable);
+}
+
 void VulkanWindow::mousePressEvent(QMouseEvent *e)
 {
     mPressed = true;
@@ -85,3 +128,64 @@ int VulkanWindow::instanceCount() const
 {
     return mRenderer->instanceCount();
 }
+
+void VulkanWindow::setInstanceCount(int count)
+{
+    mRenderer->setInstanceCount(count);
+}
+
+int VulkanWindow::instanceCapacity() const
+{
+    return mRenderer ? mRenderer->instanceCapacity() : 0;
+}
+
+int VulkanWindow::maxInstanceCount() const
+{
+    return mRenderer ? mRenderer->maxInstanceCount() : INT_MAX;
+}
+
+qint64 VulkanWindow::instanceBytesUsed() const
+{
+    return mRenderer ? qint64(mRenderer->instanceBytesUsed()) : 0;
+}
+
+qint64 VulkanWindow::instanceBytesAllocated() const
+{
+    return mRenderer ? qint64(mRenderer->instanceBytesAllocated()) : 0;
+}
+
+float VulkanWindow::frameWaitMs() const
+{
+    return mRenderer ? mRenderer->frameWaitMs() : 0.0f;
+}
+
+float VulkanWindow::renderScale() const
+{
+    return mRenderer ? mRenderer->renderScale() : 1.0f;
+}
+
+int VulkanWindow::droppedInputCount() const
+{
+    return mRenderer ? mRenderer->droppedInputCount() : 0;
+}
+
+QString VulkanWindow::profileSummary() const
+{
+    return mRenderer ? mRenderer->profiler()->summary() : QString();
+}
+
+bool VulkanWindow::exportProfile(const QString &fileName) const
+{
+    return mRenderer && mRenderer->profiler()->exportCsv(fileName);
+}
+
+bool VulkanWindow::loadScene(const QString &fileName)
+{
+    return mRenderer && mRenderer->loadScene(fileName);
+}
+
+void VulkanWindow::saveScene(const QString &fileName)
+{
+    if (mRenderer)
+        mRenderer->saveScene(fileName);
+}
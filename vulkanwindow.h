@@ -5,6 +5,7 @@
 #define VULKANWINDOW_H
 
 #include <QVulkanWindow>
+#include <functional>
 
 class Renderer;
 
@@ -16,12 +17,42 @@ public:
     QVulkanWindowRenderer *createRenderer() override;
 
     bool isDebugEnabled() const { return mDebug; }
+
+    // Before the window is shown. Instance data is random unless a seed is set.
+    void setRandomSeed(quint32 seed) { mSeed = seed; mFixedSeed = true; }
+    // Before the window is shown. Starts with the instances of a scene file instead.
+    void setSceneFile(const QString &fileName) { mSceneFile = fileName; }
+    // Called on the GUI thread after every frame was handed to the window.
+    void setFrameCallback(const std::function<void()> &callback) { mFrameCallback = callback; }
+    void frameSubmitted() { if (mFrameCallback) mFrameCallback(); }
+
+    Renderer *renderer() const { return mRenderer; }
     int instanceCount() const;
+    void setInstanceCount(int count);
+    int instanceCapacity() const;
+    int maxInstanceCount() const;
+    qint64 instanceBytesUsed() const;
+    qint64 instanceBytesAllocated() const;
+    float frameWaitMs() const;
+    float renderScale() const;
+    int droppedInputCount() const;
+    QString profileSummary() const;
+    bool exportProfile(const QString &fileName) const;
+    bool loadScene(const QString &fileName);
+    void saveScene(const QString &fileName);
 
 public slots:
     void addNew();
     void togglePaused();
     void meshSwitched(bool enable);
+    void mixedMeshesSwitched(bool enable);
+    void commandCachingSwitched(bool enable);
+    void depthPrepassSwitched(bool enable);
+    void lightCountChanged(int count);
+    void specularSwitched(bool enable);
+    void adaptiveResolutionSwitched(bool enable);
+    void occlusionCullingSwitched(bool enable);
+    void prepareAheadSwitched(bool enable);
 
 private:
     void mousePressEvent(QMouseEvent *) override;
@@ -30,6 +61,10 @@ private:
     void keyPressEvent(QKeyEvent *) override;
 
     bool mDebug;
+    bool mFixedSeed{false};
+    quint32 mSeed{0};
+    QString mSceneFile;
+    std::function<void()> mFrameCallback;
     Renderer* mRenderer{nullptr};
     bool mPressed{false};
     QPoint mLastPos;